@@ -11,10 +11,14 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#ifndef CPU
 #include <curand_kernel.h>
+#endif
 #define MAIN
 #include "asteroid.h"
 
+BEGIN_VARIANT
+
 int main (int argc,char **argv)
 {
     FILE *fp;
@@ -64,6 +68,21 @@ int main (int argc,char **argv)
     int has_delta_V = 0;
     CHI_FLOAT delta_V = 0.0;
     #endif
+    #ifdef DP45
+    double tol = DP45_TOL;
+    #endif
+    double T_bench = 0.0;
+    int lm = 0;
+    int j_island = -1;
+    int j_ckpt = -1;
+    char *cache_dir = NULL;
+    int resume = 0;
+    int start = START_RANDOM;
+    int format = FORMAT_TEXT;
+    int j_convert = -1;
+    int N_pipe1 = 0, K_pipe = 0, N_pipe2 = 0;
+    int j_batch = -1, N_batch_cores = 0;
+    int j_plotall = -1;
     
     #ifdef ONE_LE
     int const LE = 1;
@@ -173,27 +192,54 @@ int main (int argc,char **argv)
     if (argc == 1)
     {
         printf("\n Command line arguments:\n\n");
+        printf("-batch manifest Ncores : run all the jobs (\"name priority directory arguments...\" lines) of the manifest on a shared pool of Ncores cores (0: all)\n");
         printf("-best : only keep the best result\n");
+        #ifdef CPU
+        printf("-bench seconds : benchmark (chi2 evaluations and simplex steps per second, as a JSON line) for the data and the optional -m model\n");
+        #endif
         #ifdef MINIMA_TEST
 //        printf("-delta_V value : delta_V value, only in MINIMA_TEST mode\n");
         #endif
         #ifdef RMSD
         printf("-dx value : maximum shift for parameters in scale-free units (0...1)\n");
         #endif
+        printf("-cache dir : keep the preprocessed data in a binary file in directory \"dir\", memory-mapped by the next runs with the same inputs\n");
+        #ifndef RMSD
+        printf("-convert name : convert the binary results file \"name\" (-format binary) to the text results file given with -o, and exit\n");
+        #endif
+        printf("-ckpt name : save a checkpoint of the run to file \"name\" after every cycle\n");
         printf("-f type_constant value: forces the parameter with the type_constant to be frozen during optimization at \"value\" \n");
+        #ifndef RMSD
+        printf("-format text|binary : format of the results file (default text; binary: compact records, see -convert)\n");
+        #endif
         printf("-i name : input (data) file name\n");
+        #ifndef RMSD
+        printf("-island name : island model; the runs with the same name (on the same node) share their best models via shared memory\n");
+        #endif
         #ifdef ANIMATE        
         printf("-i1 index : index of the first snapshot\n");
         printf("-i2 index : index of the last snapshot minus one\n");
         #endif
         printf("-keep : keep all intermediate results, not just the best ones\n");
         printf("-l type_constant limit1 limit2 : specify range for the parameter type_constant\n");
+        #ifdef CPU
+        printf("-lm : Levenberg-Marquardt refinement of the -m model; writes the refined model and its covariance matrix (-o name, name.cov)\n");
+        #endif
         printf("-m param1 param2 ... paramN : input model parameters, for plotting and re-optimization\n");
         printf("     If one of the parameters has a special value of \"v\", it is allowed to vary randomly within its full range.\n");
         printf("-N number : exit after \"number\" cycles\n");
         printf("-Nstages number : each initial optimization stage is followed by \"number-1\" reoptimization stages\n");
         printf("-o name : output (results) file name\n");        
+        #ifdef CPU
+        printf("-opt simplex|de : optimizer for the initial optimization stage: independent simplex runs (default), or differential evolution\n");
+        #endif
+        #ifndef RMSD
+        printf("-pipeline N1 K N2 : Stage One (N1 cycles), Stage Two (reoptimization of the K best diverse models, N2 cycles) and Stage Three (CPU build: LM polishing) in one run\n");
+        #endif
         printf("-plot : plotting (only makes sense when -m is also used)\n");
+        #if !defined(ANIMATE) && !defined(MINIMA_TEST)
+        printf("-plotall results output : plotting and scoring all the models of the text results file, into the binary file output\n");
+        #endif
         #if defined(P_PHI) || defined(P_BOTH)
         printf("-Pphi min max : minimum and maximum values for Pphi period, in hours\n");
         #endif
@@ -201,8 +247,18 @@ int main (int argc,char **argv)
         printf("-Ppsi min max : minimum and maximum values for Ppsi period, in hours\n");
         #endif
         printf("-reopt : reoptimize the model provided with -m switch\n");
+        printf("-resume : continue the run from the -ckpt checkpoint file (same build and arguments)\n");
         printf("-seed SEED : use the SEED number to initialize the random number generator\n");
+        #ifndef RMSD
+        printf("-start random|halton : starting points of the random search (default random; halton: scrambled Halton sequence)\n");
+        #endif
+        #ifdef CPU
+        printf("-surrogate : screen the random starts with a surrogate model of the simplex results (CPU build)\n");
+        #endif
         printf("-t : travelling reoptimization\n");
+        #ifdef DP45
+        printf("-tol value : absolute error tolerance per step for the adaptive ODE integrator (default %.1e)\n", DP45_TOL);
+        #endif
         printf("\n");
         exit(0);
     }
@@ -335,6 +391,18 @@ int main (int argc,char **argv)
                 break;
         }
 
+        #if !defined(ANIMATE) && !defined(MINIMA_TEST)
+        // plotting all the models of a results file:
+        if (strcmp(argv[j], "-plotall") == 0)
+        {
+            j_plotall = j + 1;
+            Nplot = NPLOT;
+            j = j + 3;
+            if (j >= argc)
+                break;
+        }
+        #endif
+
         // traveling reoptimization:
         if (strcmp(argv[j], "-t") == 0)
         {
@@ -376,6 +444,99 @@ int main (int argc,char **argv)
                 break;
         }
 
+        if (strcmp(argv[j], "-batch") == 0)
+        {
+            j_batch = j + 1;
+            N_batch_cores = atoi(argv[j+2]);
+            j = j + 3;
+            if (j >= argc)
+                break;
+        }
+
+        if (strcmp(argv[j], "-cache") == 0)
+        {
+            cache_dir = argv[j+1];
+            j = j + 2;
+            if (j >= argc)
+                break;
+        }
+
+        if (strcmp(argv[j], "-ckpt") == 0)
+        {
+            j_ckpt = j + 1;
+            j = j + 2;
+            if (j >= argc)
+                break;
+        }
+
+        if (strcmp(argv[j], "-resume") == 0)
+        {
+            resume = 1;
+            j = j + 1;
+            if (j >= argc)
+                break;
+        }
+
+        #ifndef RMSD
+        if (strcmp(argv[j], "-start") == 0)
+        {
+            if (strcmp(argv[j+1], "random") == 0)
+                start = START_RANDOM;
+            else if (strcmp(argv[j+1], "halton") == 0)
+                start = START_HALTON;
+            else
+            {
+                printf("Unknown starting points type: %s (should be random or halton)\n", argv[j+1]);
+                exit(1);
+            }
+            j = j + 2;
+            if (j >= argc)
+                break;
+        }
+
+        if (strcmp(argv[j], "-format") == 0)
+        {
+            if (strcmp(argv[j+1], "text") == 0)
+                format = FORMAT_TEXT;
+            else if (strcmp(argv[j+1], "binary") == 0)
+                format = FORMAT_BINARY;
+            else
+            {
+                printf("Unknown results file format: %s (should be text or binary)\n", argv[j+1]);
+                exit(1);
+            }
+            j = j + 2;
+            if (j >= argc)
+                break;
+        }
+
+        if (strcmp(argv[j], "-convert") == 0)
+        {
+            j_convert = j + 1;
+            j = j + 2;
+            if (j >= argc)
+                break;
+        }
+
+        if (strcmp(argv[j], "-pipeline") == 0)
+        {
+            N_pipe1 = atoi(argv[j+1]);
+            K_pipe = atoi(argv[j+2]);
+            N_pipe2 = atoi(argv[j+3]);
+            j = j + 4;
+            if (j >= argc)
+                break;
+        }
+
+        if (strcmp(argv[j], "-island") == 0)
+        {
+            j_island = j + 1;
+            j = j + 2;
+            if (j >= argc)
+                break;
+        }
+        #endif
+
         if (strcmp(argv[j], "-N") == 0)
         {
             Ncases = atoi(argv[j+1]);
@@ -392,6 +553,58 @@ int main (int argc,char **argv)
                 break;
         }
 
+        #ifdef CPU
+        if (strcmp(argv[j], "-bench") == 0)
+        {
+            T_bench = atof(argv[j+1]);
+            j = j + 2;
+            if (j >= argc)
+                break;
+        }
+
+        if (strcmp(argv[j], "-lm") == 0)
+        {
+            lm = 1;
+            j = j + 1;
+            if (j >= argc)
+                break;
+        }
+
+        if (strcmp(argv[j], "-surrogate") == 0)
+        {
+            h_surrogate = 1;
+            j = j + 1;
+            if (j >= argc)
+                break;
+        }
+
+        if (strcmp(argv[j], "-opt") == 0)
+        {
+            if (strcmp(argv[j+1], "simplex") == 0)
+                h_optimizer = OPT_SIMPLEX;
+            else if (strcmp(argv[j+1], "de") == 0)
+                h_optimizer = OPT_DE;
+            else
+            {
+                printf("Unknown optimizer: %s (should be simplex or de)\n", argv[j+1]);
+                exit(1);
+            }
+            j = j + 2;
+            if (j >= argc)
+                break;
+        }
+        #endif
+
+        #ifdef DP45
+        if (strcmp(argv[j], "-tol") == 0)
+        {
+            tol = atof(argv[j+1]);
+            j = j + 2;
+            if (j >= argc)
+                break;
+        }
+        #endif
+
         // Frozen parameter constant and the value
         if (strcmp(argv[j], "-f") == 0)
         {
@@ -430,19 +643,68 @@ int main (int argc,char **argv)
         
     }  // while argc loop
     
+    if (j_batch > 0)
+        return batch_run(argv[j_batch], N_batch_cores);
+    #ifndef RMSD
+    if (j_convert > 0)
+    {
+        if (j_results == -1)
+        {
+            printf("-convert switch requires -o switch!\n");
+            exit(1);
+        }
+        return reslog_convert(argv[j_convert], argv[j_results]);
+    }
+    #endif
     if (j_input == -1)
       {
           printf("-i parameter is missing!\n");
           exit(1);
       }
-    if ((reopt || Nplot>0) && !model)
+    if ((reopt || (Nplot>0 && j_plotall==-1) || lm) && !model)
+    {
+        printf("-reopt, -plot and -lm switches require -m switch!\n");
+        exit(1);
+    }
+    if (reopt==0 & Nplot==0 && model && T_bench==0.0 && !lm)
+    {
+        printf("-m can only be used together with -reopt, -plot, -lm or -bench switches!\n");
+        exit(1);
+    }
+    if (lm && j_results == -1)
+    {
+        printf("-lm switch requires -o switch!\n");
+        exit(1);
+    }
+    #ifdef CPU
+    if (h_surrogate && h_optimizer == OPT_DE)
     {
-        printf("-reopt and -plot switches require -m switch!\n");
+        printf("-surrogate can only be used with the simplex optimizer (-opt simplex)!\n");
         exit(1);
     }
-    if (reopt==0 & Nplot==0 && model)
+    #endif
+    if (resume && j_ckpt == -1)
+    {
+        printf("-resume switch requires -ckpt switch!\n");
+        exit(1);
+    }
+    if (K_pipe != 0)
+    {
+        if (N_pipe1 < 1 || N_pipe2 < 0 || K_pipe < 1 || K_pipe > PIPE_ELITE || K_pipe > N_BLOCKS)
+        {
+            printf("-pipeline N1 K N2: N1 >= 1, N2 >= 0, and 1 <= K <= %d are required!\n", PIPE_ELITE < N_BLOCKS? PIPE_ELITE : N_BLOCKS);
+            exit(1);
+        }
+        if (model || j_island > 0 || j_ckpt > 0)
+        {
+            printf("-pipeline can't be used with -m, -reopt, -island or -ckpt switches!\n");
+            exit(1);
+        }
+        Ncases = N_pipe1 + N_pipe2;
+    }
+    if (resume && start != START_RANDOM && seed == 0 && j_island == -1)
     {
-        printf("-m can only be used together with -reopt or -plot switches!\n");
+        printf("-resume with -start halton requires -seed or -island switch (the scrambling must be the same)!\n");
         exit(1);
     }
     #ifdef MINIMA_TEST        
@@ -463,7 +725,7 @@ int main (int argc,char **argv)
     Is_GPU_present();
     
     // Reading all input data files, allocating and initializing observational data arrays   
-    read_data(argv[j_input], &N_data, &N_filters, Nplot);
+    read_data_cached(cache_dir, argv[j_input], &N_data, &N_filters, Nplot);
     
     int N_threads = N_BLOCKS * BSIZE;
     
@@ -604,10 +866,32 @@ int main (int argc,char **argv)
     ERR(cudaMemcpyToSymbol(dTypes, Types, N_TYPES*N_SEG*sizeof(int), 0, cudaMemcpyHostToDevice));                
     ERR(cudaMemcpyToSymbol(dLimits, hLimits, 2*N_TYPES*sizeof(CHI_FLOAT), 0, cudaMemcpyHostToDevice));                
     ERR(cudaMemcpyToSymbol(d_x2_params, &x2_params, sizeof(struct x2_struct), 0, cudaMemcpyHostToDevice));                
+    #ifdef DP45
+    ERR(cudaMemcpyToSymbol(d_tol, &tol, sizeof(double), 0, cudaMemcpyHostToDevice));
+    #endif
     
     #ifdef NUDGE
     prepare_chi2_params(&N_data);
     #endif
+    
+    #ifdef CPU
+    if (T_bench > 0.0)
+        return bench(argv[j_input], N_data, N_filters, params, model, T_bench, seed);
+    #if !defined(NUDGE) && !defined(MIN_DV) && !defined(RMSD)
+    if (lm)
+        return lm_refine(params, N_data, N_filters, argv[j_results], NULL, NULL);
+    #else
+    if (lm)
+    {
+        printf("-lm is not available with NUDGE, MIN_DV or RMSD (chi2 is not a pure least squares sum)\n");
+        exit(1);
+    }
+    #endif
+    #endif
+    #if !defined(ANIMATE) && !defined(MINIMA_TEST)
+    if (j_plotall > 0)
+        return bulk_plot(argv[j_plotall], argv[j_plotall+1], N_data, N_filters, Nplot, Property);
+    #endif
    
     
     if (Nplot == 0)                
@@ -626,18 +910,42 @@ int main (int argc,char **argv)
         curandState* d_states;
         ERR(cudaMalloc ( &d_states, N_BLOCKS*BSIZE*sizeof( curandState ) ));
         // setup seeds, initialize d_f
+        #ifdef CPU
+        if (seed == 0)
+            setup_cpu ( d_states, (unsigned long)(time(NULL)), d_f, 1);
+        else
+            setup_cpu ( d_states, seed, d_f, 1);
+        #else
         if (seed == 0)
             // seed=0 when no seed was provided on the command line; using time to randomize it:
             setup_kernel <<< N_BLOCKS, BSIZE >>> ( d_states, (unsigned long)(time(NULL)), d_f, 1);
         else
             // Otherwise use the explicitely provided value of seed (good for post-processing, profiling and debugging):
             setup_kernel <<< N_BLOCKS, BSIZE >>> ( d_states, seed, d_f, 1);
+        #endif
         
         if (reopt)
             ERR(cudaMemcpyToSymbol(d_params0, params, N_PARAMS*sizeof(double), 0, cudaMemcpyHostToDevice));
         
         ERR(cudaDeviceSynchronize());    
         
+        #ifndef RMSD
+        int island_id = -1;
+        if (j_island > 0)
+            island_id = island_open(argv[j_island]);
+        // Scrambling of the Halton starting points: the same for all the islands of a group (derived from the group name)
+        unsigned long qmc_seed = seed != 0? seed : (unsigned long)(time(NULL));
+        if (j_island > 0)
+        {
+            qmc_seed = 14695981039346656037UL;
+            for (char *c=argv[j_island]; *c; c++)
+                qmc_seed = (qmc_seed ^ (unsigned char)*c) * 1099511628211UL;
+        }
+        qmc_init(start, qmc_seed, island_id);
+        if (K_pipe > 0)
+            pipeline_init(K_pipe, hLimits, Property);
+        #endif
+
         int loop_counter = 0;
         
         #ifdef RMSD
@@ -648,7 +956,25 @@ int main (int argc,char **argv)
             PAR_max[j] = -1e30;
         }
         printf("\n");
-        fp = fopen(argv[j_results], "w");
+        #endif
+
+        if (resume)
+        {
+            #ifdef RMSD
+            loop_counter = ckpt_load(argv[j_ckpt], argv[j_results], N_data, d_states, params, PAR_min, PAR_max);
+            #else
+            loop_counter = ckpt_load(argv[j_ckpt], argv[j_results], N_data, d_states, params, NULL, NULL);
+            #endif
+            if (reopt)
+                // The starting point could have moved (-t):
+                ERR(cudaMemcpyToSymbol(d_params0, params, N_PARAMS*sizeof(double), 0, cudaMemcpyHostToDevice));
+        }
+
+        #ifdef RMSD
+        fp = fopen(argv[j_results], resume? "a":"w");
+        #else
+        // The results file is written by a separate thread (reslog.c):
+        reslog_open(argv[j_results], format, keep, N_filters);
         #endif
         
         // Infinite loop
@@ -657,31 +983,57 @@ int main (int argc,char **argv)
             loop_counter++;
             
             #ifdef TIMING        
+            #ifdef CPU
+            struct timeval  t_start, t_stop;
+            double elapsed;
+            gettimeofday (&t_start, NULL);
+            #else
             cudaEvent_t start, stop;
             float elapsed;
             cudaEventCreate(&start);
             cudaEventCreate(&stop);
             cudaEventRecord(start, 0);
+            #endif
             #endif        
             
             #ifdef DEBUG2
             debug_kernel<<<1, 1>>>(params, dData, N_data, N_filters);
             #endif        
             
+            #ifndef RMSD
+            if (start != START_RANDOM)
+                // Index of the first starting point of this cycle:
+                qmc_cycle(loop_counter);
+            #endif
+
             // The kernel:
+            #ifdef CPU
+            #ifdef RMSD
+            chi2_cpu_rms(dData, N_data, N_filters, reopt, Nstages, d_states, d_f, d_params, d_dV, dx_rand, dpar_min, dpar_max);
+            #else
+            chi2_cpu(dData, N_data, N_filters, reopt, Nstages, d_states, d_f, d_params, d_dV);
+            #endif
+            #else
             #ifdef RMSD
-            chi2_gpu_rms<<<N_BLOCKS, BSIZE>>>(dData, N_data, N_filters, reopt, Nstages, d_states, d_f, d_params, d_dV, dx_rand, dpar_min, dpar_max);
+            chi2_gpu_rms<<<N_BLOCKS, BSIZE, h_sdata_size>>>(dData, N_data, N_filters, reopt, Nstages, d_states, d_f, d_params, d_dV, dx_rand, dpar_min, dpar_max);
             #else
-            chi2_gpu<<<N_BLOCKS, BSIZE>>>(dData, N_data, N_filters, reopt, Nstages, d_states, d_f, d_params, d_dV);
+            chi2_gpu<<<N_BLOCKS, BSIZE, h_sdata_size>>>(dData, N_data, N_filters, reopt, Nstages, d_states, d_f, d_params, d_dV);
+            #endif
             #endif
             
             #ifdef TIMING
+            #ifdef CPU
+            gettimeofday (&t_stop, NULL);
+            timeval_subtract (&elapsed, &t_stop, &t_start);
+            printf("CPU time: %.2f ms\n", elapsed*1e3);
+            #else
             cudaEventRecord(stop, 0);
             cudaEventSynchronize (stop);
             cudaEventElapsedTime(&elapsed, start, stop);
             cudaEventDestroy(start);
             cudaEventDestroy(stop);
             printf("GPU time: %.2f ms\n", elapsed);
+            #endif
             exit(0);
             #endif        
             
@@ -730,6 +1082,26 @@ int main (int argc,char **argv)
             ERR(cudaMemcpy(h_f, d_f, N_BLOCKS * sizeof(CHI_FLOAT), cudaMemcpyDeviceToHost));
             ERR(cudaDeviceSynchronize());
 
+            // Number of the results (models) of this cycle:
+            int N_res = N_BLOCKS;
+            if (K_pipe > 0)
+            {
+                // Pipeline: Stage One results go to the archive; in Stage Two and Three the results are the K models
+                if (loop_counter <= N_pipe1)
+                    pipeline_archive(h_f, h_params, h_dV);
+                else
+                    pipeline_update(h_f, h_params, h_dV);
+                if (loop_counter == Ncases && N_pipe2 == 0)
+                    // (no Stage Two)
+                    pipeline_start();
+                #ifdef CPU
+                if (loop_counter == Ncases)
+                    pipeline_polish(N_data, N_filters);
+                #endif
+                if (loop_counter > N_pipe1 || loop_counter == Ncases)
+                    N_res = pipeline_results(h_f, h_params, h_dV);
+            }
+
             if (loop_counter > 0)
             {
                 // Finding the best result between all threads:        
@@ -738,7 +1110,7 @@ int main (int argc,char **argv)
                 int Nresults = 0;
                 double iii;
                 int l = -1;
-                for (i=0; i<N_BLOCKS; i++)
+                for (i=0; i<N_res; i++)
                 {
                     if (h_f[i] < 1e29)
                         Nresults++;
@@ -750,7 +1122,7 @@ int main (int argc,char **argv)
                     // Bringing periodic parameters to the canonic range of values
                     for (j=0; j<N_PARAMS; j++)
                     {
-                        l = l++;                        
+                        l++;
                         if (Property[j][P_periodic] == 1 || Property[j][P_type] == T_psi_0)
                             // To [0,2*pi[ range:
                             h_params[l] = 2*PI * modf(h_params[l]/(2*PI), &iii);
@@ -778,12 +1150,8 @@ int main (int argc,char **argv)
                     printf("\n");
                 fflush(stdout);
 
-                if (keep)
-                    // In the "keep" mode, we append new results
-                    fp = fopen(argv[j_results], "a");
-                    else
-                    // In the default mode, we overwtite the results with the current best ones
-                    fp = fopen(argv[j_results], "w");
+                // In the "keep" mode, the new results are appended; in the default mode, the results are overwritten with the current
+                // best ones (reslog.c)
                 int i1, i2;
                 if (best)
                     // If best=1, printing only the best model (one line)
@@ -793,31 +1161,51 @@ int main (int argc,char **argv)
                 else
                     // If best <> 1, printing all models
                 {
-                    i1 = 0;  i2 = N_BLOCKS;
+                    i1 = 0;  i2 = N_res;
                 }
                 for (i=i1; i<i2; i++)
                 {
-                    fprintf(fp,"%13.6e ",  h_f[i]);
-                    for (int m=0; m<N_filters; m++)
-                        fprintf(fp,"%13.6e ",  h_dV[i*N_FILTERS + m]);
+                    double par[N_PARAMS];
                     for (j=0; j<N_PARAMS; j++)
 #ifdef MY_L                    
                         if (Property[j][P_type] == T_L)
-                            fprintf(fp,"%15.11f ",  48*PI/h_params[i*N_PARAMS + j]);
+                            par[j] = 48*PI/h_params[i*N_PARAMS + j];
                             else
 #endif
-                            fprintf(fp,"%15.11f ",  h_params[i*N_PARAMS + j]);
-                    fprintf(fp,"\n");
+                            par[j] = h_params[i*N_PARAMS + j];
+                    reslog_write(loop_counter, i==i1, i==i2-1, h_f[i], &h_dV[i*N_FILTERS], par);
                 }
-                fclose(fp);
+
+                if (j_island > 0)
+                    // Island model: publishing our results, and getting migrants for the next cycle
+                    island_exchange(loop_counter, h_f, h_params);
+
+                if (K_pipe > 0 && loop_counter == N_pipe1 && N_pipe2 > 0)
+                    // The end of the pipeline Stage One: the best models are reoptimized by all the blocks from now on
+                    printf("\n*** Pipeline Stage Two: reoptimizing %d models ***\n\n", pipeline_start());
                                 
             }  // if loop_counter > 0
             
-            if (keep)
-                // If we are keeping all intermediate results, we have to reset d_f to 1e30 at the end of each loop:
+            if (keep || K_pipe > 0 && loop_counter >= N_pipe1)
+                // If we are keeping all intermediate results (or in the pipeline Stage Two), we have to reset d_f to 1e30 at the end of each loop:
+                #ifdef CPU
+                setup_cpu ( d_states, (unsigned long)0, d_f, 0);
+                #else
                 setup_kernel <<< N_BLOCKS, BSIZE >>> ( d_states, (unsigned long)0, d_f, 0);
+                #endif
 
             #endif  // RMSD
+
+            if (j_ckpt > 0)
+            {
+            #ifdef RMSD
+                ckpt_save(argv[j_ckpt], argv[j_results], N_data, loop_counter, d_states, params, PAR_min, PAR_max);
+            #else
+                // The checkpoint records the size of the results file, so all the results have to be written first:
+                reslog_sync();
+                ckpt_save(argv[j_ckpt], argv[j_results], N_data, loop_counter, d_states, params, NULL, NULL);
+            #endif
+            }
             
             if (loop_counter == Ncases)
                 break;            
@@ -826,6 +1214,8 @@ int main (int argc,char **argv)
 
         #ifdef RMSD
         fclose(fp);
+        #else
+        reslog_close();
         #endif
     #endif    // if not ANIMATE
     }  // End of Nplot=0 (simulation) module
@@ -847,7 +1237,8 @@ int main (int argc,char **argv)
         exit(0);
         #endif        
         
-        #if defined PROFILES        
+        #if defined CPU
+        #elif defined PROFILES        
         dim3 NB(C_POINTS, N_PARAMS);
         #elif defined ANIMATE
         int Npix = SIZE_PIX*SIZE_PIX;
@@ -876,18 +1267,23 @@ int main (int argc,char **argv)
         }
         return 0;
         
+        #elif defined CPU
+        chi2_plot_cpu(dData, N_data, N_filters, dPlot, Nplot, d_dlsq2, dx_rand);
         #else
         chi2_plot<<<NB, BSIZE>>>(dData, N_data, N_filters, dPlot, Nplot, d_dlsq2, dx_rand);        
         #endif
         
         ERR(cudaDeviceSynchronize());
         ERR(cudaMemcpyFromSymbol(&h_Vmod, d_Vmod, Nplot*sizeof(double), 0, cudaMemcpyDeviceToHost));
+        ERR(cudaMemcpy(h_dlsq2, d_dlsq2, N_data*sizeof(double), cudaMemcpyDeviceToHost));
         ERR(cudaMemcpyFromSymbol(&h_delta_V, d_delta_V, N_FILTERS*sizeof(CHI_FLOAT), 0, cudaMemcpyDeviceToHost));
         FILE * fV=fopen("delta_V","w");
         for (int m=0; m<N_filters; m++)
             fprintf(fV, "%8.4f\n", h_delta_V[m]);
         fclose(fV);
         ERR(cudaMemcpyFromSymbol(&h_chi2_plot, d_chi2_plot, sizeof(CHI_FLOAT), 0, cudaMemcpyDeviceToHost));
+        ERR(cudaMemcpyFromSymbol(&h_ode_steps, d_ode_steps, sizeof(int), 0, cudaMemcpyDeviceToHost));
+        ERR(cudaMemcpyFromSymbol(&h_ode_evals, d_ode_evals, sizeof(int), 0, cudaMemcpyDeviceToHost));
         #ifdef PROFILES        
         ERR(cudaMemcpyFromSymbol(&h_chi2_lines, d_chi2_lines, sizeof(h_chi2_lines), 0, cudaMemcpyDeviceToHost));
         ERR(cudaMemcpyFromSymbol(&h_param_lines, d_param_lines, sizeof(h_param_lines), 0, cudaMemcpyDeviceToHost));
@@ -897,7 +1293,7 @@ int main (int argc,char **argv)
             FILE * fO=fopen("omega.dat","w");
             for (i=0; i<Nplot; i++)
                 // K here is converted to period in hours
-                fprintf(fO, "%13.7f %16.9e %16.9f %16.9f %16.9e %16.9f %16.9f\n", hMJD0+hPlot[i].MJD, 48*PI/h_Omega[0][i], h_Omega[1][i]*RAD, h_Omega[2][i]*RAD, 48*PI/h_Omega[3][i], h_Omega[4][i]*RAD, h_Omega[5][i]*RAD);
+                fprintf(fO, "%13.7f %16.9e %16.9f %16.9f %16.9e %16.9f %16.9f\n", hMJD0+hPlot->MJD[i], 48*PI/h_Omega[0][i], h_Omega[1][i]*RAD, h_Omega[2][i]*RAD, 48*PI/h_Omega[3][i], h_Omega[4][i]*RAD, h_Omega[5][i]*RAD);
             fclose(fO);
         #endif
           // Printing the initial and final (only for TORQUE) model state (for later computations of P_psi, P_phi etc)
@@ -969,7 +1365,8 @@ int main (int argc,char **argv)
         ERR(cudaDeviceSynchronize());
         
         // Finding minima and computing periodogramm
-        minima(dPlot, h_Vmod, Nplot);
+        double cl_fr[NCL_MAX], cl_H[NCL_MAX];
+        minima(dPlot, h_Vmod, Nplot, cl_fr, cl_H);
         
         for (int j=0; j<NCL_MAX; j++)
             //            if (cl_fr[j] > 0.0)
@@ -980,64 +1377,23 @@ int main (int argc,char **argv)
         printf("\n");
         
         
-        //        double d2 = 0.0;
-        /*
-         *        for (i=0; i<N_data; i++)
-         *            d2 = d2 + h_dlsq2[i];
-         */
-        double d2[6], w[6];
-        int ind;
-        for (i=0; i<6; i++)
-        {
-            d2[i] = 0.0;
-            w[i] = 0.0;
-        }
-        for (i=0; i<N_data; i++)
-        {
-            if (hData[i].MJD < 0.5)
-                ind = 0;
-            else if (hData[i].MJD < 1.5)
-                ind = 1;
-            else if (hData[i].MJD < 2.7)
-                ind = 2;
-            else if (hData[i].MJD < 3.7)
-                ind = 3;
-            else if (hData[i].MJD < 4.5)
-                ind = 4;
-            else
-                ind = 5;                                
-            d2[ind] = d2[ind] + h_dlsq2[i];
-            w[ind] = w[ind] + 1;
-        }
-        double sum = 0.0;
-        double W;
-        double SW = 0.0;
-        for (i=0; i<6; i++)
-        {
-            if (i == 2 || i == 3)
-                // Giving extra weight to multi-featured regions 2 and 3:
-                W = 2;
-            else
-                W = 1;
-            sum = sum + W*d2[i]/w[i];
-            SW = SW + W;
-        }
-        double dist = sqrt(sum/SW);
+        double dist = lsq_distance(hData, h_dlsq2, N_data);
         
         printf("chi2_plot = %13.6e, lsq = %13.6e\n", h_chi2_plot, dist);
+        printf("ODE steps per chi2 evaluation: %d (%d ODE_func calls)\n", h_ode_steps, h_ode_evals);
         
         #ifndef NOPRINT
         fp = fopen("model.dat", "w");
         for (i=0; i<Nplot; i++)
             // The time here is corrected for light travel
-            fprintf(fp, "%13.7f %13.6e\n", hMJD0+hPlot[i].MJD, h_Vmod[i]);
+            fprintf(fp, "%13.7f %13.6e\n", hMJD0+hPlot->MJD[i], h_Vmod[i]);
         fclose(fp);
         
         fp = fopen("data.dat", "w");
         for (i=0; i<N_data; i++)
             // The time here is corrected for light travel
             // V is converted to the first filter
-            fprintf(fp, "%13.7f %13.6e %13.6e w\n", hMJD0+hData[i].MJD, hData[i].V - h_delta_V[hData[i].Filter] + h_delta_V[0], 1/sqrt(hData[i].w));
+            fprintf(fp, "%13.7f %13.6e %13.6e w\n", hMJD0+hData->MJD[i], hData->V[i] - h_delta_V[hData->Filter[i]] + h_delta_V[0], 1/sqrt(hData->w[i]));
         fclose(fp);
         
         #ifdef PROFILES
@@ -1063,3 +1419,5 @@ int main (int argc,char **argv)
     
     return 0;  
 }
+
+END_VARIANT
@@ -5,14 +5,32 @@
 #define ASTEROID_H
 #include <stdio.h>
 #include <string.h>
-#include <cuda.h>
 #include <sys/time.h>
-#include <curand_kernel.h>
-#include "cuda_errors.h"
+#ifdef CPU
+  // Host-only build (make cpu): CUDA runtime and cuRAND are emulated on CPU
+  #include "cpu_compat.h"
+#else
+  #include <cuda.h>
+  #include <curand_kernel.h>
+  #include "cuda_errors.h"
+#endif
 #ifdef ANIMATE
   #include <png.h>
 #endif
 
+// Multi-variant build (make multi / make cpu_multi): the model code is compiled once per model variant (variants.h),
+// each copy in its own namespace VARIANT, so the variants can be linked into one binary. Every source file wraps its code
+// (after the #include lines) in BEGIN_VARIANT ... END_VARIANT.
+#ifdef VARIANT
+  #define BEGIN_VARIANT namespace VARIANT {
+  #define END_VARIANT }
+#else
+  #define BEGIN_VARIANT
+  #define END_VARIANT
+#endif
+
+BEGIN_VARIANT
+
 #define PI 3.141592653589793238
 #define RAD (180.0 / PI)
 
@@ -28,6 +46,12 @@
 #endif
 // Precision for observational data (structure obs_data):
 #define OBS_TYPE double
+// Precision for the Earth and Sun unit vectors in obs_data (float halves the memory traffic of the geometry part of chi2one):
+#ifdef FLOAT_GEOM
+  #define GEOM_TYPE float
+#else
+  #define GEOM_TYPE OBS_TYPE
+#endif
 
 #ifdef TORQUE2
  #define TORQUE
@@ -37,6 +61,32 @@
  #define BC
 #endif 
 
+#if defined(ANALYTIC) && (defined(TORQUE) || defined(DP45))
+ #error "ANALYTIC (closed form torque-free solution) can't be used with TORQUE or DP45"
+#endif
+
+// Plot curve (-plot) as a single dense output integration, with the plot points evaluated in parallel (chi2_plot); not with the
+// adaptive DP45 integrator, the model dependent TORQUE2 split, or the sequential minima search of MINIMA_TEST:
+#if !defined(DP45) && !defined(TORQUE2) && !defined(MINIMA_TEST)
+ #define DENSE_PLOT
+#endif
+
+#ifdef CPU
+ #if defined(ANIMATE) || defined(MINIMA_TEST) || defined(DEBUG2)
+  #error "ANIMATE, MINIMA_TEST and DEBUG2 modes are only available in the GPU build"
+ #endif
+ // Lockstep (SIMD) evaluation of several models at once in the CPU simplex search (cpu_simd.c); only for the
+ // default brightness model, without data segments or minima nudging. Can be disabled with NO_BATCH (and is not used with SPECULATIVE).
+ #if !defined(NO_BATCH) && !defined(SPECULATIVE) && !defined(SEGMENT) && !defined(NUDGE) && !defined(TORQUE2) && !defined(ROTATE) && !defined(BW_BALL) && !defined(RECT) && !defined(MIN_DV) && !defined(DP45) && !defined(ANALYTIC)
+  #define BATCH
+ #endif
+ // Two-phase chi2one (attitude propagation, then a vectorized brightness loop, per tile of N_TILE data points).
+ // Can be disabled with NO_TWO_PHASE.
+ #ifndef NO_TWO_PHASE
+  #define TWO_PHASE
+ #endif
+#endif
+
 #ifdef SEGMENT
 // Absolute times - starting points of the data segments:
 #if N_SEG == 3
@@ -177,19 +227,52 @@ const int T_kappa =   __COUNTER__;
 // Total number of parameter types (determines the length of the Limits and Types arrays):
 const int N_TYPES =   __COUNTER__;
 
+// Defining these for better readability (params is the vector of model parameters, iseg is the data segment):
+#define P_theta_M  params[sTypes[T_theta_M][iseg]]
+#define P_phi_M    params[sTypes[T_phi_M][iseg]]
+#define P_phi_0    params[sTypes[T_phi_0][iseg]]
+#define P_L        params[sTypes[T_L][iseg]]
+#define P_A        params[sTypes[T_A][iseg]]
+#define P_Ti       params[sTypes[T_Ti][iseg]]
+#define P_Ts       params[sTypes[T_Ts][iseg]]
+#define P_Tl       params[sTypes[T_Tl][iseg]]
+#define P_T2i      params[sTypes[T_T2i][iseg]]
+#define P_T2s      params[sTypes[T_T2s][iseg]]
+#define P_T2l      params[sTypes[T_T2l][iseg]]
+#define P_Tt       params[sTypes[T_Tt][iseg]]
+#define P_c_tumb   params[sTypes[T_c_tumb][iseg]]
+#define P_b_tumb   params[sTypes[T_b_tumb][iseg]]
+#define P_Es       params[sTypes[T_Es][iseg]]
+#define P_psi_0    params[sTypes[T_psi_0][iseg]]
+#define P_c        params[sTypes[T_c][iseg]]
+#define P_b        params[sTypes[T_b][iseg]]
+#define P_theta_R  params[sTypes[T_theta_R][iseg]]
+#define P_phi_R    params[sTypes[T_phi_R][iseg]]
+#define P_psi_R    params[sTypes[T_psi_R][iseg]]
+#define P_kappa    params[sTypes[T_kappa][iseg]]
+
 //-----------------------------------------------------------------------
 
 
-// Maximum number of data points:
-#ifdef INTERP
-// INTERP function results in a ~15% slower code, but allows for a few time larger datasets:
-const int MAX_DATA = 772; // 497, 662, 772, 993, 1914
-#else
-const int MAX_DATA = 390;
-#endif
 // Maximum number of filters:
 const int N_FILTERS = 10;
 
+#ifdef CPU
+// CPU optimization parameters. Each "block" is a group of BSIZE independent simplex runs, and produces one model
+// in the output file, as in the GPU version. There are N_BLOCKS*BSIZE work items per kernel call, shared between all the cores.
+const int BSIZE = 16;   // Simplex runs per block
+#ifdef BATCH
+const int K_BATCH = 8;  // Number of models evaluated in lockstep by chi2_batch (SIMD lanes)
+#endif
+#ifdef TWO_PHASE
+const int N_TILE = 64;  // Number of data points per tile in the two-phase chi2one
+#endif
+#ifdef DEBUG
+const int N_BLOCKS = 14;
+#else
+const int N_BLOCKS = 56;
+#endif
+#else
 // GPU optimization parameters:
 const int BSIZE = 256;   // Threads in a block (64 ... 1024, step of 64); 256
 #ifdef DEBUG
@@ -197,9 +280,41 @@ const int N_BLOCKS = 14;
 #else
 const int N_BLOCKS = 56; // Should be proportional to the number of SMs (56 for P100, 80 for V100)
 #endif
+#endif
+
+// Island model (-island switch, island.c):
+const int ISLAND_ELITE = 32;                 // Number of the best models kept in the shared memory segment
+const int ISLAND_MIGRANTS = (N_BLOCKS+3)/4;  // Number of blocks reoptimizing the models of the other islands
+const int ISLAND_PERIOD = 2;                 // Migration every ISLAND_PERIOD cycles of the main loop
+
+// Starting points of the random search (-start switch, qmc.c):
+const int START_RANDOM = 0;                  // curand_uniform (default)
+const int START_HALTON = 1;                  // Scrambled Halton sequence
+const int QMC_MAX_DIM = 64;                  // Largest N_PARAMS supported by the Halton starts (the number of tabulated primes)
+const int QMC_P_MAX = 311;                   // The QMC_MAX_DIM-th prime (the size of the digit permutation tables)
+const long long QMC_ISLAND_STRIDE = 1LL << 40;  // Range of the Halton point indexes reserved for one island
+
+// Results file, written asynchronously by a writer thread (-format switch, reslog.c):
+const int FORMAT_TEXT = 0;                   // Text lines (default)
+const int FORMAT_BINARY = 1;                 // Binary records (converted to text with -convert)
+const int RESLOG_QUEUE = 4096;               // Size of the writer queue, in results (models)
+
+// In-process Stage One -> Two -> Three pipeline (-pipeline switch, pipeline.c):
+const int PIPE_ELITE = 64;                   // Size of the archive of the Stage One models (maximum K)
+const double PIPE_DIVERSITY = 0.02;          // Minimum rms distance between the archived models, in units of the parameter ranges
 
 // ODE time step (days):
 const double TIME_STEP = 1e-2;  // 1e-2 for Oumuamua; 0.003 for TD60_All
+// RK4 step of the dense output integration of the plot curve (DENSE_PLOT); about as accurate as the old integration between the
+// consecutive plot points (the plot curve agrees to ~1e-5 mag):
+const double PLOT_TIME_STEP = TIME_STEP / 16;
+#ifdef DP45
+// Adaptive (Dormand-Prince) integrator: TIME_STEP is only the initial step. Default absolute error tolerance per step
+// (radians; rad/day for Omega), can be changed with -tol:
+const double DP45_TOL = 1e-6;
+// Smallest allowed time step (days); if the tolerance can't be met with this step, the model is rejected:
+const double DP45_H_MIN = 1e-7;
+#endif
 
 // Simplex parameters:
 const CHI_FLOAT DX_INI = 0.001;  // Maximum scale-free initial step
@@ -244,6 +359,38 @@ const CHI_FLOAT SIGMA_SIM = 0.5;
 
 const CHI_FLOAT SIZE2_MIN = SIZE_MIN * SIZE_MIN;
 
+#ifdef CPU
+// Optimizers for the initial optimization stage (-opt switch):
+const int OPT_SIMPLEX = 0;  // N_BLOCKS*BSIZE independent simplex runs (default)
+const int OPT_DE = 1;       // Differential evolution, one population per block (de.c)
+// Differential evolution constants (DE/current-to-pbest/1/bin):
+const int DE_NP = 4*BSIZE;         // Population size (per block)
+#if defined(TIMING) || defined(DEBUG)
+const int DE_GEN = 50;             // Maximum number of generations
+#else
+const int DE_GEN = 1000;
+#endif
+const CHI_FLOAT DE_CR = 0.9;       // Crossover probability
+const CHI_FLOAT DE_F_MIN = 0.4;    // The mutation factor is random (for each trial point), DE_F_MIN ... DE_F_MAX
+const CHI_FLOAT DE_F_MAX = 0.9;
+const int DE_PBEST = DE_NP / 8;    // Number of the best points, one of which is used as "pbest" for the mutation
+// Levenberg-Marquardt refinement (-lm switch, lm.c):
+const int LM_ITER_MAX = 100;       // Maximum number of iterations (Jacobian evaluations)
+const double LM_TOL = 1e-10;       // Convergence: relative decrease of the sum of squared residuals per iteration
+const double LM_LAMBDA0 = 1e-3;    // Initial damping factor
+#ifdef ACC
+const double LM_DX = 1e-7;         // Finite difference step for the Jacobian, in dimensionless x units
+#else
+const double LM_DX = 1e-4;         // (larger when x is float)
+#endif
+// Surrogate screening of the random starts (-surrogate switch, surrogate.c):
+const int SURR_MAX = 512;          // Size of the archive of (starting point, chi2 of the simplex run) pairs
+const int SURR_MIN = 64;           // Minimum archive size for the screening
+const int SURR_CANDIDATES = 8;     // Candidate starting points per run; the one with the lowest predicted chi2 is used
+const int SURR_EXPLORE = 4;        // Every SURR_EXPLORE-th run starts from an unscreened random point (exploration)
+const double SURR_NOISE = 0.3;     // Noise variance of the Gaussian process (in units of the variance of log(chi2))
+#endif
+
 // When b and c parameters are used, maximum ln deviation from corresponding b_tumb, c_tumb during optimization:
 const float BC_DEV_MAX = 100;  //2.3
 // The same, but only during the initial value generation (when RANDOM_BC option is used):
@@ -286,6 +433,9 @@ const int MAX_MINIMA = 50;  // Maximum number of brifhtness minima allowed durin
 // Speed of light (au/day):
 const double light_speed = 173.144632674;
 
+// Degree of the piecewise Chebyshev interpolation of the ephemerides (ephem.c); each piece goes through EPH_ORDER+1 epochs:
+const int EPH_ORDER = 7;
+
 // Empirical coefficients for P_phi constraining, for LAM=0 and 1 cases:
 const double S_LAM0 = 1.1733;
 const double S_LAM1 = 1.2067;
@@ -315,6 +465,14 @@ const float IMAX_B = 144;
 const float SPOT_RAD = 0.04;
 #endif
 
+#ifdef DENSE_PLOT
+// A node (RK4 step end point) of the dense output integration of the plot curve: the time, the ODE variables and their derivatives
+struct plot_node {
+    double t;
+    double y[6], f[6];
+};
+#endif
+
 // Structure to bring auxilary parameters to chi2one
 struct chi2_struct {
     #ifdef NUDGE
@@ -334,6 +492,19 @@ struct chi2_struct {
     double S_z0[3];
     double MJD0[3];
     #endif
+    #ifdef CPU
+    double *Vmod;  // If not NULL, chi2one stores here the model magnitudes of all the data points (without delta_V)
+    double *Vplot;  // If not NULL, chi2one stores here the plot curve (Nplot>0) instead of d_Vmod
+    #endif
+    int plot_i1, plot_i2;  // The range of the plot points computed by chi2one (Nplot>0)
+    #ifdef DENSE_PLOT
+    // If not NULL: the nodes of the dense output integration of the plot curve (at most plot_N_nodes; segment iseg starts at
+    // node plot_node0[iseg]). They are stored by a seeding call (plot_i1 = plot_i2 = -1), which does the whole integration; the
+    // next calls only interpolate the plot points between the nodes, so the parts of the plot grid can be computed in parallel.
+    struct plot_node *plot_nodes;
+    int plot_N_nodes;
+    int plot_node0[N_SEG];
+    #endif
 };
 
 // Structure used to pass parameters to x2params (from chi2gpu)
@@ -351,23 +522,50 @@ struct x2_struct {
 };
 
 
-// Observational data arrays:
+#ifdef ANALYTIC
+// Constants of the closed form torque-free solution for one model (see free_rotation_init in cuda.c):
+struct free_rotation {
+    int LAM;
+    double L, Ii, Is, phi0;
+    double a, b, c;     // Amplitudes of the Omega_p, Omega_q (=Omega_i), Omega_r components
+    double sr;          // Sign of the Omega_r component
+    double rate, m;     // tau=rate*t+tau0; m=k^2 is the parameter of the elliptic functions
+    double K, Pi;       // Complete elliptic integrals of the first and third kind
+    double n, phi_coef; // Characteristic of the third kind integral, and its coefficient in phi(t)
+    double tau0, Pi0;   // tau and the third kind integral at t=0
+};
+#endif
+
+// Observational data arrays, structure of arrays (SoA) layout. All the arrays live in one contiguous memory block (buf), with the
+// 8-byte types first, so the whole data set is copied (e.g. to GPU shared memory) as a single block; see obs_carve in cuda.c.
 struct obs_data {
-    float V;  // visual magnitude array, mag
-    float w;  // 1-sgm error bar squared for V array, mag
+    void *buf;  // the memory block holding all the arrays below
+    OBS_TYPE *MJD;  // asteroid time (without time delay)
+    // Integration schedule (depends only on the data; set by integration_schedule in read_data.c):
+    OBS_TYPE *h;   // RK4 step size, days; negative if the time goes backwards
     #ifndef INTERP    
-    OBS_TYPE E_x;  // asteroid->Earth vector in barycentric FoR array, au
-    OBS_TYPE E_y;  // asteroid->Earth vector in barycentric FoR array, au
-    OBS_TYPE E_z;  // asteroid->Earth vector in barycentric FoR array, au
-    OBS_TYPE S_x;  // asteroid->Sun vector in barycentric FoR array, au
-    OBS_TYPE S_y;  // asteroid->Sun vector in barycentric FoR array, au
-    OBS_TYPE S_z;  // asteroid->Sun vector in barycentric FoR array, au
+    GEOM_TYPE *E_x;  // asteroid->Earth unit vector in barycentric FoR
+    GEOM_TYPE *E_y;
+    GEOM_TYPE *E_z;
+    GEOM_TYPE *S_x;  // asteroid->Sun unit vector in barycentric FoR
+    GEOM_TYPE *S_y;
+    GEOM_TYPE *S_z;
     #endif
-    OBS_TYPE MJD;  // asteroid time (without time delay)
-    int Filter;  // Filter code array
+    float *V;  // visual magnitude array, mag
+    float *w;  // 1-sgm error bar squared for V array, mag
+    int *Filter;  // Filter code array
+    int *N_steps;  // number of RK4 steps from the previous data point to this one (0 for the first point)
 };
 
+// Size of one data point in the obs_data memory block, bytes:
 #ifdef INTERP
+const int N_GEOM = 0;
+#else
+const int N_GEOM = 6;
+#endif
+const int OBS_POINT_SIZE = 2*sizeof(OBS_TYPE) + N_GEOM*sizeof(GEOM_TYPE) + 2*sizeof(float) + 2*sizeof(int);
+
+// Earth and Sun vectors in read_data.c, before they are normalized and stored in obs_data:
 struct obs_data_h {
     OBS_TYPE E_x;  // asteroid->Earth vector in barycentric FoR array, au
     OBS_TYPE E_y;  // asteroid->Earth vector in barycentric FoR array, au
@@ -376,18 +574,74 @@ struct obs_data_h {
     OBS_TYPE S_y;  // asteroid->Sun vector in barycentric FoR array, au
     OBS_TYPE S_z;  // asteroid->Sun vector in barycentric FoR array, au
 };
-#endif
 
 // Function declarations
 int read_data(char *, int *, int *, int);
-int quadratic_interpolation(double, OBS_TYPE *,OBS_TYPE *,OBS_TYPE *, OBS_TYPE *,OBS_TYPE *,OBS_TYPE *);
+int read_data_cached(char *, char *, int *, int *, int);
+int integration_schedule(struct obs_data *, int);
+int obs_alloc(struct obs_data **, int);
+__host__ __device__ size_t obs_size(int);
+__host__ __device__ void obs_carve(struct obs_data *, void *, int);
+int ephem_read();
+int ephem_eval(double, OBS_TYPE *,OBS_TYPE *,OBS_TYPE *, OBS_TYPE *,OBS_TYPE *,OBS_TYPE *);
+void ephem_free();
 int timeval_subtract (double *, struct timeval *, struct timeval *);
 int cmpdouble (const void * a, const void * b);
-int minima(struct obs_data * dPlot, double * Vm, int Nplot);
+int minima(struct obs_data * dPlot, double * Vm, int Nplot, double * cl_fr, double * cl_H);
+double lsq_distance(struct obs_data *, double *, int);
 int prepare_chi2_params(int *);
 int gpu_prepare(int, int, int, int);
+int island_open(char *);
+int island_exchange(int, CHI_FLOAT *, double *);
+int qmc_init(int, unsigned long, int);
+int qmc_cycle(int);
+__device__ long long qmc_index(int);
+__device__ CHI_FLOAT qmc_x(long long, int);
+int reslog_open(char *, int, int, int);
+int reslog_write(int, int, int, CHI_FLOAT, double *, double *);
+int reslog_sync();
+int reslog_close();
+int reslog_convert(char *, char *);
+int pipeline_init(int, CHI_FLOAT [][N_TYPES], int [][N_COLUMNS]);
+int pipeline_archive(CHI_FLOAT *, double *, double *);
+int pipeline_start();
+int pipeline_update(CHI_FLOAT *, double *, double *);
+int pipeline_polish(int, int);
+int pipeline_results(CHI_FLOAT *, double *, double *);
+int batch_run(char *, int);
+int bulk_plot(char *, char *, int, int, int, int [][N_COLUMNS]);
+int ckpt_save(char *, char *, int, int, curandState *, double *, float *, float *);
+int ckpt_load(char *, char *, int, curandState *, double *, float *, float *);
 int minima_test(int, int, int, double*, int[][N_SEG], CHI_FLOAT);
 
+#ifdef CPU
+// Host versions of the kernels (cpu.c):
+void setup_cpu (curandState *, unsigned long, CHI_FLOAT *, int);
+void chi2_cpu (struct obs_data *, int, int, int, int, curandState*, CHI_FLOAT*, double*, double*);
+#ifdef RMSD
+void chi2_cpu_rms (struct obs_data *, int, int, int, int, curandState*, CHI_FLOAT*, double*, double*, float, float*, float*);
+#endif
+void chi2_plot_cpu (struct obs_data *, int, int, struct obs_data *, int, double *, float);
+void simplex_runs_cpu (struct obs_data *, int, int, int, int, curandState*, CHI_FLOAT*);
+void init_chi2_struct(struct chi2_struct *);
+void init_x2_struct(struct x2_struct *, int);
+void de_stage(struct obs_data *, int, int, int, CHI_FLOAT *, CHI_FLOAT (*)[N_PARAMS], CHI_FLOAT (*)[N_PARAMS], struct x2_struct *, curandState*, struct chi2_struct *);
+int bench(char *, int, int, double *, int, double, unsigned long);
+int lm_refine(double *, int, int, char *, CHI_FLOAT *, CHI_FLOAT *);
+int cholesky(double *, int);
+void cholesky_solve(double *, int, double *);
+void surrogate_starts(int, CHI_FLOAT (*)[N_PARAMS], curandState *);
+void surrogate_update(int, CHI_FLOAT (*)[N_PARAMS], CHI_FLOAT *);
+int surrogate_save(FILE *);
+int surrogate_load(FILE *);
+#ifdef BATCH
+void chi2_batch(double [][K_BATCH], struct obs_data *, int, int, CHI_FLOAT *, CHI_FLOAT [][K_BATCH], struct chi2_struct *);
+#endif
+__device__ CHI_FLOAT chi2one(double *, struct obs_data *, int, int, CHI_FLOAT *, int, struct chi2_struct *, int [][N_SEG]);
+__device__ double dlsq2_point(struct obs_data *, int, struct obs_data *, int, double *, CHI_FLOAT *);
+__device__ void params2x(CHI_FLOAT *, double *, CHI_FLOAT [][N_TYPES], int [][N_COLUMNS], int [][N_SEG], volatile struct x2_struct *);
+__device__ int x2params(CHI_FLOAT *, double *, CHI_FLOAT [][N_TYPES], volatile struct x2_struct *, int [][N_COLUMNS], int [][N_SEG]);
+#endif
 __global__ void setup_kernel ( curandState *, unsigned long, CHI_FLOAT *, int);
 #ifndef ANIMATE
 __global__ void chi2_gpu(struct obs_data *, int, int, int, int, curandState*, CHI_FLOAT*, double*, double*);
@@ -440,10 +694,16 @@ EXTERN struct obs_data *dData;
 EXTERN struct obs_data *dPlot;
 
 
-// Arrays used for ephemerides interpolation:
+// The three ephemeris epochs for the interpolation in chi2one (INTERP):
 EXTERN double E_x0[3],E_y0[3],E_z0[3], S_x0[3],S_y0[3],S_z0[3], MJD0[3];    
 EXTERN double *MJD_obs;  // observational time (with light delay)
 EXTERN double hMJD0;
+// Total number of RK4 steps per chi2 evaluation (from the integration schedule; the work estimate per model):
+EXTERN int h_sched_steps;
+// Size (bytes) of the dynamic shared memory copy of the data in chi2_gpu / chi2_gpu_rms (0 if the data don't fit
+// into shared memory, and the device memory copy is used instead); see gpu_prepare.c:
+EXTERN size_t h_sdata_size;
+EXTERN __device__ int d_sdata;
 #ifdef INTERP
 EXTERN __device__ double dE_x0[3],dE_y0[3],dE_z0[3], dS_x0[3],dS_y0[3],dS_z0[3], dMJD0[3];    
 #endif
@@ -457,8 +717,27 @@ EXTERN long int * h_iloc_min;
 
 EXTERN __device__ CHI_FLOAT d_chi2_plot;
 EXTERN CHI_FLOAT h_chi2_plot;
+// Number of ODE steps and ODE_func calls for one chi2 evaluation (from chi2_plot):
+EXTERN __device__ int d_ode_steps, d_ode_evals;
+EXTERN int h_ode_steps, h_ode_evals;
+#ifdef CPU
+// Total number of simplex steps and chi2 evaluations done by the simplex runs (cpu.c; used by the benchmark, bench.c):
+EXTERN long long int h_simplex_steps, h_simplex_evals;
+// Optimizer for the initial optimization stage (OPT_SIMPLEX or OPT_DE; -opt switch):
+EXTERN int h_optimizer;
+// Surrogate screening of the random starts (-surrogate switch):
+EXTERN int h_surrogate;
+#endif
+#ifdef DP45
+EXTERN __device__ double d_tol;
+#endif
 EXTERN __device__ CHI_FLOAT dLimits[2][N_TYPES];
 EXTERN __device__ double d_Vmod[NPLOT];
+#if defined(DENSE_PLOT) && !defined(ANALYTIC)
+// Buffer for the nodes of the dense output integration of the plot curve (chi2_plot), and its size:
+EXTERN __device__ struct plot_node *d_plot_nodes;
+EXTERN __device__ int d_plot_N_nodes;
+#endif
 #ifdef PLOT_OMEGA
 EXTERN __device__ double d_Omega[6][NPLOT];
 EXTERN double h_Omega[6][NPLOT];
@@ -483,6 +762,16 @@ EXTERN double* h_params;
 //EXTERN double h_dV[N_BLOCKS][N_FILTERS];
 EXTERN double* h_dV;
 EXTERN __device__ double d_params0[N_PARAMS];
+// Migrants: the first d_N_migrants blocks reoptimize these models (island model, island.c: up to ISLAND_MIGRANTS of them;
+// -pipeline Stage Two, pipeline.c: all the blocks):
+EXTERN __device__ double d_migrants[N_BLOCKS][N_PARAMS];
+EXTERN __device__ int d_N_migrants;
+// Low-discrepancy starting points (qmc.c): the point type (START_RANDOM, START_HALTON), the index of the first point of the current
+// kernel call, the Halton bases and the digit permutations (scrambling) of all the dimensions:
+EXTERN __device__ int d_qmc;
+EXTERN __device__ long long d_qmc_base;
+EXTERN __device__ int d_qmc_prime[N_PARAMS];
+EXTERN __device__ short d_qmc_perm[N_PARAMS][QMC_P_MAX];
 #ifdef RMSD
 EXTERN float *dpar_min, *dpar_max;
 EXTERN float *hpar_min, *hpar_max;
@@ -504,8 +793,6 @@ EXTERN int h_min;
 EXTERN int h_max;
 EXTERN unsigned int h_block_counter;
 
-EXTERN double cl_fr[NCL_MAX];
-EXTERN double cl_H[NCL_MAX];
 EXTERN __device__ int dProperty[N_PARAMS][N_COLUMNS];
 EXTERN __device__ int dTypes[N_TYPES][N_SEG];
 
@@ -540,6 +827,8 @@ EXTERN __device__ int d_i1, d_i2;
 EXTERN int h_i1, h_i2;
 #endif
 
+END_VARIANT
+
 #endif
 
 
@@ -0,0 +1,282 @@
+/* Batch mode (-batch manifest Ncores switch): fitting the light curves of many objects from one command.
+ *
+ * The model code keeps the data, the ephemerides (asteroid.eph, earth.eph, sun.eph in the working directory) and the results in
+ * global variables, so one object is fitted per process. The batch driver reads a manifest with one job per line:
+ *
+ *     name  priority  directory  arguments...
+ *
+ * (empty lines and lines starting with '#' are ignored). The job runs in "directory" (which holds the ephemeris set of the object),
+ * with the usual command line "arguments" (light curve -i, results -o, model, limits, -N, ...; with the multi-variant binary also
+ * -model), and its output goes to directory/name.log. All the jobs share one pool of Ncores cores (0: all the cores of the node):
+ * the jobs are started in the order of decreasing priority, and, for the same priority, of decreasing size (the number of the
+ * data points times the -N number of cycles). A job gets a fair share of the free cores - proportional to its size relative to all
+ * the jobs still waiting - but at least one core, so the small objects run next to a large one instead of leaving cores idle, and
+ * the cores freed by a finished job go to the next waiting ones. In the GPU build every job takes one slot of the pool (the jobs
+ * share the GPU; Ncores=0 means one job at a time).
+ */
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "asteroid.h"
+
+BEGIN_VARIANT
+
+const int BATCH_MAX_LINE = 4096;   // Longest manifest line
+const int BATCH_MAX_ARGS = 256;    // Largest number of arguments of a job
+
+struct batch_job {
+    char name[MAX_FILE_NAME];
+    int priority;
+    char *line;                    // The manifest line (the arguments point into it)
+    char *dir;
+    int argc;
+    char *argv[BATCH_MAX_ARGS+2];
+    double size;                   // Work estimate (for the order and the share of the cores)
+    int cores;                     // Cores given to the job (when running)
+    pid_t pid;                     // 0: waiting; -1: finished
+    int status;
+    struct timeval t0;
+    double time;
+};
+
+
+static int batch_cmp(const void *a, const void *b)
+// Decreasing priority, then decreasing size
+{
+    const struct batch_job *j1 = (const struct batch_job *)a;
+    const struct batch_job *j2 = (const struct batch_job *)b;
+    if (j1->priority != j2->priority)
+        return j2->priority - j1->priority;
+    if (j1->size != j2->size)
+        return j1->size < j2->size? 1 : -1;
+    return 0;
+}
+
+
+static double batch_size(struct batch_job *job)
+// Work estimate of the job: number of the data points (lines of the -i file) times the number of cycles (-N)
+{
+    double lines = 0.0, cycles = 1.0;
+    for (int i=1; i+1<job->argc; i++)
+    {
+        if (strcmp(job->argv[i], "-N") == 0)
+            cycles = atof(job->argv[i+1]);
+        if (strcmp(job->argv[i], "-i") == 0)
+        {
+            char name[2*MAX_FILE_NAME];
+            // (relative to the job directory)
+            if (job->argv[i+1][0] == '/')
+                snprintf(name, sizeof(name), "%s", job->argv[i+1]);
+            else
+                snprintf(name, sizeof(name), "%s/%s", job->dir, job->argv[i+1]);
+            FILE *fp = fopen(name, "r");
+            if (fp != NULL)
+            {
+                // (a last line without the end of line character counts too, as in read_data)
+                int ch, last = '\n';
+                while ((ch = fgetc(fp)) != EOF)
+                {
+                    if (ch == '\n')
+                        lines++;
+                    last = ch;
+                }
+                if (last != '\n')
+                    lines++;
+                fclose(fp);
+            }
+        }
+    }
+    if (cycles < 1.0)
+        cycles = 1.0;
+    return (lines > 0.0? lines : 1.0) * cycles;
+}
+
+
+static int batch_read(char *manifest, struct batch_job **jobs)
+// Reading the manifest. Returns the number of jobs.
+{
+    FILE *fp = fopen(manifest, "r");
+    if (fp == NULL)
+    {
+        printf("Manifest file %s does not exist!\n", manifest);
+        exit(1);
+    }
+    int N = 0, N_max = 64;
+    *jobs = (struct batch_job *)malloc(N_max * sizeof(struct batch_job));
+    char line[BATCH_MAX_LINE];
+    int l = 0;
+    while (fgets(line, sizeof(line), fp))
+    {
+        l++;
+        char *p = line;
+        while (*p == ' ' || *p == '\t')
+            p++;
+        if (*p == '#' || *p == '\n' || *p == 0)
+            continue;
+        if (N == N_max)
+        {
+            N_max = 2*N_max;
+            *jobs = (struct batch_job *)realloc(*jobs, N_max * sizeof(struct batch_job));
+        }
+        struct batch_job *job = &(*jobs)[N];
+        memset(job, 0, sizeof(struct batch_job));
+        job->line = strdup(p);
+        // Splitting the line into words:
+        char *words[BATCH_MAX_ARGS+3];
+        int n = 0;
+        for (char *w = strtok(job->line, " \t\n"); w != NULL && n < BATCH_MAX_ARGS+3; w = strtok(NULL, " \t\n"))
+            words[n++] = w;
+        if (n < 3)
+        {
+            printf("Manifest %s, line %d: \"name priority directory arguments...\" expected!\n", manifest, l);
+            exit(1);
+        }
+        snprintf(job->name, MAX_FILE_NAME, "%s", words[0]);
+        job->priority = atoi(words[1]);
+        job->dir = words[2];
+        // argv[0] is filled in when the job is started
+        job->argc = n - 2;
+        for (int i=1; i<job->argc; i++)
+            job->argv[i] = words[i+2];
+        job->argv[job->argc] = NULL;
+        job->size = batch_size(job);
+        N++;
+    }
+    fclose(fp);
+    return N;
+}
+
+
+static pid_t batch_start(struct batch_job *job, char *exe)
+// Starting the job in its directory, with job->cores threads, output to name.log
+{
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid != 0)
+        return pid;
+
+    // The child process:
+    char log_name[MAX_FILE_NAME+8];
+    snprintf(log_name, sizeof(log_name), "%s.log", job->name);
+    if (chdir(job->dir) != 0)
+    {
+        printf("Batch job %s: cannot change to directory %s!\n", job->name, job->dir);
+        fflush(stdout);
+        _exit(127);
+    }
+    int fd = open(log_name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd >= 0)
+    {
+        dup2(fd, 1);
+        dup2(fd, 2);
+        close(fd);
+    }
+    char threads[16];
+    snprintf(threads, sizeof(threads), "%d", job->cores);
+    setenv("OMP_NUM_THREADS", threads, 1);
+    job->argv[0] = exe;
+    execv(exe, job->argv);
+    printf("Batch job %s: cannot execute %s!\n", job->name, exe);
+    fflush(stdout);
+    _exit(127);
+}
+
+
+int batch_run(char *manifest, int N_cores)
+// Running all the jobs of the manifest on a pool of N_cores cores. Returns 0 if all the jobs succeeded.
+{
+    struct batch_job *jobs;
+    int N = batch_read(manifest, &jobs);
+    if (N == 0)
+    {
+        printf("Manifest %s has no jobs!\n", manifest);
+        exit(1);
+    }
+    qsort(jobs, N, sizeof(struct batch_job), batch_cmp);
+
+    // The jobs execute this binary:
+    char exe[MAX_FILE_NAME];
+    ssize_t l = readlink("/proc/self/exe", exe, sizeof(exe)-1);
+    if (l <= 0)
+    {
+        printf("Cannot find the path of the executable!\n");
+        exit(1);
+    }
+    exe[l] = 0;
+
+    if (N_cores <= 0)
+    #ifdef CPU
+        N_cores = sysconf(_SC_NPROCESSORS_ONLN);
+    #else
+        N_cores = 1;
+    #endif
+    printf("Batch: %d jobs, %d cores\n", N, N_cores);
+
+    int free_cores = N_cores;
+    int next = 0, N_running = 0, N_failed = 0;
+    struct timeval t0, t1;
+    gettimeofday(&t0, NULL);
+    while (next < N || N_running > 0)
+    {
+        // Starting the waiting jobs while there are free cores:
+        while (next < N && free_cores > 0)
+        {
+            struct batch_job *job = &jobs[next];
+            #ifdef CPU
+            double W = 0.0;
+            for (int i=next; i<N; i++)
+                W = W + jobs[i].size;
+            job->cores = (int)(free_cores * job->size / W + 0.5);
+            if (job->cores < 1)
+                job->cores = 1;
+            if (job->cores > free_cores)
+                job->cores = free_cores;
+            #else
+            job->cores = 1;
+            #endif
+            gettimeofday(&job->t0, NULL);
+            job->pid = batch_start(job, exe);
+            if (job->pid < 0)
+            {
+                printf("Cannot start batch job %s!\n", job->name);
+                exit(1);
+            }
+            printf("  started  %-20s priority %3d, %2d cores, size %.3g (%s)\n", job->name, job->priority, job->cores, job->size, job->dir);
+            free_cores = free_cores - job->cores;
+            N_running++;
+            next++;
+        }
+
+        // Waiting for a job to finish:
+        int status;
+        pid_t pid = wait(&status);
+        if (pid < 0)
+            break;
+        for (int i=0; i<next; i++)
+            if (jobs[i].pid == pid)
+            {
+                gettimeofday(&t1, NULL);
+                timeval_subtract(&jobs[i].time, &t1, &jobs[i].t0);
+                jobs[i].pid = -1;
+                jobs[i].status = WIFEXITED(status)? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+                if (jobs[i].status != 0)
+                    N_failed++;
+                printf("  finished %-20s status %3d, %.1f s\n", jobs[i].name, jobs[i].status, jobs[i].time);
+                free_cores = free_cores + jobs[i].cores;
+                N_running--;
+            }
+    }
+    gettimeofday(&t1, NULL);
+    double time;
+    timeval_subtract(&time, &t1, &t0);
+    printf("Batch: %d jobs finished (%d failed) in %.1f s\n", N, N_failed, time);
+
+    for (int i=0; i<N; i++)
+        free(jobs[i].line);
+    free(jobs);
+    return N_failed > 0;
+}
+
+END_VARIANT
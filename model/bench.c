@@ -0,0 +1,239 @@
+/* Benchmark mode of the CPU build (-bench switch).
+ *
+ * Measures the throughput of the chi2 function (chi2one, and chi2_batch in BATCH mode) and of the simplex engine, for the
+ * compiled model variant and the given data file, and prints the results as one JSON line. bench.sh ("make bench") runs it
+ * for the main model variants and the bundled datasets, so the speed of the CPU code can be tracked over time.
+ * Everything (the random models, the simplex starting points) is derived from -seed, so the check values (chi2 of the first model,
+ * best chi2 of the first BSIZE simplex runs) don't depend on the number of threads or the benchmark duration.
+ */
+#include <sys/time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "asteroid.h"
+
+BEGIN_VARIANT
+
+#ifdef CPU
+
+// Number of models evaluated in one round of the chi2 test (a multiple of K_BATCH):
+const int N_BENCH_MODELS = 64;
+
+// Model macros (for the output):
+static const char *bench_macros[] = {
+    #ifdef ACC
+    "ACC",
+    #endif
+    #ifdef ANALYTIC
+    "ANALYTIC",
+    #endif
+    #ifdef BC
+    "BC",
+    #endif
+    #ifdef BW_BALL
+    "BW_BALL",
+    #endif
+    #ifdef DP45
+    "DP45",
+    #endif
+    #ifdef FLOAT_GEOM
+    "FLOAT_GEOM",
+    #endif
+    #ifdef INTERP
+    "INTERP",
+    #endif
+    #ifdef MIN_DV
+    "MIN_DV",
+    #endif
+    #ifdef NUDGE
+    "NUDGE",
+    #endif
+    #ifdef P_BOTH
+    "P_BOTH",
+    #endif
+    #ifdef P_PHI
+    "P_PHI",
+    #endif
+    #ifdef P_PSI
+    "P_PSI",
+    #endif
+    #ifdef RECT
+    "RECT",
+    #endif
+    #ifdef ROTATE
+    "ROTATE",
+    #endif
+    #ifdef SEGMENT
+    "SEGMENT",
+    #endif
+    #ifdef SPECULATIVE
+    "SPECULATIVE",
+    #endif
+    #ifdef TORQUE
+    "TORQUE",
+    #endif
+    #ifdef TORQUE2
+    "TORQUE2",
+    #endif
+    #ifdef TREND
+    "TREND",
+    #endif
+    NULL
+};
+
+
+static double bench_elapsed(struct timeval *t0)
+// Wall clock time since t0, in seconds
+{
+    struct timeval t;
+    double dt;
+    gettimeofday (&t, NULL);
+    timeval_subtract (&dt, &t, t0);
+    return dt;
+}
+
+
+int bench(char *data_name, int N_data, int N_filters, double *params, int model, double T_bench, unsigned long seed)
+// The benchmark. With model=1 (-m switch) the chi2 test uses params, and the simplex runs reoptimize params; otherwise random models
+// (and random simplex starting points) are used. T_bench is the minimum wall clock time (seconds), shared equally between the tests.
+{
+    struct chi2_struct sp;
+    struct x2_struct x2_params;
+    struct timeval t0;
+    int i, k;
+    int N_threads = 1;
+    #ifdef _OPENMP
+    N_threads = omp_get_max_threads();
+    #endif
+    #ifdef BATCH
+    const int N_tests = 3;
+    const int batch = 1;
+    const int lanes = K_BATCH;  // Simplex runs per thread
+    #else
+    const int N_tests = 2;
+    const int batch = 0;
+    const int lanes = 1;
+    #endif
+    #ifdef TWO_PHASE
+    const int two_phase = 1;
+    #else
+    const int two_phase = 0;
+    #endif
+
+    init_chi2_struct(&sp);
+    init_x2_struct(&x2_params, 0);
+
+    // Models for the chi2 tests:
+    double (*pm)[N_PARAMS] = (double (*)[N_PARAMS])malloc(N_BENCH_MODELS * N_PARAMS * sizeof(double));
+    curandState state;
+    curand_init ((unsigned long long)seed, 0, 0, &state);
+    for (k=0; k<N_BENCH_MODELS; k++)
+    {
+        if (model)
+        {
+            for (i=0; i<N_PARAMS; i++)
+                pm[k][i] = params[i];
+            continue;
+        }
+        CHI_FLOAT x[N_PARAMS];
+        do
+        {
+            for (i=0; i<N_PARAMS; i++)
+                x[i] = curand_uniform(&state);
+        }
+        while (x2params(x, pm[k], dLimits, &x2_params, dProperty, dTypes));
+    }
+
+    // chi2one test:
+    CHI_FLOAT f[N_BENCH_MODELS];
+    long long int N_chi2 = 0;
+    double t_chi2;
+    gettimeofday (&t0, NULL);
+    do
+    {
+        #pragma omp parallel for schedule(dynamic)
+        for (k=0; k<N_BENCH_MODELS; k++)
+        {
+            CHI_FLOAT delta_V[N_FILTERS];
+            f[k] = chi2one(pm[k], dData, N_data, N_filters, delta_V, 0, &sp, dTypes);
+        }
+        N_chi2 += N_BENCH_MODELS;
+        t_chi2 = bench_elapsed(&t0);
+    }
+    while (t_chi2 < T_bench/N_tests);
+
+    // chi2_batch test:
+    long long int N_batch = 0;
+    double t_batch = 0.0;
+    #ifdef BATCH
+    gettimeofday (&t0, NULL);
+    do
+    {
+        #pragma omp parallel for schedule(dynamic)
+        for (int kb=0; kb<N_BENCH_MODELS/K_BATCH; kb++)
+        {
+            double pb[N_PARAMS][K_BATCH];
+            CHI_FLOAT fb[K_BATCH];
+            for (int kk=0; kk<K_BATCH; kk++)
+                for (int ii=0; ii<N_PARAMS; ii++)
+                    pb[ii][kk] = pm[kb*K_BATCH+kk][ii];
+            chi2_batch(pb, dData, N_data, N_filters, fb, NULL, &sp);
+        }
+        N_batch += N_BENCH_MODELS;
+        t_batch = bench_elapsed(&t0);
+    }
+    while (t_batch < T_bench/N_tests);
+    #endif
+
+    // Simplex test (the -opt optimizer; with -opt de, a "step" is one generation of a population). Enough runs per round to keep all the threads (and SIMD lanes) busy, a multiple of BSIZE:
+    int N_runs = (2*N_threads*lanes + BSIZE-1) / BSIZE * BSIZE;
+    if (N_runs > N_BLOCKS*BSIZE)
+        N_runs = N_BLOCKS*BSIZE;
+    curandState *states = (curandState *)malloc(N_BLOCKS*BSIZE * sizeof(curandState));
+    CHI_FLOAT *s_f = (CHI_FLOAT *)malloc(N_runs * sizeof(CHI_FLOAT));
+    setup_cpu (states, seed, d_f, 1);
+    if (model)
+        ERR(cudaMemcpyToSymbol(d_params0, params, N_PARAMS*sizeof(double), 0, cudaMemcpyHostToDevice));
+    h_simplex_steps = 0;
+    h_simplex_evals = 0;
+    CHI_FLOAT f_simplex = 1e30;
+    int N_rounds = 0;
+    double t_simplex;
+    gettimeofday (&t0, NULL);
+    do
+    {
+        simplex_runs_cpu(dData, N_data, N_filters, model, N_runs, states, s_f);
+        if (N_rounds == 0)
+            // The check value: the best result of the first BSIZE runs
+            for (k=0; k<BSIZE; k++)
+                if (s_f[k] < f_simplex)
+                    f_simplex = s_f[k];
+        N_rounds++;
+        t_simplex = bench_elapsed(&t0);
+    }
+    while (t_simplex < T_bench/N_tests);
+
+    printf("{\"model\": \"");
+    for (i=0; bench_macros[i] != NULL; i++)
+        printf("%s%s", i>0? ",":"", bench_macros[i]);
+    printf("\", \"data\": \"%s\", \"N_data\": %d, \"N_filters\": %d, \"N_params\": %d, \"start\": \"%s\", \"seed\": %lu, \"threads\": %d, ",
+           data_name, N_data, N_filters, N_PARAMS, model? "model":"random", seed, N_threads);
+    printf("\"optimizer\": \"%s\", ", h_optimizer == OPT_DE? "de":"simplex");
+    printf("\"batch\": %d, \"two_phase\": %d, \"chi2\": %.6e, \"chi2_evals\": %lld, \"chi2_time\": %.3f, \"chi2_per_s\": %.1f, ",
+           batch, two_phase, f[0], N_chi2, t_chi2, N_chi2/t_chi2);
+    if (batch)
+        printf("\"batch_evals\": %lld, \"batch_time\": %.3f, \"batch_per_s\": %.1f, ", N_batch, t_batch, N_batch/t_batch);
+    else
+        printf("\"batch_evals\": null, \"batch_time\": null, \"batch_per_s\": null, ");
+    printf("\"simplex_runs\": %d, \"simplex_steps\": %lld, \"simplex_evals\": %lld, \"simplex_time\": %.3f, \"steps_per_s\": %.1f, \"simplex_evals_per_s\": %.1f, \"simplex_chi2\": %.6e}\n",
+           N_rounds*N_runs, h_simplex_steps, h_simplex_evals, t_simplex, h_simplex_steps/t_simplex, h_simplex_evals/t_simplex, f_simplex);
+    fflush(stdout);
+
+    free(pm);
+    free(states);
+    free(s_f);
+    return 0;
+}
+
+#endif // CPU
+
+END_VARIANT
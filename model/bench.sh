@@ -0,0 +1,41 @@
+#!/bin/bash
+# CPU benchmark ("make bench"): runs the -bench mode of the multi-variant CPU binary for the main model variants and the
+# bundled datasets, printing one JSON line per case (see bench.c for the fields). Usage:
+#
+#   ./bench.sh [binary [seconds [seed]]]    (defaults: ../asteroid_cpu_multi 6 1)
+#
+# Run from the model directory; the cases are executed in the parent directory (where the ephemeris files are).
+# The output can be appended to a file to track the performance over time, e.g.  ./bench.sh >> bench_history.json
+
+BINARY=$(realpath ${1:-../asteroid_cpu_multi})
+TIME=${2:-6}
+SEED=${3:-1}
+
+cd ..
+
+# One case: variant, data file, and (optionally) the file with the model (the last N_params columns of its first line are used;
+# the run is then a reoptimization of this model). P_PSI variants need the -Ppsi range for the random starting points.
+run()
+{
+    local variant=$1 data=$2 model_file=$3 nparams=$4
+    local model=""
+    if [ -n "$model_file" ]
+    then
+        model="-m $(head -1 $model_file | awk -v n=$nparams '{for(i=NF-n+1;i<=NF;i++) printf "%s ", $i}')"
+    fi
+    $BINARY -model $variant -i $data -bench $TIME -seed $SEED -Ppsi 2 4800 $model | grep '^{'
+}
+
+# Random models, all the main variants:
+run psi             Data/light_curve.txt
+run psi_bc          Data/light_curve.txt
+run psi_torque      Data/light_curve.txt
+run psi_torque2_bc  Data/light_curve.txt
+run psi_torque_bw   Data/light_curve.txt
+run psi_rect        Data/light_curve.txt
+
+# The bundled runs (reoptimization of their best models):
+run psi_torque      Data/light_curve.txt  cigar/stage2.txt          11
+run psi_torque      Data/light_curve.txt  sail/stage2.txt           11
+run psi_torque_bc   Data/light_curve.txt  relaxed_cigar/stage2.txt  13
+run psi_torque      day3/day3.dat         day3/output.res           11
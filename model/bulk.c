@@ -0,0 +1,293 @@
+/* Bulk plotting and scoring of all the models of a results file (-plotall results output switch).
+ *
+ * Every model (line) of the text results file "results" (the -o output of the optimization runs, e.g. stage1.txt) is evaluated as
+ * with -plot: the chi2 and the filter constants delta_V, the model light curve on the NPLOT grid, the periodogram clusters of its
+ * minima (minima) and the 2D distances of the data points to the curve (dlsq2_point, lsq_distance). The data are read once, and
+ * the models are evaluated in parallel (CPU build: one model per OpenMP thread; GPU build: the chi2_plot kernel, one model after
+ * another). Nothing is written to model.dat, data.dat etc.; all the results go to the binary file "output": a header (struct
+ * bulk_header) followed by columns of doubles, at the header offsets. The per-model columns are indexed by the model number k
+ * (the line of the results file), [k][j] arrays being row-major:
+ *
+ *     t_plot[Nplot], t_data[N_data]               times (days, relative to MJD0; light time corrected)
+ *     f[N_models], chi2[N_models], lsq[N_models]   chi2 from the results file, recomputed chi2, lsq
+ *     delta_V[N_models][N_filters]
+ *     params[N_models][N_params]                   as in the results file
+ *     cl_fr[N_models][N_cl], cl_H[N_models][N_cl]  periodogram clusters (frequency -1: not found)
+ *     V_data[N_models][N_data]                     data magnitudes brought to the first filter (as in data.dat)
+ *     dlsq2[N_models][N_data]                      squared 2D distances of the data points to the curve
+ *     Vmod[N_models][Nplot]                        model light curves (as in model.dat)
+ *
+ * The magic string is written last, so an interrupted run doesn't leave a valid looking file.
+ */
+#include <sys/time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "asteroid.h"
+
+BEGIN_VARIANT
+
+#if !defined(ANIMATE) && !defined(MINIMA_TEST)
+
+const int BULK_MAX_LINE = 8192;   // Longest results file line
+
+struct bulk_header {
+    char magic[8];
+    int N_models;
+    int N_params;
+    int N_filters;
+    int N_data;
+    int Nplot;
+    int N_cl;
+    double MJD0;
+    // Byte offsets of the columns:
+    size_t off_t_plot;
+    size_t off_t_data;
+    size_t off_f;
+    size_t off_chi2;
+    size_t off_lsq;
+    size_t off_delta_V;
+    size_t off_params;
+    size_t off_cl_fr;
+    size_t off_cl_H;
+    size_t off_V_data;
+    size_t off_dlsq2;
+    size_t off_Vmod;
+    size_t size;      // Total file size
+};
+
+static const char BULK_MAGIC[8] = "ASTPLT1";
+
+
+static size_t bulk_column(size_t *off, size_t n)
+// Placing a column of n doubles at *off
+{
+    size_t off0 = *off;
+    *off = *off + n*sizeof(double);
+    return off0;
+}
+
+
+static int bulk_read(char *name, int N_filters, double **f, double **params)
+// Reading all the models of the text results file name. Returns the number of models.
+{
+    FILE *fp = fopen(name, "r");
+    if (fp == NULL)
+    {
+        printf("Results file %s does not exist!\n", name);
+        exit(1);
+    }
+    char line[BULK_MAX_LINE];
+    if (fread(line, 1, 8, fp) == 8 && memcmp(line, "ASTRES1", 8) == 0)
+    {
+        printf("%s is a binary results file; convert it to text with -convert first!\n", name);
+        exit(1);
+    }
+    rewind(fp);
+
+    int N = 0, N_max = 256, l = 0;
+    *f = (double *)malloc(N_max * sizeof(double));
+    *params = (double *)malloc(N_max * N_PARAMS * sizeof(double));
+    while (fgets(line, sizeof(line), fp))
+    {
+        l++;
+        // One line: chi2, N_filters delta_V values, N_PARAMS parameters
+        double v[1 + N_FILTERS + N_PARAMS];
+        int n = 0;
+        char *p = line, *end;
+        while (n < 1 + N_filters + N_PARAMS)
+        {
+            v[n] = strtod(p, &end);
+            if (end == p)
+                break;
+            p = end;
+            n++;
+        }
+        if (n == 0)
+            // Empty line
+            continue;
+        if (n < 1 + N_filters + N_PARAMS)
+        {
+            printf("Results file %s, line %d: %d values (chi2, %d delta_V, %d parameters) expected!\n", name, l, 1 + N_filters + N_PARAMS, N_filters, N_PARAMS);
+            exit(1);
+        }
+        if (N == N_max)
+        {
+            N_max = 2*N_max;
+            *f = (double *)realloc(*f, N_max * sizeof(double));
+            *params = (double *)realloc(*params, N_max * N_PARAMS * sizeof(double));
+        }
+        (*f)[N] = v[0];
+        for (int j=0; j<N_PARAMS; j++)
+            (*params)[N*N_PARAMS + j] = v[1 + N_filters + j];
+        N++;
+    }
+    fclose(fp);
+    return N;
+}
+
+
+static void bulk_model(double *params, int N_data, int N_filters, int Nplot, CHI_FLOAT *chi2, CHI_FLOAT *delta_V, double *Vm, double *dlsq2)
+// The chi2 and delta_V of one model, its light curve Vm[Nplot], and the distances dlsq2[N_data] of the data points to the curve
+{
+    #ifdef CPU
+    // chi2_plot_cpu for one model, with its own output arrays (so the models can be evaluated in parallel):
+    struct chi2_struct sp;
+    init_chi2_struct(&sp);
+    *chi2 = chi2one(params, dData, N_data, N_filters, delta_V, 0, &sp, dTypes);
+    #ifdef SEGMENT
+    for (int i=0; i<N_SEG; i++)
+        sp.start_seg[i] = d_plot_start_seg[i];
+    #endif
+    sp.plot_i1 = 0;
+    sp.plot_i2 = Nplot;
+    sp.Vplot = Vm;
+    chi2one(params, dPlot, Nplot, N_filters, delta_V, Nplot, &sp, dTypes);
+    for (int i=0; i<N_data; i++)
+        dlsq2[i] = dlsq2_point(dData, i, dPlot, Nplot, Vm, delta_V);
+    #else
+    ERR(cudaMemcpyToSymbol(d_params0, params, N_PARAMS*sizeof(double), 0, cudaMemcpyHostToDevice));
+    chi2_plot<<<1, BSIZE>>>(dData, N_data, N_filters, dPlot, Nplot, d_dlsq2, 0.0);
+    ERR(cudaDeviceSynchronize());
+    ERR(cudaMemcpyFromSymbol(Vm, d_Vmod, Nplot*sizeof(double), 0, cudaMemcpyDeviceToHost));
+    ERR(cudaMemcpyFromSymbol(delta_V, d_delta_V, N_filters*sizeof(CHI_FLOAT), 0, cudaMemcpyDeviceToHost));
+    ERR(cudaMemcpyFromSymbol(chi2, d_chi2_plot, sizeof(CHI_FLOAT), 0, cudaMemcpyDeviceToHost));
+    ERR(cudaMemcpy(dlsq2, d_dlsq2, N_data*sizeof(double), cudaMemcpyDeviceToHost));
+    #endif
+    return;
+}
+
+
+int bulk_plot(char *results, char *output, int N_data, int N_filters, int Nplot, int Property[][N_COLUMNS])
+// Plotting and scoring all the models of the results file "results"; the results go to the binary file "output"
+{
+    double *f, *params_file;
+    int N = bulk_read(results, N_filters, &f, &params_file);
+    if (N == 0)
+    {
+        printf("Results file %s has no models!\n", results);
+        exit(1);
+    }
+    printf("\n*** Plotting %d models ***\n\n", N);
+
+    struct bulk_header h;
+    memset(&h, 0, sizeof(h));
+    h.N_models = N;
+    h.N_params = N_PARAMS;
+    h.N_filters = N_filters;
+    h.N_data = N_data;
+    h.Nplot = Nplot;
+    h.N_cl = NCL_MAX;
+    h.MJD0 = hMJD0;
+    size_t off = (sizeof(h) + 7) / 8 * 8;
+    h.off_t_plot = bulk_column(&off, Nplot);
+    h.off_t_data = bulk_column(&off, N_data);
+    h.off_f = bulk_column(&off, N);
+    h.off_chi2 = bulk_column(&off, N);
+    h.off_lsq = bulk_column(&off, N);
+    h.off_delta_V = bulk_column(&off, (size_t)N*N_filters);
+    h.off_params = bulk_column(&off, (size_t)N*N_PARAMS);
+    h.off_cl_fr = bulk_column(&off, (size_t)N*NCL_MAX);
+    h.off_cl_H = bulk_column(&off, (size_t)N*NCL_MAX);
+    h.off_V_data = bulk_column(&off, (size_t)N*N_data);
+    h.off_dlsq2 = bulk_column(&off, (size_t)N*N_data);
+    h.off_Vmod = bulk_column(&off, (size_t)N*Nplot);
+    h.size = off;
+
+    int fd = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        printf("Cannot open output file %s!\n", output);
+        exit(1);
+    }
+    // The per-model scalars (small) are kept in memory, the curves are written as soon as they are computed:
+    double *chi2 = (double *)malloc(N * sizeof(double));
+    double *lsq = (double *)malloc(N * sizeof(double));
+    double *dV = (double *)malloc((size_t)N * N_filters * sizeof(double));
+    double *cl_fr = (double *)malloc((size_t)N * NCL_MAX * sizeof(double));
+    double *cl_H = (double *)malloc((size_t)N * NCL_MAX * sizeof(double));
+    int n_bad = 0;
+    n_bad += pwrite(fd, hPlot->MJD, Nplot*sizeof(double), h.off_t_plot) != (ssize_t)(Nplot*sizeof(double));
+    n_bad += pwrite(fd, hData->MJD, N_data*sizeof(double), h.off_t_data) != (ssize_t)(N_data*sizeof(double));
+
+    struct timeval t0, t1;
+    gettimeofday(&t0, NULL);
+    #ifdef CPU
+    #pragma omp parallel reduction(+:n_bad)
+    #endif
+    {
+        double *Vm = (double *)malloc(Nplot * sizeof(double));
+        double *dlsq2 = (double *)malloc(N_data * sizeof(double));
+        double *V_data = (double *)malloc(N_data * sizeof(double));
+        #ifdef CPU
+        #pragma omp for schedule(dynamic)
+        #endif
+        for (int k=0; k<N; k++)
+        {
+            double params[N_PARAMS];
+            CHI_FLOAT chi2k, delta_V[N_FILTERS];
+            for (int j=0; j<N_PARAMS; j++)
+            {
+                params[j] = params_file[k*N_PARAMS + j];
+                #ifdef MY_L
+                if (Property[j][P_type] == T_L)
+                    params[j] = 48.0*PI/params[j];
+                #endif
+            }
+            bulk_model(params, N_data, N_filters, Nplot, &chi2k, delta_V, Vm, dlsq2);
+
+            chi2[k] = chi2k;
+            for (int m=0; m<N_filters; m++)
+                dV[k*N_filters + m] = delta_V[m];
+            minima(hPlot, Vm, Nplot, &cl_fr[k*NCL_MAX], &cl_H[k*NCL_MAX]);
+            lsq[k] = lsq_distance(hData, dlsq2, N_data);
+            for (int i=0; i<N_data; i++)
+                V_data[i] = hData->V[i] - delta_V[hData->Filter[i]] + delta_V[0];
+
+            n_bad += pwrite(fd, Vm, Nplot*sizeof(double), h.off_Vmod + (size_t)k*Nplot*sizeof(double)) != (ssize_t)(Nplot*sizeof(double));
+            n_bad += pwrite(fd, dlsq2, N_data*sizeof(double), h.off_dlsq2 + (size_t)k*N_data*sizeof(double)) != (ssize_t)(N_data*sizeof(double));
+            n_bad += pwrite(fd, V_data, N_data*sizeof(double), h.off_V_data + (size_t)k*N_data*sizeof(double)) != (ssize_t)(N_data*sizeof(double));
+        }
+        free(Vm);
+        free(dlsq2);
+        free(V_data);
+    }
+    gettimeofday(&t1, NULL);
+    double time;
+    timeval_subtract(&time, &t1, &t0);
+
+    n_bad += pwrite(fd, f, N*sizeof(double), h.off_f) != (ssize_t)(N*sizeof(double));
+    n_bad += pwrite(fd, chi2, N*sizeof(double), h.off_chi2) != (ssize_t)(N*sizeof(double));
+    n_bad += pwrite(fd, lsq, N*sizeof(double), h.off_lsq) != (ssize_t)(N*sizeof(double));
+    n_bad += pwrite(fd, dV, (size_t)N*N_filters*sizeof(double), h.off_delta_V) != (ssize_t)((size_t)N*N_filters*sizeof(double));
+    n_bad += pwrite(fd, params_file, (size_t)N*N_PARAMS*sizeof(double), h.off_params) != (ssize_t)((size_t)N*N_PARAMS*sizeof(double));
+    n_bad += pwrite(fd, cl_fr, (size_t)N*NCL_MAX*sizeof(double), h.off_cl_fr) != (ssize_t)((size_t)N*NCL_MAX*sizeof(double));
+    n_bad += pwrite(fd, cl_H, (size_t)N*NCL_MAX*sizeof(double), h.off_cl_H) != (ssize_t)((size_t)N*NCL_MAX*sizeof(double));
+    // The header (with the magic string) goes last:
+    memcpy(h.magic, BULK_MAGIC, 8);
+    n_bad += pwrite(fd, &h, sizeof(h), 0) != (ssize_t)sizeof(h);
+    n_bad += close(fd) != 0;
+    if (n_bad)
+    {
+        printf("Error writing output file %s!\n", output);
+        exit(1);
+    }
+
+    // Summary: the chi2 (from the file and recomputed), lsq and the top periodogram cluster of every model
+    printf("Model      chi2_file          chi2           lsq        fr1         H1\n");
+    for (int k=0; k<N; k++)
+        printf("%5d %13.6e %13.6e %13.6e %10.6f %10.6f\n", k, f[k], chi2[k], lsq[k], cl_fr[k*NCL_MAX], cl_H[k*NCL_MAX]);
+    printf("\n%d models plotted in %.3f s; results in %s\n", N, time, output);
+
+    free(chi2);
+    free(lsq);
+    free(dV);
+    free(cl_fr);
+    free(cl_H);
+    free(f);
+    free(params_file);
+    return 0;
+}
+
+#endif
+
+END_VARIANT
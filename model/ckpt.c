@@ -0,0 +1,210 @@
+/* Checkpoint and resume of the optimization and RMSD runs (-ckpt and -resume switches).
+ *
+ * The state of a run between two kernel calls of the main loop is small: the random number generator states of all the threads
+ * (d_states), the best result of every block (d_f, d_params, d_dV), the cycle counter, the input model (which moves in the
+ * -travel mode), the island model migrants, the surrogate model archive (CPU build), and in RMSD mode the cumulative counters and
+ * confidence intervals. No simplex state survives a kernel call, so saving all this after every cycle and restoring it with
+ * -resume makes the resumed run continue bit-identically (same build and command line). The results file is truncated back to
+ * its size at the checkpoint time, so results appended after the last checkpoint (-keep, RMSD) are not duplicated.
+ * The checkpoint is written to a temporary file which is then renamed, so a run killed while writing leaves the previous
+ * checkpoint intact.
+ */
+#include <sys/stat.h>
+#include <unistd.h>
+#include "asteroid.h"
+
+BEGIN_VARIANT
+
+// Checkpoint file header; a checkpoint can only be resumed by the same model variant, with the same data:
+struct ckpt_header {
+    char magic[8];
+    int N_params;
+    int N_blocks;
+    int bsize;
+    int N_filters;
+    int N_data;
+    int state_size;            // sizeof(curandState)
+    int chi_size;              // sizeof(CHI_FLOAT)
+    int rmsd;
+    int loop_counter;
+    long results_size;         // Size of the results file (bytes) at the checkpoint time
+};
+
+static const char CKPT_MAGIC[8] = "ASTCKPT";
+
+
+static void ckpt_header_init(struct ckpt_header *h, int N_data)
+{
+    memset(h, 0, sizeof(struct ckpt_header));
+    memcpy(h->magic, CKPT_MAGIC, 8);
+    h->N_params = N_PARAMS;
+    h->N_blocks = N_BLOCKS;
+    h->bsize = BSIZE;
+    h->N_filters = N_FILTERS;
+    h->N_data = N_data;
+    h->state_size = sizeof(curandState);
+    h->chi_size = sizeof(CHI_FLOAT);
+    #ifdef RMSD
+    h->rmsd = 1;
+    #endif
+    return;
+}
+
+
+static void ckpt_io(size_t n, size_t count, char *name)
+{
+    if (n != count)
+    {
+        printf("Error reading/writing checkpoint file %s!\n", name);
+        exit(1);
+    }
+    return;
+}
+
+
+int ckpt_save(char *name, char *results_name, int N_data, int loop_counter, curandState *d_states, double *params, float *PAR_min, float *PAR_max)
+// Saving the state of the run after the cycle loop_counter of the main loop to the checkpoint file "name"
+{
+    struct ckpt_header h;
+    struct stat st;
+    char tmp_name[MAX_FILE_NAME+8];
+    int N_states = N_BLOCKS * BSIZE;
+
+    ckpt_header_init(&h, N_data);
+    h.loop_counter = loop_counter;
+    h.results_size = stat(results_name, &st) == 0? (long)st.st_size : 0;
+
+    curandState *h_states = (curandState *)malloc(N_states * sizeof(curandState));
+    ERR(cudaMemcpy(h_states, d_states, N_states * sizeof(curandState), cudaMemcpyDeviceToHost));
+
+    snprintf(tmp_name, sizeof(tmp_name), "%s.tmp", name);
+    FILE *fc = fopen(tmp_name, "wb");
+    if (fc == NULL)
+    {
+        printf("Cannot open checkpoint file %s!\n", tmp_name);
+        exit(1);
+    }
+    ckpt_io(fwrite(&h, sizeof(h), 1, fc), 1, tmp_name);
+    ckpt_io(fwrite(h_states, sizeof(curandState), N_states, fc), N_states, tmp_name);
+    ckpt_io(fwrite(params, sizeof(double), N_PARAMS, fc), N_PARAMS, tmp_name);
+    free(h_states);
+
+    #ifdef RMSD
+    int h_Ntot, h_Nbad;
+    ERR(cudaMemcpyFromSymbol(&h_Ntot, d_Ntot, sizeof(int), 0, cudaMemcpyDeviceToHost));
+    ERR(cudaMemcpyFromSymbol(&h_Nbad, d_Nbad, sizeof(int), 0, cudaMemcpyDeviceToHost));
+    ckpt_io(fwrite(&h_Ntot, sizeof(int), 1, fc), 1, tmp_name);
+    ckpt_io(fwrite(&h_Nbad, sizeof(int), 1, fc), 1, tmp_name);
+    ckpt_io(fwrite(PAR_min, sizeof(float), N_PARAMS, fc), N_PARAMS, tmp_name);
+    ckpt_io(fwrite(PAR_max, sizeof(float), N_PARAMS, fc), N_PARAMS, tmp_name);
+    #else
+    // The current block results (h_f etc. can be stale in the -keep mode, where d_f is reset after the results were copied):
+    CHI_FLOAT *f = (CHI_FLOAT *)malloc(N_BLOCKS * sizeof(CHI_FLOAT));
+    double *par = (double *)malloc(N_BLOCKS * N_PARAMS * sizeof(double));
+    double *dV = (double *)malloc(N_BLOCKS * N_FILTERS * sizeof(double));
+    ERR(cudaMemcpy(f, d_f, N_BLOCKS * sizeof(CHI_FLOAT), cudaMemcpyDeviceToHost));
+    ERR(cudaMemcpy(par, d_params, N_BLOCKS * N_PARAMS * sizeof(double), cudaMemcpyDeviceToHost));
+    ERR(cudaMemcpy(dV, d_dV, N_BLOCKS * N_FILTERS * sizeof(double), cudaMemcpyDeviceToHost));
+    ckpt_io(fwrite(f, sizeof(CHI_FLOAT), N_BLOCKS, fc), N_BLOCKS, tmp_name);
+    ckpt_io(fwrite(par, sizeof(double), N_BLOCKS*N_PARAMS, fc), N_BLOCKS*N_PARAMS, tmp_name);
+    ckpt_io(fwrite(dV, sizeof(double), N_BLOCKS*N_FILTERS, fc), N_BLOCKS*N_FILTERS, tmp_name);
+    free(f);
+    free(par);
+    free(dV);
+    // Island model migrants for the next cycle:
+    int N_migrants;
+    double migrants[ISLAND_MIGRANTS][N_PARAMS];
+    ERR(cudaMemcpyFromSymbol(&N_migrants, d_N_migrants, sizeof(int), 0, cudaMemcpyDeviceToHost));
+    ERR(cudaMemcpyFromSymbol(migrants, d_migrants, ISLAND_MIGRANTS*N_PARAMS*sizeof(double), 0, cudaMemcpyDeviceToHost));
+    ckpt_io(fwrite(&N_migrants, sizeof(int), 1, fc), 1, tmp_name);
+    ckpt_io(fwrite(migrants, sizeof(double), ISLAND_MIGRANTS*N_PARAMS, fc), ISLAND_MIGRANTS*N_PARAMS, tmp_name);
+    #ifdef CPU
+    // The surrogate model archive (-surrogate):
+    ckpt_io(surrogate_save(fc), 0, tmp_name);
+    #endif
+    #endif
+
+    // Making sure the checkpoint is on the disk before it replaces the previous one:
+    fflush(fc);
+    fsync(fileno(fc));
+    fclose(fc);
+    if (rename(tmp_name, name) != 0)
+    {
+        printf("Cannot rename %s to %s!\n", tmp_name, name);
+        exit(1);
+    }
+    return 0;
+}
+
+
+int ckpt_load(char *name, char *results_name, int N_data, curandState *d_states, double *params, float *PAR_min, float *PAR_max)
+// Restoring the state of the run from the checkpoint file "name". Returns the number of completed cycles of the main loop.
+{
+    struct ckpt_header h, h0;
+    int N_states = N_BLOCKS * BSIZE;
+
+    FILE *fc = fopen(name, "rb");
+    if (fc == NULL)
+    {
+        printf("Cannot open checkpoint file %s!\n", name);
+        exit(1);
+    }
+    ckpt_io(fread(&h, sizeof(h), 1, fc), 1, name);
+    ckpt_header_init(&h0, N_data);
+    if (memcmp(h.magic, h0.magic, 8) != 0 || h.N_params != h0.N_params || h.N_blocks != h0.N_blocks || h.bsize != h0.bsize ||
+        h.N_filters != h0.N_filters || h.N_data != h0.N_data || h.state_size != h0.state_size || h.chi_size != h0.chi_size || h.rmsd != h0.rmsd)
+    {
+        printf("Checkpoint file %s was written by a different model variant or for different data!\n", name);
+        exit(1);
+    }
+
+    curandState *h_states = (curandState *)malloc(N_states * sizeof(curandState));
+    ckpt_io(fread(h_states, sizeof(curandState), N_states, fc), N_states, name);
+    ERR(cudaMemcpy(d_states, h_states, N_states * sizeof(curandState), cudaMemcpyHostToDevice));
+    free(h_states);
+    ckpt_io(fread(params, sizeof(double), N_PARAMS, fc), N_PARAMS, name);
+
+    #ifdef RMSD
+    int h_Ntot, h_Nbad;
+    ckpt_io(fread(&h_Ntot, sizeof(int), 1, fc), 1, name);
+    ckpt_io(fread(&h_Nbad, sizeof(int), 1, fc), 1, name);
+    ERR(cudaMemcpyToSymbol(d_Ntot, &h_Ntot, sizeof(int), 0, cudaMemcpyHostToDevice));
+    ERR(cudaMemcpyToSymbol(d_Nbad, &h_Nbad, sizeof(int), 0, cudaMemcpyHostToDevice));
+    ckpt_io(fread(PAR_min, sizeof(float), N_PARAMS, fc), N_PARAMS, name);
+    ckpt_io(fread(PAR_max, sizeof(float), N_PARAMS, fc), N_PARAMS, name);
+    #else
+    CHI_FLOAT *f = (CHI_FLOAT *)malloc(N_BLOCKS * sizeof(CHI_FLOAT));
+    double *par = (double *)malloc(N_BLOCKS * N_PARAMS * sizeof(double));
+    double *dV = (double *)malloc(N_BLOCKS * N_FILTERS * sizeof(double));
+    ckpt_io(fread(f, sizeof(CHI_FLOAT), N_BLOCKS, fc), N_BLOCKS, name);
+    ckpt_io(fread(par, sizeof(double), N_BLOCKS*N_PARAMS, fc), N_BLOCKS*N_PARAMS, name);
+    ckpt_io(fread(dV, sizeof(double), N_BLOCKS*N_FILTERS, fc), N_BLOCKS*N_FILTERS, name);
+    ERR(cudaMemcpy(d_f, f, N_BLOCKS * sizeof(CHI_FLOAT), cudaMemcpyHostToDevice));
+    ERR(cudaMemcpy(d_params, par, N_BLOCKS * N_PARAMS * sizeof(double), cudaMemcpyHostToDevice));
+    ERR(cudaMemcpy(d_dV, dV, N_BLOCKS * N_FILTERS * sizeof(double), cudaMemcpyHostToDevice));
+    free(f);
+    free(par);
+    free(dV);
+    int N_migrants;
+    double migrants[ISLAND_MIGRANTS][N_PARAMS];
+    ckpt_io(fread(&N_migrants, sizeof(int), 1, fc), 1, name);
+    ckpt_io(fread(migrants, sizeof(double), ISLAND_MIGRANTS*N_PARAMS, fc), ISLAND_MIGRANTS*N_PARAMS, name);
+    ERR(cudaMemcpyToSymbol(d_N_migrants, &N_migrants, sizeof(int), 0, cudaMemcpyHostToDevice));
+    ERR(cudaMemcpyToSymbol(d_migrants, migrants, ISLAND_MIGRANTS*N_PARAMS*sizeof(double), 0, cudaMemcpyHostToDevice));
+    #ifdef CPU
+    ckpt_io(surrogate_load(fc), 0, name);
+    #endif
+    #endif
+    fclose(fc);
+
+    // Dropping the results written after the checkpoint:
+    if (truncate(results_name, h.results_size) != 0)
+    {
+        printf("Cannot truncate the results file %s!\n", results_name);
+        exit(1);
+    }
+    printf("Resuming from checkpoint %s after %d cycles\n", name, h.loop_counter);
+    return h.loop_counter;
+}
+
+END_VARIANT
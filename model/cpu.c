@@ -0,0 +1,1575 @@
+/* Host (CPU) versions of the kernels from cuda.c, used in the CPU build (make cpu).
+ *
+ * A GPU thread becomes an independent work item (one simplex run), and the N_BLOCKS*BSIZE work items
+ * are shared between the cores with OpenMP. A GPU block becomes a group of BSIZE consecutive work items;
+ * the block reduction is done as soon as all the work items of the block are finished (see the work pool below).
+ * Each work item has its own random numbers stream, so the results do not depend on the number of OpenMP threads.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <sched.h>
+#include "asteroid.h"
+
+BEGIN_VARIANT
+
+#ifdef CPU
+
+// Device arrays, under the same names as the shared memory copies in the kernels:
+#define sLimits dLimits
+#define sProperty dProperty
+#define sTypes dTypes
+
+
+// Filling the chi2one parameters structure from the "device" (global) data:
+void init_chi2_struct(struct chi2_struct *sp)
+{
+    #ifdef INTERP
+    for (int i=0; i<3; i++)
+    {
+        sp->E_x0[i] = dE_x0[i];
+        sp->E_y0[i] = dE_y0[i];
+        sp->E_z0[i] = dE_z0[i];
+        sp->S_x0[i] = dS_x0[i];
+        sp->S_y0[i] = dS_y0[i];
+        sp->S_z0[i] = dS_z0[i];
+        sp->MJD0[i] = dMJD0[i];
+    }
+    #endif
+    #ifdef NUDGE
+    sp->N_obs = d_chi2_params.N_obs;
+    for (int i=0; i<sp->N_obs; i++)
+    {
+        sp->t_obs[i] = d_chi2_params.t_obs[i];
+        sp->V_obs[i] = d_chi2_params.V_obs[i];
+    }
+    #endif
+    #ifdef SEGMENT
+    for (int i=0; i<N_SEG; i++)
+        sp->start_seg[i] = d_start_seg[i];
+    #endif
+    sp->Vmod = NULL;
+    sp->Vplot = NULL;
+    sp->plot_i1 = 0;
+    sp->plot_i2 = 0;
+    #ifdef DENSE_PLOT
+    sp->plot_nodes = NULL;
+    sp->plot_N_nodes = 0;
+    #endif
+    return;
+}
+
+
+void init_x2_struct(struct x2_struct *s_x2_params, int reopt)
+{
+    #ifdef P_PSI
+    s_x2_params->Ppsi1 = d_x2_params.Ppsi1;
+    s_x2_params->Ppsi2 = d_x2_params.Ppsi2;
+    #endif
+    #ifdef P_BOTH
+    s_x2_params->Pphi =  d_x2_params.Pphi;
+    s_x2_params->Pphi2 = d_x2_params.Pphi2;
+    #endif
+    s_x2_params->reopt = reopt;
+    return;
+}
+
+
+//++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+
+static void simplex_init(CHI_FLOAT x[][N_PARAMS], CHI_FLOAT *x_start, struct x2_struct *s_x2_params, curandState *localState, const CHI_FLOAT *u0)
+// Placing the initial simplex (see chi2_gpu for the strategy). x_start is the initial point (only used when reoptimizing).
+// u0 (if not NULL) replaces the random numbers which place the initial point (-start halton, -surrogate; see chi2_cpu).
+{
+    int i, j;
+
+    if (s_x2_params->reopt)
+        for (i=0; i<N_PARAMS; i++)
+            x[0][i] = x_start[i];
+
+    #define SMALL 1e-8  // Small offset from the hard parameter limits
+    int LAM = 0;
+
+    // Setting the initial values of x[0][i] vector
+    for (i=0; i<N_PARAMS; i++)
+    {
+        // Generating random number in [0..1[ interval:
+        float r = curand_uniform(localState);
+        if (u0 != NULL && !s_x2_params->reopt)
+            r = u0[i];
+
+        #ifdef BC
+        #ifndef RANDOM_BC
+        if (!s_x2_params->reopt)
+        {
+            // Initial vales of c/b are equal to initial values of c_tumb/b_tumb:
+            if (sProperty[i][P_type] == T_c)
+            {
+                x[0][i] = x[0][sTypes[T_c_tumb][sProperty[i][P_iseg]]];
+                continue;
+            }
+            else if (sProperty[i][P_type] == T_b)
+            {
+                x[0][i] = x[0][sTypes[T_b_tumb][sProperty[i][P_iseg]]];
+                continue;
+            }
+        }
+        #endif  // RANDOM_BC
+        #endif  // BC
+
+        if (!s_x2_params->reopt || s_x2_params->reopt && sProperty[i][P_frozen]==-1)
+            // Points placed randomly within the full allowed interval
+        {
+            x[0][i] = DX_INI+SMALL + r*(1.0 - 2*(SMALL+DX_INI));
+        }
+        else
+         // During reoptimization, P_frozen=0 parameters start close to the original values, within +-DX_RAND
+        {
+            CHI_FLOAT xmin = x[0][i] - DX_RAND;
+            CHI_FLOAT xmax = x[0][i] + DX_RAND;
+            // Enforcing hard limits:
+            if (xmin<SMALL && (sProperty[i][P_periodic]==HARD_BOTH || sProperty[i][P_periodic]==HARD_LEFT || LAM==0 && sProperty[i][P_periodic]==PERIODIC_LAM))
+                xmin = SMALL;
+            if (xmax>1.0-SMALL && (sProperty[i][P_periodic]==HARD_BOTH || sProperty[i][P_periodic]==HARD_RIGHT || LAM==0 && sProperty[i][P_periodic]==PERIODIC_LAM))
+                xmax = 1.0 - SMALL;
+
+            x[0][i] = xmin + r*(xmax-xmin);
+        }
+
+    if (sProperty[i][P_type] == T_Es)
+        // We need to know LAM to figure out whether psi_0 is periodic (LAM=1) or not (LAM=0):
+        LAM = x[0][i]>=0.5;
+    }
+
+    // Simplex initialization (initial values x[j][i] for all j>0)
+    for (j=1; j<N_PARAMS+1; j++)
+    {
+        for (i=0; i<N_PARAMS; i++)
+        {
+            if (i == j-1)
+            {
+                float d2x = curand_uniform(localState);
+                // Initial step size is log-random, in the interval exp(D2X_INI)*DX_INI .. DX_INI:
+                CHI_FLOAT dx = DX_INI * exp(D2X_INI*d2x);
+                // Random but safe sign of the step:
+                if (curand_uniform(localState) < 0.5)
+                {
+                    dx = -dx;
+                    if (x[0][i]+dx<SMALL && (sProperty[i][P_periodic]==HARD_BOTH || sProperty[i][P_periodic]==HARD_LEFT || LAM==0 && sProperty[i][P_periodic]==PERIODIC_LAM))
+                        dx = -dx;
+                }
+                else
+                {
+                    if (x[0][i]+dx>1.0-SMALL && (sProperty[i][P_periodic]==HARD_BOTH || sProperty[i][P_periodic]==HARD_RIGHT || LAM==0 && sProperty[i][P_periodic]==PERIODIC_LAM))
+                        dx = -dx;
+                }
+                x[j][i] = x[0][i] + dx;
+            }
+            else
+            {
+                x[j][i] = x[0][i];
+            }
+        }
+    }
+    #undef SMALL
+    return;
+}
+
+
+static CHI_FLOAT simplex_sort(CHI_FLOAT x[][N_PARAMS], CHI_FLOAT *f, int *ind, CHI_FLOAT *x0)
+// Sorting the simplex (ind), computing its centroid (x0). Returns the simplex size squared.
+{
+    int i, j;
+    bool ind2[N_PARAMS+1];
+    for (j=0; j<N_PARAMS+1; j++)
+        ind2[j] = 0;
+    for (j=0; j<N_PARAMS+1; j++)
+    {
+        CHI_FLOAT fmin = 1e30;
+        int jmin = -1;
+        for (int j2=0; j2<N_PARAMS+1; j2++)
+        {
+            if (ind2[j2]==0 && f[j2] <= fmin)
+            {
+                fmin = f[j2];
+                jmin = j2;
+            }
+        }
+        if (jmin < 0)
+            // The remaining f[] values are NaN: these points go to the end (as the worst ones)
+        {
+            if (j == 0)
+                // All f[] values are NaN
+                f[0] = 1e30;
+            for (int j2=0; j2<N_PARAMS+1; j2++)
+                if (ind2[j2] == 0)
+                {
+                    ind[j] = j2;
+                    j++;
+                }
+            break;
+        }
+        ind[j] = jmin;
+        ind2[jmin] = 1;
+    }
+
+    // Simplex centroid:
+    for (i=0; i<N_PARAMS; i++)
+    {
+        CHI_FLOAT sum = 0.0;
+        for (j=0; j<N_PARAMS+1; j++)
+            sum = sum + x[j][i];
+        x0[i] = sum / (N_PARAMS+1);
+    }
+
+    // Simplex size squared:
+    CHI_FLOAT size2 = 0.0;
+    for (j=0; j<N_PARAMS+1; j++)
+    {
+        CHI_FLOAT sum = 0.0;
+        for (i=0; i<N_PARAMS; i++)
+        {
+            CHI_FLOAT dx = x[j][i] - x0[i];
+            sum = sum + dx*dx;
+        }
+        size2 = size2 + sum;
+    }
+    return size2 / N_PARAMS;
+}
+
+
+//++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+
+/* Work pool. There are no stage barriers: every worker (an OpenMP thread, or a BATCH lane) takes a new work item as soon as its
+ * simplex run is finished. When the last run of a block is finished, the block reduction is done right away (by the thread which
+ * finished it), and the block's BSIZE runs of the next stage are queued; they take precedence over the remaining initial-stage
+ * runs. The final result of a block goes straight to d_f, d_params, d_dV. The run id always uses the random numbers stream
+ * globalState[id], and its stage s+1 run starts after its stage s run is finished, so the results are the same as with
+ * stage-synchronous scheduling, for any number of threads.
+ */
+
+struct simplex_pool {
+    int next_id;       // Next initial-stage work item to start
+    int N_threads;     // Total number of initial-stage work items
+    int N_blocks;
+    int Nstages;
+    int N_done;        // Number of blocks with all the stages finished
+    int *queue;        // Queued (next stage) work items: a ring buffer of N_blocks*BSIZE items
+    int q_head, q_tail;
+    int *block_left;   // Number of unfinished runs of the current stage, per block
+    int *block_stage;  // Current stage, per block
+    CHI_FLOAT *s_f;
+    CHI_FLOAT (*x_min)[N_PARAMS];
+    CHI_FLOAT (*s_x0)[N_PARAMS];
+    struct x2_struct *s_x2_params;
+    curandState *globalState;
+    // Final results of the blocks (chi2_cpu; NULL when only the runs are needed, in simplex_runs_cpu):
+    CHI_FLOAT *d_f;
+    double *d_params;
+    double *d_dV;
+    struct obs_data *dData;
+    int N_data, N_filters;
+    struct chi2_struct *sp;
+    // Preset random numbers placing the initial points of the initial-stage runs (-start halton, -surrogate; NULL: random):
+    CHI_FLOAT (*u_start)[N_PARAMS];
+    // Results of the initial-stage random-start runs (-surrogate; NULL if not needed):
+    CHI_FLOAT *f_start;
+};
+
+
+static void pool_init(struct simplex_pool *pool, int N_runs, int Nstages, CHI_FLOAT *s_f, CHI_FLOAT (*x_min)[N_PARAMS],
+                      CHI_FLOAT (*s_x0)[N_PARAMS], struct x2_struct *s_x2_params, curandState* globalState)
+{
+    pool->next_id = 0;
+    pool->N_threads = N_runs;
+    pool->N_blocks = (N_runs+BSIZE-1) / BSIZE;
+    pool->Nstages = Nstages;
+    pool->N_done = 0;
+    pool->queue = (int *)malloc(pool->N_blocks * BSIZE * sizeof(int));
+    pool->q_head = 0;
+    pool->q_tail = 0;
+    pool->block_left = (int *)malloc(pool->N_blocks * sizeof(int));
+    pool->block_stage = (int *)malloc(pool->N_blocks * sizeof(int));
+    for (int iblock=0; iblock<pool->N_blocks; iblock++)
+    {
+        pool->block_left[iblock] = iblock<pool->N_blocks-1? BSIZE : N_runs - iblock*BSIZE;
+        pool->block_stage[iblock] = 0;
+    }
+    pool->s_f = s_f;
+    pool->x_min = x_min;
+    pool->s_x0 = s_x0;
+    pool->s_x2_params = s_x2_params;
+    pool->globalState = globalState;
+    pool->d_f = NULL;
+    pool->d_params = NULL;
+    pool->d_dV = NULL;
+    pool->u_start = NULL;
+    pool->f_start = NULL;
+    return;
+}
+
+
+static void pool_free(struct simplex_pool *pool)
+{
+    free(pool->queue);
+    free(pool->block_left);
+    free(pool->block_stage);
+    return;
+}
+
+
+static int pool_take(struct simplex_pool *pool)
+// The next work item: a queued next-stage run, or a new initial-stage run. Returns -1 if there is nothing to do at the moment
+// (but some blocks are still running, and may queue more work), and -2 when all the work is done.
+{
+    int id;
+    #pragma omp critical(simplex_pool)
+    {
+        if (pool->q_head < pool->q_tail)
+        {
+            id = pool->queue[pool->q_head % (pool->N_blocks*BSIZE)];
+            pool->q_head++;
+        }
+        else if (pool->next_id < pool->N_threads)
+            id = pool->next_id++;
+        else
+            id = pool->N_done == pool->N_blocks? -2 : -1;
+    }
+    return id;
+}
+
+
+static CHI_FLOAT *pool_u0(struct simplex_pool *pool, int id)
+// The preset random numbers for the initial point of the run id (NULL if random)
+{
+    return pool->u_start != NULL? pool->u_start[id] : NULL;
+}
+
+
+static void pool_wait()
+// Waiting for more work to be queued (running pending OpenMP tasks meanwhile, if any)
+{
+    #pragma omp taskyield
+    sched_yield();
+    return;
+}
+
+
+static void pool_block(struct simplex_pool *pool, int iblock)
+// All the runs of the current stage of the block are finished: the block reduction, and either queueing the runs of the next
+// stage, or storing the final result
+{
+    int id0 = iblock * BSIZE;
+    int id1 = id0+BSIZE < pool->N_threads? id0+BSIZE : pool->N_threads;
+    double params[N_PARAMS];
+    CHI_FLOAT delta_V[N_FILTERS];
+    struct x2_struct *s_x2_params = &pool->s_x2_params[iblock];
+
+    if (pool->f_start != NULL && pool->block_stage[iblock] == 0 && s_x2_params->reopt == 0)
+        // The results of the random-start runs, for the surrogate model (-surrogate):
+        for (int id=id0; id<id1; id++)
+            pool->f_start[id] = pool->s_f[id];
+
+    // The first smallest chi2 wins, as in chi2_gpu:
+    int thread_min = id0;
+    CHI_FLOAT smin = HUGE;
+    for (int id=id0; id<id1; id++)
+        if (pool->s_f[id] < smin)
+        {
+            smin = pool->s_f[id];
+            thread_min = id;
+        }
+    CHI_FLOAT *xb = pool->x_min[thread_min];
+
+    if (pool->block_stage[iblock] < pool->Nstages-1)
+        // When Nstages>1, for each block the best point is used to run reoptimization
+    {
+        #if defined(P_PSI) || defined(P_PHI) || defined(P_BOTH)
+        // Switching the meaning of x for L parameter, when reopt changes from 0 to 1:
+        if (s_x2_params->reopt == 0)
+        {
+            x2params(xb, params, sLimits, s_x2_params, sProperty, sTypes);
+            params2x(xb, params, sLimits, sProperty, sTypes, s_x2_params);
+        }
+        #endif
+        for (int i=0; i<N_PARAMS; i++)
+            pool->s_x0[iblock][i] = xb[i];
+        s_x2_params->reopt = 1;
+        pool->block_stage[iblock]++;
+        #pragma omp critical(simplex_pool)
+        {
+            pool->block_left[iblock] = id1 - id0;
+            for (int id=id0; id<id1; id++)
+            {
+                pool->queue[pool->q_tail % (pool->N_blocks*BSIZE)] = id;
+                pool->q_tail++;
+            }
+        }
+        return;
+    }
+
+    if (pool->d_f != NULL && smin < pool->d_f[iblock])
+        // Keeping the current best result if it's better than the previous result for the same block
+    {
+        pool->d_f[iblock] = smin;
+        x2params(xb, params, sLimits, s_x2_params, sProperty, sTypes);
+        // Recomputing delta_V for the best point:
+        chi2one(params, pool->dData, pool->N_data, pool->N_filters, delta_V, 0, pool->sp, sTypes);
+        for (int i=0; i<N_PARAMS; i++)
+            pool->d_params[iblock*N_PARAMS + i] = params[i];
+        for (int m=0; m<pool->N_filters; m++)
+            pool->d_dV[iblock*N_FILTERS + m] = delta_V[m];
+    }
+    #pragma omp critical(simplex_pool)
+    pool->N_done++;
+    return;
+}
+
+
+static void pool_done(struct simplex_pool *pool, int id)
+// The run id is finished (its results are in s_f[id], x_min[id])
+{
+    int iblock = id / BSIZE;
+    int left;
+    #pragma omp critical(simplex_pool)
+    left = --pool->block_left[iblock];
+    if (left == 0)
+        pool_block(pool, iblock);
+    return;
+}
+
+
+#ifndef BATCH
+static CHI_FLOAT simplex_cpu(CHI_FLOAT *x_best, CHI_FLOAT *x_start, struct obs_data *dData, int N_data, int N_filters,
+                             struct chi2_struct *sp, struct x2_struct *s_x2_params, curandState *localState, const CHI_FLOAT *u0)
+// One downhill simplex run (the body of the istage loop of chi2_gpu kernel). x_start is the initial point
+// (only used when reoptimizing), u0 the preset random numbers for the initial point (NULL: random; see simplex_init). Returns the chi2 of the best point (1e30 if failed), and the point itself in x_best.
+{
+    int i, j;
+    double params[N_PARAMS];
+    CHI_FLOAT delta_V[N_FILTERS];
+    int ind[N_PARAMS+1]; // Indexes to the sorted array (point index)
+    CHI_FLOAT x[N_PARAMS+1][N_PARAMS];  // simplex points (point index, coordinate)
+    CHI_FLOAT f[N_PARAMS+1]; // chi2 values for the simplex edges (point index)
+    CHI_FLOAT x0[N_PARAMS], x_r[N_PARAMS], x_e[N_PARAMS];
+
+    ind[0] = 0;
+
+    //Simplex steps counter:
+    int l = 0;
+    // chi2 evaluations counter:
+    int n_eval = 0;
+
+    bool failed;
+    #ifdef P_BOTH
+    while (1)
+    {
+    #endif
+        simplex_init(x, x_start, s_x2_params, localState, u0);
+        // (P_BOTH restarts use random points)
+        u0 = NULL;
+
+        // Computing the initial function values (chi2):
+        failed = 0;
+        for (j=0; j<N_PARAMS+1; j++)
+        {
+            if (x2params(x[j], params, sLimits, s_x2_params, sProperty, sTypes))
+            {
+                failed = 1;
+                break;
+            }
+            f[j] = chi2one(params, dData, N_data, N_filters, delta_V, 0, sp, sTypes);
+            n_eval++;
+        }
+
+    #ifdef P_BOTH
+        if (failed == 0)
+            break;
+    }
+    #endif
+
+    // Frozen coordinates are never updated in the trial points:
+    for (i=0; i<N_PARAMS; i++)
+    {
+        x_r[i] = x[0][i];
+        x_e[i] = x[0][i];
+    }
+
+    // The main simplex loop
+    while (1)
+    {
+        if (failed == 1)
+            break;
+        l++;
+
+        CHI_FLOAT size2 = simplex_sort(x, f, ind, x0);
+
+        if (size2 < SIZE2_MIN)
+            // We converged
+            break;
+        if (l > N_STEPS)
+            // We ran out of time
+            break;
+
+        // Reflection
+        for (i=0; i<N_PARAMS; i++)
+        {
+            if (sProperty[i][P_frozen] != 1)
+                x_r[i] = x0[i] + ALPHA_SIM*(x0[i] - x[ind[N_PARAMS]][i]);
+        }
+        CHI_FLOAT f_r;
+        if (x2params(x_r,params,sLimits, s_x2_params, sProperty, sTypes))
+            f_r = 1e30;
+        else
+        {
+            f_r = chi2one(params, dData, N_data, N_filters, delta_V, 0, sp, sTypes);
+            n_eval++;
+        }
+        if (f_r >= f[ind[0]] && f_r < f[ind[N_PARAMS-1]])
+        {
+            for (i=0; i<N_PARAMS; i++)
+                x[ind[N_PARAMS]][i] = x_r[i];
+            f[ind[N_PARAMS]] = f_r;
+            continue;
+        }
+
+        // Expansion
+        if (f_r < f[ind[0]])
+        {
+            for (i=0; i<N_PARAMS; i++)
+            {
+                if (sProperty[i][P_frozen] != 1)
+                    x_e[i] = x0[i] + GAMMA_SIM*(x_r[i] - x0[i]);
+            }
+            CHI_FLOAT f_e;
+            if (x2params(x_e,params,sLimits, s_x2_params, sProperty, sTypes))
+                f_e = 1e30;
+            else
+            {
+                f_e = chi2one(params, dData, N_data, N_filters, delta_V, 0, sp, sTypes);
+                n_eval++;
+            }
+            if (f_e < f_r)
+            {
+                for (i=0; i<N_PARAMS; i++)
+                    x[ind[N_PARAMS]][i] = x_e[i];
+                f[ind[N_PARAMS]] = f_e;
+            }
+            else
+            {
+                for (i=0; i<N_PARAMS; i++)
+                    x[ind[N_PARAMS]][i] = x_r[i];
+                f[ind[N_PARAMS]] = f_r;
+            }
+            continue;
+        }
+
+        // Contraction
+        for (i=0; i<N_PARAMS; i++)
+        {
+            if (sProperty[i][P_frozen] != 1)
+                x_r[i] = x0[i] + RHO_SIM*(x[ind[N_PARAMS]][i] - x0[i]);
+        }
+        if (x2params(x_r,params,sLimits, s_x2_params, sProperty, sTypes))
+            f_r = 1e30;
+        else
+        {
+            f_r = chi2one(params, dData, N_data, N_filters, delta_V, 0, sp, sTypes);
+            n_eval++;
+        }
+        if (f_r < f[ind[N_PARAMS]])
+        {
+            for (i=0; i<N_PARAMS; i++)
+                x[ind[N_PARAMS]][i] = x_r[i];
+            f[ind[N_PARAMS]] = f_r;
+            continue;
+        }
+        bool bad = 0;
+
+        // If all else fails - shrink
+        for (j=1; j<N_PARAMS+1; j++)
+        {
+            for (i=0; i<N_PARAMS; i++)
+            {
+                if (sProperty[i][P_frozen] != 1)
+                    x[ind[j]][i] = x[ind[0]][i] + SIGMA_SIM*(x[ind[j]][i] - x[ind[0]][i]);
+            }
+            if (x2params(x[ind[j]],params,sLimits, s_x2_params, sProperty, sTypes))
+                bad = 1;
+            else
+            {
+                f[ind[j]] = chi2one(params, dData, N_data, N_filters, delta_V, 0, sp, sTypes);
+                n_eval++;
+            }
+        }
+        if (bad)
+        {
+            failed = 1;
+            break;
+        }
+
+    }  // simplex loop
+
+    for (i=0; i<N_PARAMS; i++)
+        x_best[i] = x[ind[0]][i];
+
+    #pragma omp atomic
+    h_simplex_steps += l;
+    #pragma omp atomic
+    h_simplex_evals += n_eval;
+
+    if (failed == 1)
+        return 1e30;
+    else
+        return f[ind[0]];
+}
+
+
+
+#ifdef SPECULATIVE
+static int simplex_eval(CHI_FLOAT **xp, int n, CHI_FLOAT *f, struct obs_data *dData, int N_data, int N_filters,
+                        struct chi2_struct *sp, struct x2_struct *s_x2_params)
+// Computing chi2 for the n simplex points xp[] concurrently (OpenMP tasks). f=1e30 for the points where x2params fails.
+// Returns the number of such points.
+{
+    int n_bad = 0;
+    #pragma omp taskloop grainsize(1) reduction(+:n_bad)
+    for (int k=0; k<n; k++)
+    {
+        double params[N_PARAMS];
+        CHI_FLOAT delta_V[N_FILTERS];
+        if (x2params(xp[k], params, sLimits, s_x2_params, sProperty, sTypes))
+        {
+            f[k] = 1e30;
+            n_bad++;
+        }
+        else
+            f[k] = chi2one(params, dData, N_data, N_filters, delta_V, 0, sp, sTypes);
+    }
+    #pragma omp atomic
+    h_simplex_evals += n - n_bad;
+    return n_bad;
+}
+
+
+static CHI_FLOAT simplex_spec(CHI_FLOAT *x_best, CHI_FLOAT *x_start, struct obs_data *dData, int N_data, int N_filters,
+                              struct chi2_struct *sp, struct x2_struct *s_x2_params, curandState *localState, const CHI_FLOAT *u0)
+// Speculative version of simplex_cpu: all the candidate points of a simplex step (reflection, expansion and contraction) are
+// evaluated at once, before knowing which of them are needed, and so are the initial and the shrunk vertices (simplex_eval).
+// The sequence of the simplex points is the same as in simplex_cpu; the wall clock time per step is ~one chi2one call when
+// there are enough idle cores, at the cost of ~2.5x more chi2 evaluations.
+{
+    int i, j;
+    int ind[N_PARAMS+1]; // Indexes to the sorted array (point index)
+    CHI_FLOAT x[N_PARAMS+1][N_PARAMS];  // simplex points (point index, coordinate)
+    CHI_FLOAT f[N_PARAMS+1]; // chi2 values for the simplex edges (point index)
+    CHI_FLOAT x0[N_PARAMS], x_r[N_PARAMS], x_e[N_PARAMS], x_c[N_PARAMS];
+    CHI_FLOAT *xp[N_PARAMS+1];  // Points to evaluate
+    CHI_FLOAT fp[N_PARAMS+1];
+
+    ind[0] = 0;
+
+    //Simplex steps counter:
+    int l = 0;
+
+    bool failed;
+    #ifdef P_BOTH
+    while (1)
+    {
+    #endif
+        simplex_init(x, x_start, s_x2_params, localState, u0);
+        // (P_BOTH restarts use random points)
+        u0 = NULL;
+
+        // Computing the initial function values (chi2):
+        for (j=0; j<N_PARAMS+1; j++)
+            xp[j] = x[j];
+        failed = simplex_eval(xp, N_PARAMS+1, f, dData, N_data, N_filters, sp, s_x2_params) > 0;
+
+    #ifdef P_BOTH
+        if (failed == 0)
+            break;
+    }
+    #endif
+
+    // Frozen coordinates are never updated in the trial points:
+    for (i=0; i<N_PARAMS; i++)
+    {
+        x_r[i] = x[0][i];
+        x_e[i] = x[0][i];
+        x_c[i] = x[0][i];
+    }
+
+    // The main simplex loop
+    while (1)
+    {
+        if (failed == 1)
+            break;
+        l++;
+
+        CHI_FLOAT size2 = simplex_sort(x, f, ind, x0);
+
+        if (size2 < SIZE2_MIN)
+            // We converged
+            break;
+        if (l > N_STEPS)
+            // We ran out of time
+            break;
+
+        // Reflection, expansion and contraction points, evaluated together:
+        for (i=0; i<N_PARAMS; i++)
+        {
+            if (sProperty[i][P_frozen] != 1)
+            {
+                x_r[i] = x0[i] + ALPHA_SIM*(x0[i] - x[ind[N_PARAMS]][i]);
+                x_e[i] = x0[i] + GAMMA_SIM*(x_r[i] - x0[i]);
+                x_c[i] = x0[i] + RHO_SIM*(x[ind[N_PARAMS]][i] - x0[i]);
+            }
+        }
+        xp[0] = x_r;
+        xp[1] = x_e;
+        xp[2] = x_c;
+        simplex_eval(xp, 3, fp, dData, N_data, N_filters, sp, s_x2_params);
+        CHI_FLOAT f_r = fp[0], f_e = fp[1], f_c = fp[2];
+
+        // Reflection
+        if (f_r >= f[ind[0]] && f_r < f[ind[N_PARAMS-1]])
+        {
+            for (i=0; i<N_PARAMS; i++)
+                x[ind[N_PARAMS]][i] = x_r[i];
+            f[ind[N_PARAMS]] = f_r;
+            continue;
+        }
+
+        // Expansion
+        if (f_r < f[ind[0]])
+        {
+            if (f_e < f_r)
+            {
+                for (i=0; i<N_PARAMS; i++)
+                    x[ind[N_PARAMS]][i] = x_e[i];
+                f[ind[N_PARAMS]] = f_e;
+            }
+            else
+            {
+                for (i=0; i<N_PARAMS; i++)
+                    x[ind[N_PARAMS]][i] = x_r[i];
+                f[ind[N_PARAMS]] = f_r;
+            }
+            continue;
+        }
+
+        // Contraction
+        if (f_c < f[ind[N_PARAMS]])
+        {
+            for (i=0; i<N_PARAMS; i++)
+                x[ind[N_PARAMS]][i] = x_c[i];
+            f[ind[N_PARAMS]] = f_c;
+            continue;
+        }
+
+        // If all else fails - shrink (all the shrunk vertices evaluated together)
+        for (j=1; j<N_PARAMS+1; j++)
+        {
+            for (i=0; i<N_PARAMS; i++)
+            {
+                if (sProperty[i][P_frozen] != 1)
+                    x[ind[j]][i] = x[ind[0]][i] + SIGMA_SIM*(x[ind[j]][i] - x[ind[0]][i]);
+            }
+            xp[j-1] = x[ind[j]];
+        }
+        if (simplex_eval(xp, N_PARAMS, fp, dData, N_data, N_filters, sp, s_x2_params) > 0)
+        {
+            failed = 1;
+            break;
+        }
+        for (j=1; j<N_PARAMS+1; j++)
+            f[ind[j]] = fp[j-1];
+
+    }  // simplex loop
+
+    for (i=0; i<N_PARAMS; i++)
+        x_best[i] = x[ind[0]][i];
+
+    #pragma omp atomic
+    h_simplex_steps += l;
+
+    if (failed == 1)
+        return 1e30;
+    else
+        return f[ind[0]];
+}
+#endif // SPECULATIVE
+
+#else // BATCH
+
+/* In BATCH mode K_BATCH simplex runs advance together, one chi2 evaluation per run per chi2_batch call. Each run (lane) is
+ * a state machine, with a state for every place in the simplex_cpu loop where chi2one is called. When a run is finished,
+ * the lane picks up the next work item, so all the lanes are kept busy.
+ */
+
+// Lane states (which point is being evaluated):
+const int L_IDLE     = 0;  // No more work
+const int L_INIT     = 1;  // Initial simplex vertex x[j]
+const int L_REFLECT  = 2;  // Reflected point x_r
+const int L_EXPAND   = 3;  // Expanded point x_e
+const int L_CONTRACT = 4;  // Contracted point x_r
+const int L_SHRINK   = 5;  // Shrunk vertex x[ind[j]]
+
+struct simplex_lane {
+    int id;     // Work item index
+    int state;
+    int j;      // Vertex index (for L_INIT and L_SHRINK)
+    int l;      // Simplex steps counter
+    bool bad;
+    struct x2_struct *s_x2_params;
+    CHI_FLOAT *x_start;
+    int ind[N_PARAMS+1];
+    CHI_FLOAT x[N_PARAMS+1][N_PARAMS];
+    CHI_FLOAT f[N_PARAMS+1];
+    CHI_FLOAT x0[N_PARAMS], x_r[N_PARAMS], x_e[N_PARAMS];
+    CHI_FLOAT f_r;
+};
+
+static int lane_start(struct simplex_lane *lane, struct simplex_pool *pool)
+// Taking the next work item from the pool, and placing its initial simplex. Returns the pool_take code (<0: the lane stays idle)
+{
+    int id = pool_take(pool);
+    if (id < 0)
+    {
+        lane->state = L_IDLE;
+        return id;
+    }
+    int iblock = id / BSIZE;
+    lane->id = id;
+    lane->s_x2_params = &pool->s_x2_params[iblock];
+    lane->x_start = pool->s_x0[iblock];
+    lane->l = 0;
+    lane->ind[0] = 0;
+    simplex_init(lane->x, lane->x_start, lane->s_x2_params, &pool->globalState[id], pool_u0(pool, id));
+    for (int i=0; i<N_PARAMS; i++)
+    {
+        lane->x_r[i] = lane->x[0][i];
+        lane->x_e[i] = lane->x[0][i];
+    }
+    lane->state = L_INIT;
+    lane->j = 0;
+    return id;
+}
+
+
+static void lane_finish(struct simplex_lane *lane, struct simplex_pool *pool, CHI_FLOAT f)
+{
+    #pragma omp atomic
+    h_simplex_steps += lane->l;
+    pool->s_f[lane->id] = f;
+    for (int i=0; i<N_PARAMS; i++)
+        pool->x_min[lane->id][i] = lane->x[lane->ind[0]][i];
+    pool_done(pool, lane->id);
+    lane_start(lane, pool);
+    return;
+}
+
+
+static void lane_step(struct simplex_lane *lane, struct simplex_pool *pool)
+// The beginning of the simplex loop: sorting, convergence test, and the reflected point
+{
+    lane->l++;
+    CHI_FLOAT size2 = simplex_sort(lane->x, lane->f, lane->ind, lane->x0);
+    if (size2 < SIZE2_MIN || lane->l > N_STEPS)
+    {
+        lane_finish(lane, pool, lane->f[lane->ind[0]]);
+        return;
+    }
+    for (int i=0; i<N_PARAMS; i++)
+        if (sProperty[i][P_frozen] != 1)
+            lane->x_r[i] = lane->x0[i] + ALPHA_SIM*(lane->x0[i] - lane->x[lane->ind[N_PARAMS]][i]);
+    lane->state = L_REFLECT;
+    return;
+}
+
+
+static CHI_FLOAT * lane_point(struct simplex_lane *lane)
+// The point to be evaluated next
+{
+    switch (lane->state)
+    {
+        case L_INIT:     return lane->x[lane->j];
+        case L_REFLECT:  return lane->x_r;
+        case L_EXPAND:   return lane->x_e;
+        case L_CONTRACT: return lane->x_r;
+        case L_SHRINK:   return lane->x[lane->ind[lane->j]];
+    }
+    return NULL;
+}
+
+
+static void lane_advance(struct simplex_lane *lane, struct simplex_pool *pool, CHI_FLOAT f, int failed)
+// Processing the chi2 value f of the current point (failed=1 if x2params failed), and moving to the next point
+{
+    int i;
+    int *ind = lane->ind;
+    CHI_FLOAT (*x)[N_PARAMS] = lane->x;
+    if (failed)
+        f = 1e30;
+
+    switch (lane->state)
+    {
+    case L_INIT:
+        if (failed)
+        {
+            #ifdef P_BOTH
+            // Trying another initial simplex:
+            simplex_init(lane->x, lane->x_start, lane->s_x2_params, &pool->globalState[lane->id], NULL);
+            lane->j = 0;
+            #else
+            lane_finish(lane, pool, 1e30);
+            #endif
+            return;
+        }
+        lane->f[lane->j] = f;
+        lane->j++;
+        if (lane->j == N_PARAMS+1)
+            lane_step(lane, pool);
+        return;
+
+    case L_REFLECT:
+        lane->f_r = f;
+        if (f >= lane->f[ind[0]] && f < lane->f[ind[N_PARAMS-1]])
+        {
+            for (i=0; i<N_PARAMS; i++)
+                x[ind[N_PARAMS]][i] = lane->x_r[i];
+            lane->f[ind[N_PARAMS]] = f;
+            lane_step(lane, pool);
+        }
+        else if (f < lane->f[ind[0]])
+        {
+            for (i=0; i<N_PARAMS; i++)
+                if (sProperty[i][P_frozen] != 1)
+                    lane->x_e[i] = lane->x0[i] + GAMMA_SIM*(lane->x_r[i] - lane->x0[i]);
+            lane->state = L_EXPAND;
+        }
+        else
+        {
+            for (i=0; i<N_PARAMS; i++)
+                if (sProperty[i][P_frozen] != 1)
+                    lane->x_r[i] = lane->x0[i] + RHO_SIM*(x[ind[N_PARAMS]][i] - lane->x0[i]);
+            lane->state = L_CONTRACT;
+        }
+        return;
+
+    case L_EXPAND:
+        if (f < lane->f_r)
+        {
+            for (i=0; i<N_PARAMS; i++)
+                x[ind[N_PARAMS]][i] = lane->x_e[i];
+            lane->f[ind[N_PARAMS]] = f;
+        }
+        else
+        {
+            for (i=0; i<N_PARAMS; i++)
+                x[ind[N_PARAMS]][i] = lane->x_r[i];
+            lane->f[ind[N_PARAMS]] = lane->f_r;
+        }
+        lane_step(lane, pool);
+        return;
+
+    case L_CONTRACT:
+        if (f < lane->f[ind[N_PARAMS]])
+        {
+            for (i=0; i<N_PARAMS; i++)
+                x[ind[N_PARAMS]][i] = lane->x_r[i];
+            lane->f[ind[N_PARAMS]] = f;
+            lane_step(lane, pool);
+            return;
+        }
+        lane->bad = 0;
+        lane->j = 0;
+        // Falling through to the shrinking of the first vertex
+
+    case L_SHRINK:
+        if (lane->state == L_SHRINK)
+        {
+            if (failed)
+                lane->bad = 1;
+            else
+                lane->f[ind[lane->j]] = f;
+        }
+        lane->j++;
+        if (lane->j < N_PARAMS+1)
+        {
+            for (i=0; i<N_PARAMS; i++)
+                if (sProperty[i][P_frozen] != 1)
+                    x[ind[lane->j]][i] = x[ind[0]][i] + SIGMA_SIM*(x[ind[lane->j]][i] - x[ind[0]][i]);
+            lane->state = L_SHRINK;
+        }
+        else if (lane->bad)
+            lane_finish(lane, pool, 1e30);
+        else
+            lane_step(lane, pool);
+        return;
+    }
+    return;
+}
+
+
+static void simplex_batch(struct simplex_pool *pool, struct obs_data *dData, int N_data, int N_filters, struct chi2_struct *sp)
+// Running simplex work items from the pool in K_BATCH lanes, until all the work is done
+{
+    struct simplex_lane *lane = (struct simplex_lane *)malloc(K_BATCH * sizeof(struct simplex_lane));
+    double params[N_PARAMS];
+    double pb[N_PARAMS][K_BATCH];
+    CHI_FLOAT fb[K_BATCH];
+    int failed[K_BATCH];
+    long long int n_eval = 0;
+
+    for (int k=0; k<K_BATCH; k++)
+        lane[k].state = L_IDLE;
+
+    while (1)
+    {
+        // Idle lanes take new work items (including the next-stage runs queued by the blocks finished in the meantime):
+        int code = 0;
+        int active = 0;
+        for (int k=0; k<K_BATCH; k++)
+        {
+            if (lane[k].state == L_IDLE && code >= 0)
+                code = lane_start(&lane[k], pool);
+            active = active || lane[k].state != L_IDLE;
+        }
+        if (!active)
+        {
+            if (code == -2)
+                break;
+            pool_wait();
+            continue;
+        }
+
+        // Converting the current points of all lanes to physical parameters:
+        int k_good = -1;
+        for (int k=0; k<K_BATCH; k++)
+        {
+            failed[k] = 1;
+            if (lane[k].state == L_IDLE)
+                continue;
+            if (x2params(lane_point(&lane[k]), params, sLimits, lane[k].s_x2_params, sProperty, sTypes) == 0)
+            {
+                failed[k] = 0;
+                k_good = k;
+                n_eval++;
+                for (int i=0; i<N_PARAMS; i++)
+                    pb[i][k] = params[i];
+            }
+        }
+        if (k_good >= 0)
+        {
+            // Unused lanes get a copy of a good model:
+            for (int k=0; k<K_BATCH; k++)
+                if (failed[k])
+                    for (int i=0; i<N_PARAMS; i++)
+                        pb[i][k] = pb[i][k_good];
+            chi2_batch(pb, dData, N_data, N_filters, fb, NULL, sp);
+        }
+
+        for (int k=0; k<K_BATCH; k++)
+            if (lane[k].state != L_IDLE)
+                lane_advance(&lane[k], pool, fb[k], failed[k]);
+    }
+
+    #pragma omp atomic
+    h_simplex_evals += n_eval;
+    free(lane);
+    return;
+}
+#endif // BATCH
+
+
+//++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+
+static void pool_run(struct simplex_pool *pool, struct obs_data *dData, int N_data, int N_filters, struct chi2_struct *sp)
+// Running all the work of the pool: the simplex runs are shared between the OpenMP threads (and, in BATCH mode, the K_BATCH
+// lanes of each thread). Work item id uses the initial point s_x0[id/BSIZE] and s_x2_params[id/BSIZE] of its block (as they are
+// when the run starts); the results go to s_f[id], x_min[id]
+{
+    #pragma omp parallel
+    {
+        #ifdef BATCH
+        simplex_batch(pool, dData, N_data, N_filters, sp);
+        #else
+        while (1)
+        {
+            int id = pool_take(pool);
+            if (id == -2)
+                break;
+            if (id == -1)
+            {
+                pool_wait();
+                continue;
+            }
+            int iblock = id / BSIZE;
+            #ifdef SPECULATIVE
+            // Each chi2 evaluation of the run is an OpenMP task (simplex_eval); the threads waiting for work (at the end) pick
+            // up the evaluations of the runs in progress, so fewer runs than threads still keep all the cores busy:
+            pool->s_f[id] = simplex_spec(pool->x_min[id], pool->s_x0[iblock], dData, N_data, N_filters, sp, &pool->s_x2_params[iblock], &pool->globalState[id], pool_u0(pool, id));
+            #else
+            pool->s_f[id] = simplex_cpu(pool->x_min[id], pool->s_x0[iblock], dData, N_data, N_filters, sp, &pool->s_x2_params[iblock], &pool->globalState[id], pool_u0(pool, id));
+            #endif
+            pool_done(pool, id);
+        }
+        #endif
+    }
+    return;
+}
+
+
+//++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+
+void chi2_cpu (struct obs_data *dData, int N_data, int N_filters, int reopt, int Nstages,
+               curandState* globalState, CHI_FLOAT *d_f, double* d_params, double* d_dV)
+// CPU version of chi2_gpu kernel. All the stages of all the blocks run from one work pool (see pool_block).
+{
+    const int N_threads = N_BLOCKS * BSIZE;
+    struct chi2_struct sp;
+    struct x2_struct s_x2_params[N_BLOCKS];  // reopt changes per block when Nstages>1
+    CHI_FLOAT s_x0[N_BLOCKS][N_PARAMS];      // Starting (best) point for each block
+    double params[N_PARAMS];
+    struct simplex_pool pool;
+
+    // Results of individual simplex runs:
+    CHI_FLOAT *s_f = (CHI_FLOAT *)malloc(N_threads * sizeof(CHI_FLOAT));
+    CHI_FLOAT (*x_min)[N_PARAMS] = (CHI_FLOAT (*)[N_PARAMS])malloc(N_threads * N_PARAMS * sizeof(CHI_FLOAT));
+
+    init_chi2_struct(&sp);
+    for (int iblock=0; iblock<N_BLOCKS; iblock++)
+        init_x2_struct(&s_x2_params[iblock], reopt);
+
+    if (reopt)
+    {
+        // Converting the initial point from physical to dimensionless (0...1 scale) parameters:
+        for (int i=0; i<N_PARAMS; i++)
+            params[i] = d_params0[i];
+        params2x(s_x0[0], params, sLimits, sProperty, sTypes, &s_x2_params[0]);
+        for (int iblock=1; iblock<N_BLOCKS; iblock++)
+            for (int i=0; i<N_PARAMS; i++)
+                s_x0[iblock][i] = s_x0[0][i];
+    }
+
+    // Island model (-island): the first d_N_migrants blocks reoptimize the models found by the other islands:
+    for (int iblock=0; iblock<d_N_migrants; iblock++)
+    {
+        s_x2_params[iblock].reopt = 1;
+        for (int i=0; i<N_PARAMS; i++)
+            params[i] = d_migrants[iblock][i];
+        params2x(s_x0[iblock], params, sLimits, sProperty, sTypes, &s_x2_params[iblock]);
+    }
+
+    pool_init(&pool, N_threads, Nstages, s_f, x_min, s_x0, s_x2_params, globalState);
+    if (h_surrogate || d_qmc != START_RANDOM)
+    {
+        // The initial points of the random-start runs: screened with the surrogate model, or low-discrepancy points:
+        pool.u_start = (CHI_FLOAT (*)[N_PARAMS])malloc(N_threads * N_PARAMS * sizeof(CHI_FLOAT));
+        if (h_surrogate)
+        {
+            pool.f_start = (CHI_FLOAT *)malloc(N_threads * sizeof(CHI_FLOAT));
+            for (int id=0; id<N_threads; id++)
+                pool.f_start[id] = 1e30;
+            surrogate_starts(N_threads, pool.u_start, globalState);
+        }
+        else
+            for (int id=0; id<N_threads; id++)
+                for (int i=0; i<N_PARAMS; i++)
+                    pool.u_start[id][i] = qmc_x(qmc_index(id), i);
+    }
+    pool.d_f = d_f;
+    pool.d_params = d_params;
+    pool.d_dV = d_dV;
+    pool.dData = dData;
+    pool.N_data = N_data;
+    pool.N_filters = N_filters;
+    pool.sp = &sp;
+
+    if (h_optimizer == OPT_DE)
+    {
+        // Differential evolution replaces the random-start simplex runs in the initial stage (-opt de); it is population based,
+        // so the initial stage is done for all the blocks at once:
+        de_stage(dData, N_data, N_filters, N_BLOCKS, s_f, x_min, s_x0, s_x2_params, globalState, &sp);
+        pool.next_id = N_threads;
+        for (int iblock=0; iblock<N_BLOCKS; iblock++)
+        {
+            pool.block_left[iblock] = 0;
+            pool_block(&pool, iblock);
+        }
+    }
+
+    pool_run(&pool, dData, N_data, N_filters, &sp);
+
+    if (pool.f_start != NULL)
+        // Adding the results of this call to the surrogate model:
+        surrogate_update(N_threads, pool.u_start, pool.f_start);
+
+    free(pool.u_start);
+    free(pool.f_start);
+    pool_free(&pool);
+    free(s_f);
+    free(x_min);
+    return;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+
+void simplex_runs_cpu (struct obs_data *dData, int N_data, int N_filters, int reopt, int N_runs,
+                       curandState* globalState, CHI_FLOAT *s_f)
+// N_runs (<= N_BLOCKS*BSIZE) simplex runs of one chi2_cpu stage, without the block reductions (used by the benchmark, bench.c).
+// The chi2 of the run results go to s_f. When reopt=1, the runs start from d_params0. With -opt de, N_runs/BSIZE differential
+// evolution populations instead (N_runs should be a multiple of BSIZE).
+{
+    struct chi2_struct sp;
+    const int N_blocks = (N_runs+BSIZE-1) / BSIZE;
+    struct x2_struct *s_x2_params = (struct x2_struct *)malloc(N_blocks * sizeof(struct x2_struct));
+    CHI_FLOAT (*s_x0)[N_PARAMS] = (CHI_FLOAT (*)[N_PARAMS])malloc(N_blocks * N_PARAMS * sizeof(CHI_FLOAT));
+    CHI_FLOAT (*x_min)[N_PARAMS] = (CHI_FLOAT (*)[N_PARAMS])malloc(N_runs * N_PARAMS * sizeof(CHI_FLOAT));
+    double params[N_PARAMS];
+
+    init_chi2_struct(&sp);
+    for (int iblock=0; iblock<N_blocks; iblock++)
+        init_x2_struct(&s_x2_params[iblock], reopt);
+    if (reopt)
+    {
+        for (int i=0; i<N_PARAMS; i++)
+            params[i] = d_params0[i];
+        params2x(s_x0[0], params, sLimits, sProperty, sTypes, &s_x2_params[0]);
+        for (int iblock=1; iblock<N_blocks; iblock++)
+            for (int i=0; i<N_PARAMS; i++)
+                s_x0[iblock][i] = s_x0[0][i];
+    }
+
+    if (h_optimizer == OPT_DE)
+        de_stage(dData, N_data, N_filters, N_blocks, s_f, x_min, s_x0, s_x2_params, globalState, &sp);
+    else
+    {
+        struct simplex_pool pool;
+        pool_init(&pool, N_runs, 1, s_f, x_min, s_x0, s_x2_params, globalState);
+        pool_run(&pool, dData, N_data, N_filters, &sp);
+        pool_free(&pool);
+    }
+
+    free(s_x2_params);
+    free(s_x0);
+    free(x_min);
+    return;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+
+void chi2_plot_cpu (struct obs_data *dData, int N_data, int N_filters,
+                    struct obs_data *dPlot, int Nplot, double * d_dlsq2, float dx_rand)
+// CPU version of chi2_plot kernel
+{
+    CHI_FLOAT delta_V[N_FILTERS];
+    struct chi2_struct sp;
+    struct x2_struct s_x2_params;
+    double params[N_PARAMS];
+    #if defined(SPHERICAL_K) && defined(TORQUE) && defined(PROFILES)
+    double phi0, K0, theta0;
+    int iseg=0;
+    #endif
+
+    init_chi2_struct(&sp);
+    init_x2_struct(&s_x2_params, 1);
+
+    for (int i=0; i<N_PARAMS; i++)
+        params[i] = d_params0[i];
+
+    // Step one: computing constants for each filter (delta_V[]) using chi^2 method, and the chi2 value
+    d_chi2_plot = chi2one(params, dData, N_data, N_filters, delta_V, -1,  &sp, sTypes);
+    for (int m=0; m<N_filters; m++)
+        d_delta_V[m] = delta_V[m];
+
+    #ifdef SEGMENT
+    for (int i=0; i<N_SEG; i++)
+        sp.start_seg[i] = d_plot_start_seg[i];
+    #endif
+
+    // Step two: computing the Nplots data points using the delta_V values from above. With DENSE_PLOT, the plot grid is split
+    // into contiguous parts computed in parallel: the (sequential) integration is done once, storing all its nodes, and the
+    // parts only interpolate the Euler angles between the nodes and compute the brightness:
+    #ifdef DENSE_PLOT
+    int N_parts = omp_get_max_threads();
+    #else
+    int N_parts = 1;
+    #endif
+    int n = (Nplot + N_parts - 1) / N_parts;
+    #if defined(DENSE_PLOT) && !defined(ANALYTIC)
+    if (N_parts > 1)
+    {
+        sp.plot_nodes = d_plot_nodes;
+        sp.plot_N_nodes = d_plot_N_nodes;
+        sp.plot_i1 = sp.plot_i2 = -1;
+        chi2one(params, dPlot, Nplot, N_filters, delta_V, Nplot,  &sp, sTypes);
+    }
+    #endif
+    #pragma omp parallel for schedule(static)
+    for (int ip=0; ip<N_parts; ip++)
+    {
+        struct chi2_struct sp1 = sp;
+        double params1[N_PARAMS];
+        CHI_FLOAT delta_V1[N_FILTERS];
+        for (int i=0; i<N_PARAMS; i++)
+            params1[i] = params[i];
+        for (int m=0; m<N_filters; m++)
+            delta_V1[m] = delta_V[m];
+        sp1.plot_i1 = ip * n;
+        sp1.plot_i2 = sp1.plot_i1 + n;
+        if (sp1.plot_i1 < Nplot)
+            chi2one(params1, dPlot, Nplot, N_filters, delta_V1, Nplot,  &sp1, sTypes);
+    }
+
+    // The least squares distances between the data points and the plot curve:
+    #pragma omp parallel for
+    for (int i=0; i<N_data; i++)
+        d_dlsq2[i] = dlsq2_point(dData, i, dPlot, Nplot, d_Vmod, d_delta_V);
+
+    #ifdef PROFILES
+    #if defined(SPHERICAL_K) && defined(TORQUE)
+    // Converting torque vector from Cartesian to spherical coordinates, for confidence interval estimation
+    double Is = (1.0 + P_b_tumb*P_b_tumb) / (P_b_tumb*P_b_tumb + P_c_tumb*P_c_tumb);
+    double Ii = (1.0 + P_c_tumb*P_c_tumb) / (P_b_tumb*P_b_tumb + P_c_tumb*P_c_tumb);
+    double Ki = Ii * P_Ti;
+    double Ks = Is * P_Ts;
+    double Kl = P_Tl;
+    K0 = sqrt(Ki*Ki + Ks*Ks + Kl*Kl);  // r
+    theta0 = acos(Kl/K0);  // theta (polar angle; 0..pi)
+    phi0 = atan2(Ks, Ki);  // phi (azimuthal angle; 0..2*pi) for the input model
+    #endif
+
+    // Cross-sections along all parameter dimensions, C_POINTS*BSIZE points per parameter:
+    #pragma omp parallel for collapse(2) schedule(dynamic)
+    for (int iparam=0; iparam<N_PARAMS; iparam++)
+    for (int id=0; id<C_POINTS*BSIZE; id++)
+    {
+        CHI_FLOAT x[N_PARAMS];
+        double params[N_PARAMS];
+        CHI_FLOAT delta_V[N_FILTERS];
+        struct x2_struct x2_params = s_x2_params;
+        #if defined(SPHERICAL_K) && defined(TORQUE)
+        int iseg=0;
+        #endif
+
+        for (int i=0; i<N_PARAMS; i++)
+            params[i] = d_params0[i];
+        params2x(x, params, sLimits, sProperty, sTypes, &x2_params);
+        #if defined(SPHERICAL_K) && defined(TORQUE)
+        x[sTypes[T_Ti][0]] = K0 / sLimits[1][T_Ti];
+        x[sTypes[T_Ts][0]] = theta0 / PI;
+        x[sTypes[T_Tl][0]] = phi0 / (2*PI);
+        #endif
+
+        // Changes from -DELTA_MAX to +DELTA_MAX:
+        double delta = 2.0 * dx_rand * ((id+1.0)/(C_POINTS*BSIZE) - 0.5);
+        x[iparam] = x[iparam] + delta;
+
+        x2params(x, params, sLimits, &x2_params, sProperty, sTypes);
+        #if defined(SPHERICAL_K) && defined(TORQUE)
+        double K = x[sTypes[T_Ti][0]] * sLimits[1][T_Ti];
+        double theta = x[sTypes[T_Ts][0]] * PI;
+        double phi = x[sTypes[T_Tl][0]] * 2*PI;
+        double Is = (1.0 + P_b_tumb*P_b_tumb) / (P_b_tumb*P_b_tumb + P_c_tumb*P_c_tumb);
+        double Ii = (1.0 + P_c_tumb*P_c_tumb) / (P_b_tumb*P_b_tumb + P_c_tumb*P_c_tumb);
+        P_Ti = K * cos(phi) * sin(theta) / Ii;
+        P_Ts = K * sin(phi) * sin(theta) / Is;
+        P_Tl = K * cos(theta);
+        #endif
+        // !!! Will not work in NUDGE mode - NULL
+        d_chi2_lines[iparam][id] = chi2one(params, dData, N_data, N_filters, delta_V, 0, &sp, sTypes);
+
+        #if defined(SPHERICAL_K) && defined(TORQUE)
+        P_Ti = K;
+        P_Ts = theta;
+        P_Tl = phi;
+        #endif
+
+        d_param_lines[iparam][id] = params[iparam];
+    }
+    #endif  // PROFILES
+
+    return;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+
+void setup_cpu ( curandState * state, unsigned long seed, CHI_FLOAT *d_f, int generate_seeds)
+// CPU version of setup_kernel
+{
+    if (generate_seeds)
+        // Generating initial states for all work items:
+        for (unsigned long long id=0; id<N_BLOCKS*BSIZE; id++)
+            curand_init ( (unsigned long long)seed, id, 0, &state[id] );
+
+    for (int iblock=0; iblock<N_BLOCKS; iblock++)
+        d_f[iblock] = 1e30;
+
+    return;
+}
+
+
+//--------------------------------------------------------------------------------------------------------------------------------------------------------------------------
+
+#ifdef RMSD
+void chi2_cpu_rms (struct obs_data *dData, int N_data, int N_filters, int reopt, int Nstages,
+                   curandState* globalState, CHI_FLOAT *d_f, double* d_params, double* d_dV, float dx_rand, float* dpar_min, float* dpar_max)
+// CPU version of chi2_gpu_rms kernel (confidence intervals using RMSD method)
+{
+    const int N_threads = N_BLOCKS * BSIZE;
+    struct chi2_struct sp;
+    struct x2_struct s_x2_params;
+    double params[N_PARAMS];
+    CHI_FLOAT delta_V[N_FILTERS];
+    CHI_FLOAT x0[N_PARAMS];
+    int Ntot = 0;
+    int Nbad = 0;
+
+    // Min/max parameter values found by individual work items:
+    float (*s_min)[N_PARAMS] = (float (*)[N_PARAMS])malloc(N_threads * N_PARAMS * sizeof(float));
+    float (*s_max)[N_PARAMS] = (float (*)[N_PARAMS])malloc(N_threads * N_PARAMS * sizeof(float));
+
+    init_chi2_struct(&sp);
+    init_x2_struct(&s_x2_params, reopt);
+
+    for (int i=0; i<N_PARAMS; i++)
+        params[i] = d_params0[i];
+    params2x(x0, params, sLimits, sProperty, sTypes, &s_x2_params);
+
+    // RMSD value for the input model:
+    CHI_FLOAT f0 = chi2one(params, dData, N_data, N_filters, delta_V, 0, &sp, sTypes);
+    // + one sigma value for RMSD (all good models will have RMSD smaller than this value):
+    CHI_FLOAT f1 = f0 + f0/sqrt((CHI_FLOAT)(N_data - N_PARAMS - N_filters));
+    int iseg = 0;
+    double phi_M0 = P_phi_M;
+    double phi_00 = P_phi_0;
+    #if defined(SPHERICAL_K) && defined(TORQUE)
+    double Is0 = (1.0 + P_b_tumb*P_b_tumb) / (P_b_tumb*P_b_tumb + P_c_tumb*P_c_tumb);
+    double Ii0 = (1.0 + P_c_tumb*P_c_tumb) / (P_b_tumb*P_b_tumb + P_c_tumb*P_c_tumb);
+    double phi0 = atan2(Is0*P_Ts, Ii0*P_Ti);  // phi (azimuthal angle; 0..2*pi) for the input model
+    #endif
+
+    d_f0 = f0;
+    d_f1 = f1;
+
+    #pragma omp parallel for schedule(dynamic) reduction(+:Ntot,Nbad)
+    for (int id=0; id<N_threads; id++)
+    {
+        int i;
+        double params[N_PARAMS];
+        CHI_FLOAT delta_V[N_FILTERS];
+        CHI_FLOAT x1[N_PARAMS];
+        float *par_min = s_min[id];
+        float *par_max = s_max[id];
+        curandState *localState = &globalState[id];
+        for (i=0; i<N_PARAMS; i++)
+        {
+            par_min[i] = 1e30;
+            par_max[i] = -1e30;
+        }
+
+        // In RMSD mode, Nstages mean number of random points generated per work item
+        for (int istage=0; istage<Nstages; istage++)
+        {
+            #define SMALL 1e-8  // Small offset from the hard parameter limits
+            int LAM = 0;
+
+            for (i=0; i<N_PARAMS; i++)
+            {
+                CHI_FLOAT xx = x0[i] + dx_rand * curand_normal(localState);
+                if (xx<SMALL && (sProperty[i][P_periodic]==HARD_BOTH || sProperty[i][P_periodic]==HARD_LEFT || LAM==0 && sProperty[i][P_periodic]==PERIODIC_LAM))
+                    xx = SMALL;
+                else if (xx>1.0-SMALL && (sProperty[i][P_periodic]==HARD_BOTH || sProperty[i][P_periodic]==HARD_RIGHT || LAM==0 && sProperty[i][P_periodic]==PERIODIC_LAM))
+                    xx = 1.0 - SMALL;
+                x1[i] = xx;
+
+                if (sProperty[i][P_type] == T_Es)
+                    LAM = x1[i]>=0.5;
+            }
+            #undef SMALL
+
+            if (x2params(x1, params, sLimits, &s_x2_params, sProperty, sTypes))
+                continue;
+
+            // RMSD value for a randomly shifted model:
+            CHI_FLOAT f = chi2one(params, dData, N_data, N_filters, delta_V, 0, &sp, sTypes);
+
+            Ntot++;
+            if (f < f1)
+            // We found a good model (within one sigma from the input model, in terms of RMSD)
+            {
+                // Converting periodic angles to proper intervals, for confidence interval calculations
+                if (P_phi_M > phi_M0 + PI)
+                    P_phi_M = phi_M0 - 2*PI;
+                if (P_phi_M < phi_M0 - PI)
+                    P_phi_M = phi_M0 + 2*PI;
+                if (P_phi_0 > phi_00 + PI)
+                    P_phi_0 = phi_00 - 2*PI;
+                if (P_phi_0 < phi_00 - PI)
+                    P_phi_0 = phi_00 + 2*PI;
+                #if defined(SPHERICAL_K) && defined(TORQUE)
+                // Torque vector spherical components (storing them back inside the params vector):
+                double Is = (1.0 + P_b_tumb*P_b_tumb) / (P_b_tumb*P_b_tumb + P_c_tumb*P_c_tumb);
+                double Ii = (1.0 + P_c_tumb*P_c_tumb) / (P_b_tumb*P_b_tumb + P_c_tumb*P_c_tumb);
+                double Ki = Ii * P_Ti;
+                double Ks = Is * P_Ts;
+                double Kl = P_Tl;
+                P_Ti = sqrt(Ki*Ki + Ks*Ks + Kl*Kl);  // r
+                P_Ts = acos(Kl/P_Ti);  // theta (polar angle; 0..pi)
+                double phi = atan2(Ks, Ki);
+                if (phi > phi0 + PI)
+                    phi = phi - 2*PI;
+                if (phi < phi0 - PI)
+                    phi = phi + 2*PI;
+                P_Tl = phi;  // phi (azimuthal angle; phi0-pi..phi0+pi)
+                #endif
+
+                for (i=0; i<N_PARAMS; i++)
+                {
+                    if (params[i] < par_min[i])
+                        par_min[i] = params[i];
+                    if (params[i] > par_max[i])
+                        par_max[i] = params[i];
+                }
+            }
+            else
+            {
+                Nbad++;
+            }
+        } // istage loop
+    }  // id loop
+
+    d_Ntot += Ntot;
+    d_Nbad += Nbad;
+
+    // Serial reduction for each block:
+    for (int iblock=0; iblock<N_BLOCKS; iblock++)
+        for (int i=0; i<N_PARAMS; i++)
+        {
+            float fmin =  1e30;
+            float fmax = -1e30;
+            for (int id=iblock*BSIZE; id<(iblock+1)*BSIZE; id++)
+            {
+                if (s_min[id][i] < fmin)
+                    fmin = s_min[id][i];
+                if (s_max[id][i] > fmax)
+                    fmax = s_max[id][i];
+            }
+            dpar_min[iblock*N_PARAMS + i] = fmin;
+            dpar_max[iblock*N_PARAMS + i] = fmax;
+        }
+
+    free(s_min);
+    free(s_max);
+    return;
+}
+#endif //RMSD
+
+#endif // CPU
+
+END_VARIANT
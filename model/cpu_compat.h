@@ -0,0 +1,165 @@
+/*  Host-only (CPU) replacements for the CUDA runtime and cuRAND pieces used by the code.
+ *  Included from asteroid.h instead of cuda.h / curand_kernel.h / cuda_errors.h when CPU macro is defined.
+ *  "Device" memory is ordinary host memory here, so all copies become memcpy's.
+ */
+
+#ifndef _CPU_COMPAT
+#define _CPU_COMPAT
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <stdint.h>
+#ifdef _OPENMP
+  #include <omp.h>
+#endif
+
+#if defined(__x86_64__) && defined(__GLIBC__) && !defined(__FAST_MATH__)
+// Glibc only declares the vector (libmvec) versions of the math functions with -ffast-math. Declaring them here, so
+// the SIMD loops (cpu_simd.c, two-phase chi2one) are vectorized without relaxing the IEEE semantics for the rest of the code.
+extern "C" {
+#pragma omp declare simd notinbranch
+double sin(double);
+#pragma omp declare simd notinbranch
+double cos(double);
+#pragma omp declare simd notinbranch
+double tan(double);
+#pragma omp declare simd notinbranch
+double asin(double);
+#pragma omp declare simd notinbranch
+double acos(double);
+#pragma omp declare simd notinbranch
+double atan2(double, double);
+#pragma omp declare simd notinbranch
+double log(double);
+#pragma omp declare simd notinbranch
+double log10(double);
+}
+#endif
+
+#define __global__
+#define __device__
+#define __host__
+
+typedef int cudaError_t;
+const cudaError_t cudaSuccess = 0;
+const cudaError_t cudaErrorMemoryAllocation = 2;
+
+enum cudaMemcpyKind {cudaMemcpyHostToHost, cudaMemcpyHostToDevice, cudaMemcpyDeviceToHost, cudaMemcpyDeviceToDevice};
+
+#define ERR(ans) { cpuAssert((ans), __FILE__, __LINE__); }
+
+inline void cpuAssert(cudaError_t code, const char *file, int line)
+{
+   if (code != cudaSuccess)
+   {
+      fprintf(stderr,"CPUassert: error %d %s %d\n", code, file, line);
+      exit(code);
+   }
+}
+
+template <class T> inline cudaError_t cudaMalloc(T **p, size_t size)
+{
+    *p = (T *)malloc(size);
+    return *p==NULL && size>0 ? cudaErrorMemoryAllocation : cudaSuccess;
+}
+
+template <class T> inline cudaError_t cudaMallocHost(T **p, size_t size)
+{
+    return cudaMalloc(p, size);
+}
+
+inline cudaError_t cudaMemcpy(void *dst, const void *src, size_t count, enum cudaMemcpyKind kind)
+{
+    memcpy(dst, src, count);
+    return cudaSuccess;
+}
+
+#define cudaMemcpyToSymbol(symbol, src, count, offset, kind) cudaMemcpy((char *)&(symbol)+(offset), (src), (count), (kind))
+#define cudaMemcpyFromSymbol(dst, symbol, count, offset, kind) cudaMemcpy((dst), (char *)&(symbol)+(offset), (count), (kind))
+
+inline cudaError_t cudaDeviceSynchronize()
+{
+    return cudaSuccess;
+}
+
+
+/* Replacement for curandState: xoshiro256** generator (one independent stream per simplex "thread"),
+ * seeded with splitmix64 from (seed, subsequence), like curand_init.
+ */
+struct curandState {
+    uint64_t s[4];
+    int has_normal;  // Box-Muller produces pairs; the second value is cached here
+    float normal;
+};
+
+inline uint64_t splitmix64(uint64_t *x)
+{
+    uint64_t z = (*x += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+inline void curand_init(unsigned long long seed, unsigned long long subsequence, unsigned long long offset, curandState *state)
+{
+    uint64_t x = seed ^ (subsequence * 0xd1342543de82ef95ULL);
+    for (int i=0; i<4; i++)
+        state->s[i] = splitmix64(&x);
+    state->has_normal = 0;
+    state->normal = 0.0f;
+}
+
+inline uint64_t xoshiro256(curandState *state)
+{
+    uint64_t *s = state->s;
+    uint64_t x = s[1] * 5;
+    uint64_t result = ((x << 7) | (x >> 57)) * 9;
+    uint64_t t = s[1] << 17;
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = (s[3] << 45) | (s[3] >> 19);
+    return result;
+}
+
+// Uniform float in (0,1] interval (same convention as curand_uniform):
+inline float curand_uniform(curandState *state)
+{
+    return ((xoshiro256(state) >> 40) + 1) * (1.0f / 16777216.0f);
+}
+
+// Standard normal float (Box-Muller, as in curand_normal):
+inline float curand_normal(curandState *state)
+{
+    if (state->has_normal)
+    {
+        state->has_normal = 0;
+        return state->normal;
+    }
+    double u1 = ((xoshiro256(state) >> 11) + 1) * (1.0 / 9007199254740992.0);
+    double u2 = (xoshiro256(state) >> 11) * (1.0 / 9007199254740992.0);
+    double r = sqrt(-2.0*log(u1));
+    state->normal = r * sin(2.0*M_PI*u2);
+    state->has_normal = 1;
+    return r * cos(2.0*M_PI*u2);
+}
+
+
+#ifdef MAIN
+inline void Is_GPU_present()
+{
+  #ifdef _OPENMP
+  printf ("CPU backend, %d OpenMP threads\n\n", omp_get_max_threads());
+  #else
+  printf ("CPU backend, single thread (compiled without OpenMP)\n\n");
+  #endif
+  return;
+}
+#endif
+
+#endif
@@ -0,0 +1,293 @@
+/* Lockstep (SIMD) version of chi2one for the CPU build.
+ *
+ * chi2_batch evaluates K_BATCH parameter vectors at once. The time integration grid depends only on the data (N_steps is the same
+ * for all models), so the RK4 loop, the Euler angles rotation and the brightness calculation can be done for all the models
+ * in lockstep, with the models in SIMD lanes (structure of arrays: params[N_PARAMS][K_BATCH]).
+ *
+ * Only used when BATCH is defined in asteroid.h (the simpler model variants); otherwise the CPU build uses chi2one.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include "asteroid.h"
+
+#if defined(CPU) && defined(BATCH)
+
+BEGIN_VARIANT
+
+// Parameter of the given type, for lane k:
+#define PB(type) params[dTypes[type][0]][k]
+
+
+void chi2_batch(double params[][K_BATCH], struct obs_data *dData, int N_data, int N_filters, CHI_FLOAT *chi2, CHI_FLOAT delta_V[][K_BATCH],
+                struct chi2_struct *sp)
+// Computing chi^2 (and optionally delta_V, if not NULL) for K_BATCH models at once. Same physics as chi2one (Nplot=0 case).
+{
+    int i, k, m;
+    double sum_y2[N_FILTERS][K_BATCH];
+    double sum_y[N_FILTERS][K_BATCH];
+    double sum_w[N_FILTERS][K_BATCH];
+
+    // Time independent quantities, per lane:
+    double M_x[K_BATCH], M_y[K_BATCH], M_z[K_BATCH];
+    double XM_x[K_BATCH], XM_z[K_BATCH], YM_x[K_BATCH], YM_y[K_BATCH], YM_z[K_BATCH];
+    double b[K_BATCH], c[K_BATCH];
+    #ifdef TORQUE
+    const int N_ODE = 6;
+    double mu[6][K_BATCH];
+    #else
+    const int N_ODE = 3;
+    double mu[3][K_BATCH];
+    #endif
+    // ODE variables (for TORQUE: Omega_i, Omega_s, Omega_l, phi, theta, psi; otherwise phi, theta, psi):
+    double y[N_ODE][K_BATCH];
+
+    for (m=0; m<N_filters; m++)
+        for (k=0; k<K_BATCH; k++)
+        {
+            sum_y2[m][k] = 0.0;
+            sum_y[m][k] = 0.0;
+            sum_w[m][k] = 0.0;
+        }
+
+    #pragma omp simd
+    for (k=0; k<K_BATCH; k++)
+    {
+        M_x[k] = sin(PB(T_theta_M)) * cos(PB(T_phi_M));
+        M_y[k] = sin(PB(T_theta_M)) * sin(PB(T_phi_M));
+        M_z[k] = cos(PB(T_theta_M));
+        double XM = sqrt(M_z[k]*M_z[k]+M_x[k]*M_x[k]);
+        XM_x[k] = M_z[k] / XM;
+        XM_z[k] = -M_x[k] / XM;
+        YM_x[k] = M_y[k]*XM_z[k];
+        YM_y[k] = M_z[k]*XM_x[k] - M_x[k]*XM_z[k];
+        YM_z[k] = -M_y[k]*XM_x[k];
+
+        double b_tumb = PB(T_b_tumb);
+        double c_tumb = PB(T_c_tumb);
+        double Is = (1.0 + b_tumb*b_tumb) / (b_tumb*b_tumb + c_tumb*c_tumb);
+        double Ii = (1.0 + c_tumb*c_tumb) / (b_tumb*b_tumb + c_tumb*c_tumb);
+        double Is_inv = 1.0 / Is;
+        double Ii_inv = 1.0 / Ii;
+
+        double phi = PB(T_phi_0);
+        double psi = PB(T_psi_0);
+        double theta = asin(sqrt((PB(T_Es)-1.0)/(sin(psi)*sin(psi)*(Ii_inv-Is_inv)+Is_inv-1.0)));
+
+        #ifdef TORQUE
+        mu[0][k] = (Is-1.0)*Ii_inv;
+        mu[1][k] = (1.0-Ii)*Is_inv;
+        mu[2][k] = Ii - Is;
+        mu[3][k] = PB(T_Ti);
+        mu[4][k] = PB(T_Ts);
+        mu[5][k] = PB(T_Tl);
+        y[0][k] = PB(T_L) * Ii_inv * sin(theta) * sin(psi);
+        y[1][k] = PB(T_L) * Is_inv * sin(theta) * cos(psi);
+        y[2][k] = PB(T_L) * cos(theta);
+        y[3][k] = phi;
+        y[4][k] = theta;
+        y[5][k] = psi;
+        #else
+        mu[0][k] = PB(T_L);
+        mu[1][k] = 0.5*(Ii_inv + Is_inv);
+        mu[2][k] = 0.5*(Ii_inv - Is_inv);
+        y[0][k] = phi;
+        y[1][k] = theta;
+        y[2][k] = psi;
+        #endif
+
+        #ifdef BC
+        b[k] = PB(T_b);
+        c[k] = PB(T_c);
+        #else
+        b[k] = b_tumb;
+        c[k] = c_tumb;
+        #endif
+    }
+
+    for (i=0; i<N_data; i++)
+    {
+        if (i > 0)
+        {
+            // Same time steps as in chi2one (the precomputed integration schedule):
+            int N_steps = dData->N_steps[i];
+            double h = dData->h[i];
+
+            // RK4; the step loop is inside the lane loop, as the number of steps is the same for all lanes
+            #pragma omp simd
+            for (k=0; k<K_BATCH; k++)
+            {
+                double yk[N_ODE], K1[N_ODE], K2[N_ODE], K3[N_ODE], K4[N_ODE], f[N_ODE];
+                for (int j=0; j<N_ODE; j++)
+                    yk[j] = y[j][k];
+
+                for (int l=0; l<N_steps; l++)
+                {
+                    #ifdef TORQUE
+                    // ODE_func with TORQUE, inlined:
+                    #define ODE(Y, F) \
+                        F[0] = mu[0][k]*Y[1]*Y[2] + mu[3][k]; \
+                        F[1] = mu[1][k]*Y[2]*Y[0] + mu[4][k]; \
+                        F[2] = mu[2][k]*Y[0]*Y[1] + mu[5][k]; \
+                        { double s5 = sin(Y[5]), c5 = cos(Y[5]); \
+                          F[3] = (Y[0]*s5 + Y[1]*c5) / sin(Y[4]); \
+                          F[4] = Y[0]*c5 - Y[1]*s5; \
+                          F[5] = Y[2] - F[3]*cos(Y[4]); }
+                    #else
+                    // ODE_func without TORQUE, inlined:
+                    #define ODE(Y, F) \
+                        F[0] = mu[0][k]*(mu[1][k]-mu[2][k]*cos(2.0*Y[2])); \
+                        F[1] = mu[0][k]*mu[2][k]*sin(Y[1])*sin(2.0*Y[2]); \
+                        F[2] = cos(Y[1])*(mu[0][k]-F[0]);
+                    #endif
+
+                    ODE(yk, K1);
+                    for (int j=0; j<N_ODE; j++)
+                        f[j] = yk[j] + 0.5*h*K1[j];
+                    ODE(f, K2);
+                    for (int j=0; j<N_ODE; j++)
+                        f[j] = yk[j] + 0.5*h*K2[j];
+                    ODE(f, K3);
+                    for (int j=0; j<N_ODE; j++)
+                        f[j] = yk[j] + h*K3[j];
+                    ODE(f, K4);
+                    for (int j=0; j<N_ODE; j++)
+                        yk[j] = yk[j] + 1/6.0 * h *(K1[j] + 2*K2[j] + 2*K3[j] + K4[j]);
+                    #undef ODE
+                }
+
+                for (int j=0; j<N_ODE; j++)
+                    y[j][k] = yk[j];
+            }
+        }
+
+        // Earth and Sun unit vectors are the same for all lanes:
+        #ifdef INTERP
+        double rr[3];
+        double MJD = dData->MJD[i];
+        rr[0] = (MJD-sp->MJD0[1]) * (MJD-sp->MJD0[2]) / (sp->MJD0[0]-sp->MJD0[1]) / (sp->MJD0[0]-sp->MJD0[2]);
+        rr[1] = (MJD-sp->MJD0[0]) * (MJD-sp->MJD0[2]) / (sp->MJD0[1]-sp->MJD0[0]) / (sp->MJD0[1]-sp->MJD0[2]);
+        rr[2] = (MJD-sp->MJD0[0]) * (MJD-sp->MJD0[1]) / (sp->MJD0[2]-sp->MJD0[0]) / (sp->MJD0[2]-sp->MJD0[1]);
+        double E_x1 = sp->E_x0[0]*rr[0] + sp->E_x0[1]*rr[1] + sp->E_x0[2]*rr[2];
+        double E_y1 = sp->E_y0[0]*rr[0] + sp->E_y0[1]*rr[1] + sp->E_y0[2]*rr[2];
+        double E_z1 = sp->E_z0[0]*rr[0] + sp->E_z0[1]*rr[1] + sp->E_z0[2]*rr[2];
+        double S_x1 = sp->S_x0[0]*rr[0] + sp->S_x0[1]*rr[1] + sp->S_x0[2]*rr[2];
+        double S_y1 = sp->S_y0[0]*rr[0] + sp->S_y0[1]*rr[1] + sp->S_y0[2]*rr[2];
+        double S_z1 = sp->S_z0[0]*rr[0] + sp->S_z0[1]*rr[1] + sp->S_z0[2]*rr[2];
+        double E = sqrt(E_x1*E_x1 + E_y1*E_y1 + E_z1*E_z1);
+        E_x1= E_x1 / E;
+        E_y1= E_y1 / E;
+        E_z1= E_z1 / E;
+        double S = sqrt(S_x1*S_x1 + S_y1*S_y1 + S_z1*S_z1);
+        S_x1= S_x1 / S;
+        S_y1= S_y1 / S;
+        S_z1= S_z1 / S;
+        #else
+        double E_x1 = dData->E_x[i];
+        double E_y1 = dData->E_y[i];
+        double E_z1 = dData->E_z[i];
+        double S_x1 = dData->S_x[i];
+        double S_y1 = dData->S_y[i];
+        double S_z1 = dData->S_z[i];
+        #endif
+        int mf = dData->Filter[i];
+        double V = dData->V[i];
+        double w = dData->w[i];
+
+        #pragma omp simd
+        for (k=0; k<K_BATCH; k++)
+        {
+            #ifdef TORQUE
+            double phi = y[3][k], theta = y[4][k], psi = y[5][k];
+            #else
+            double phi = y[0][k], theta = y[1][k], psi = y[2][k];
+            #endif
+
+            // Body axes in the inertial frame (see chi2one for the details):
+            double cos_phi = cos(phi);
+            double sin_phi = sin(phi);
+            double N_x = XM_x[k]*cos_phi + YM_x[k]*sin_phi;
+            double N_y =                   YM_y[k]*sin_phi;
+            double N_z = XM_z[k]*cos_phi + YM_z[k]*sin_phi;
+            double p_x = N_y*M_z[k] - N_z*M_y[k];
+            double p_y = N_z*M_x[k] - N_x*M_z[k];
+            double p_z = N_x*M_y[k] - N_y*M_x[k];
+            double cos_theta = cos(theta);
+            double sin_theta = sin(theta);
+            double a_x = M_x[k]*cos_theta + p_x*sin_theta;
+            double a_y = M_y[k]*cos_theta + p_y*sin_theta;
+            double a_z = M_z[k]*cos_theta + p_z*sin_theta;
+            double w_x = a_y*N_z - a_z*N_y;
+            double w_y = a_z*N_x - a_x*N_z;
+            double w_z = a_x*N_y - a_y*N_x;
+            double sin_psi = sin(psi);
+            double cos_psi = cos(psi);
+            double b_x = N_x*cos_psi + w_x*sin_psi;
+            double b_y = N_y*cos_psi + w_y*sin_psi;
+            double b_z = N_z*cos_psi + w_z*sin_psi;
+            double c_x = a_y*b_z - a_z*b_y;
+            double c_y = a_z*b_x - a_x*b_z;
+            double c_z = a_x*b_y - a_y*b_x;
+
+            double Ep_b = b_x*E_x1 + b_y*E_y1 + b_z*E_z1;
+            double Ep_c = c_x*E_x1 + c_y*E_y1 + c_z*E_z1;
+            double Ep_a = a_x*E_x1 + a_y*E_y1 + a_z*E_z1;
+            double Sp_b = b_x*S_x1 + b_y*S_y1 + b_z*S_z1;
+            double Sp_c = c_x*S_x1 + c_y*S_y1 + c_z*S_z1;
+            double Sp_a = a_x*S_x1 + a_y*S_y1 + a_z*S_z1;
+
+            // Triaxial ellipsoid brightness (Muinonen & Lumme, 2015):
+            double b2 = b[k]*b[k];
+            double c2 = c[k]*c[k];
+            double scalar_Sun   = sqrt(Sp_b*Sp_b/b2 + Sp_c*Sp_c/c2 + Sp_a*Sp_a);
+            double scalar_Earth = sqrt(Ep_b*Ep_b/b2 + Ep_c*Ep_c/c2 + Ep_a*Ep_a);
+            double cos_alpha_p = (Sp_b*Ep_b/b2 + Sp_c*Ep_c/c2 + Sp_a*Ep_a) / (scalar_Sun * scalar_Earth);
+            double sin_alpha_p = sqrt(1.0 - cos_alpha_p*cos_alpha_p);
+            double alpha_p = atan2(sin_alpha_p, cos_alpha_p);
+            double scalar = sqrt(scalar_Sun*scalar_Sun + scalar_Earth*scalar_Earth + 2*scalar_Sun*scalar_Earth*cos_alpha_p);
+            double cos_lambda_p = (scalar_Sun + scalar_Earth*cos_alpha_p) / scalar;
+            double sin_lambda_p = scalar_Earth*sin_alpha_p / scalar;
+            double lambda_p = atan2(sin_lambda_p, cos_lambda_p);
+            double Vmod = -2.5*log10(b[k]*c[k] * scalar_Sun*scalar_Earth/scalar * (cos(lambda_p-alpha_p) + cos_lambda_p +
+                          sin_lambda_p*sin(lambda_p-alpha_p) * log(1.0 / tan(0.5*lambda_p) / tan(0.5*(alpha_p-lambda_p)))));
+
+            #ifdef TREND
+            double alpha = acos(Sp_b*Ep_b + Sp_c*Ep_c + Sp_a*Ep_a);
+            Vmod = Vmod - PB(T_A)*alpha;
+            #endif
+
+            double dV = V - Vmod;
+            sum_y2[mf][k] = sum_y2[mf][k] + dV*dV*w;
+            sum_y[mf][k] = sum_y[mf][k] + dV*w;
+            sum_w[mf][k] = sum_w[mf][k] + w;
+        }
+    }
+
+    // Computing chi^2
+    for (k=0; k<K_BATCH; k++)
+    {
+        CHI_FLOAT chi2a = 0.0;
+        #ifdef RMSD
+        CHI_FLOAT SUM_w = 0.0;
+        #endif
+        for (m=0; m<N_filters; m++)
+        {
+            chi2a = chi2a + (CHI_FLOAT)(sum_y2[m][k] - sum_y[m][k]*sum_y[m][k]/sum_w[m][k]);
+            if (delta_V != NULL)
+                delta_V[m][k] = sum_y[m][k] / sum_w[m][k];
+            #ifdef RMSD
+            SUM_w = SUM_w + sum_w[m][k];
+            #endif
+        }
+        #ifdef RMSD
+        chi2[k] = sqrt(chi2a / SUM_w);
+        #else
+        chi2[k] = chi2a / (N_data - N_PARAMS - N_filters);
+        #endif
+    }
+
+    return;
+}
+
+END_VARIANT
+
+#endif // CPU && BATCH
@@ -5,9 +5,56 @@
  */
 #include <stdio.h>
 #include <stdlib.h>
+#ifndef CPU
 #include <curand_kernel.h>
+#endif
 #include "asteroid.h"
 
+BEGIN_VARIANT
+
+
+#ifdef DP45
+// Dormand-Prince 5(4) coefficients (Dormand & Prince 1980). The 5th order solution is used to advance, and the difference
+// with the embedded 4th order solution (coefficients E*) is the local error estimate.
+const double A21 = 1.0/5.0;
+const double A31 = 3.0/40.0,        A32 = 9.0/40.0;
+const double A41 = 44.0/45.0,       A42 = -56.0/15.0,      A43 = 32.0/9.0;
+const double A51 = 19372.0/6561.0,  A52 = -25360.0/2187.0, A53 = 64448.0/6561.0,  A54 = -212.0/729.0;
+const double A61 = 9017.0/3168.0,   A62 = -355.0/33.0,     A63 = 46732.0/5247.0,  A64 = 49.0/176.0,    A65 = -5103.0/18656.0;
+const double B1  = 35.0/384.0,      B3  = 500.0/1113.0,    B4  = 125.0/192.0,     B5  = -2187.0/6784.0, B6  = 11.0/84.0;
+const double E1  = 71.0/57600.0,    E3  = -71.0/16695.0,   E4  = 71.0/1920.0,     E5  = -17253.0/339200.0, E6 = 22.0/525.0, E7 = -1.0/40.0;
+#endif
+
+
+__host__ __device__ size_t obs_size(int N)
+// Size of the obs_data memory block for N data points, bytes
+{
+    return (size_t)N * OBS_POINT_SIZE;
+}
+
+
+__host__ __device__ void obs_carve(struct obs_data *data, void *buf, int N)
+/* Setting the obs_data array pointers for N data points stored in the memory block buf (8-byte aligned), in the order
+   of decreasing element size, so all the arrays are aligned for any N.
+ */
+{
+    char *p = (char *)buf;
+    data->buf = buf;
+    data->MJD = (OBS_TYPE *)p;      p += N*sizeof(OBS_TYPE);
+    data->h = (OBS_TYPE *)p;        p += N*sizeof(OBS_TYPE);
+    #ifndef INTERP
+    data->E_x = (GEOM_TYPE *)p;     p += N*sizeof(GEOM_TYPE);
+    data->E_y = (GEOM_TYPE *)p;     p += N*sizeof(GEOM_TYPE);
+    data->E_z = (GEOM_TYPE *)p;     p += N*sizeof(GEOM_TYPE);
+    data->S_x = (GEOM_TYPE *)p;     p += N*sizeof(GEOM_TYPE);
+    data->S_y = (GEOM_TYPE *)p;     p += N*sizeof(GEOM_TYPE);
+    data->S_z = (GEOM_TYPE *)p;     p += N*sizeof(GEOM_TYPE);
+    #endif
+    data->V = (float *)p;           p += N*sizeof(float);
+    data->w = (float *)p;           p += N*sizeof(float);
+    data->Filter = (int *)p;        p += N*sizeof(int);
+    data->N_steps = (int *)p;
+}
 
 
 __device__ void ODE_func (double y[], double f[], double mu[])
@@ -78,6 +125,316 @@ __device__ void ODE_func (double y[], double f[], double mu[])
 
 
 
+#ifdef ANALYTIC
+/* Closed form solution for the torque-free tumbling (replaces the ODE integration in chi2one when ANALYTIC is defined).
+ *
+ * The angular momentum components in the body frame are Jacobi elliptic functions of tau = rate*t + tau0 (Landau & Lifshitz,
+ * Mechanics, 37). "r" is the axis the body rotates around (s for SAM, l for LAM), "p" is the other extremal axis, and
+ * the intermediate axis i is "q":
+ *     Omega_p = a*cn(tau),  Omega_q = s_r*b*sn(tau),  Omega_r = s_r*c*dn(tau)
+ * Here s_r is the (constant) sign of Omega_r.
+ * theta and psi follow from the components directly, and phi from the integral of dphi/dt = L*(Es-cos^2(theta))/(1-cos^2(theta)),
+ * which is an incomplete elliptic integral of the third kind, Pi(n; am(tau) | m). All the elliptic integrals are computed
+ * with Carlson's symmetric forms (Carlson 1995).
+ */
+
+__device__ double carlson_RF(double x, double y, double z)
+// Carlson's elliptic integral of the first kind (at most one of x,y,z can be zero)
+{
+    const double ERRTOL = 0.0025;
+    double xt=x, yt=y, zt=z, ave, delx, dely, delz;
+    do
+    {
+        double sqrtx = sqrt(xt);
+        double sqrty = sqrt(yt);
+        double sqrtz = sqrt(zt);
+        double alamb = sqrtx*(sqrty+sqrtz) + sqrty*sqrtz;
+        xt = 0.25*(xt+alamb);
+        yt = 0.25*(yt+alamb);
+        zt = 0.25*(zt+alamb);
+        ave = (xt+yt+zt) / 3.0;
+        delx = (ave-xt) / ave;
+        dely = (ave-yt) / ave;
+        delz = (ave-zt) / ave;
+    }
+    while (fmax(fmax(fabs(delx), fabs(dely)), fabs(delz)) > ERRTOL);
+    double e2 = delx*dely - delz*delz;
+    double e3 = delx*dely*delz;
+    return (1.0 + (e2/24.0 - 0.1 - 3.0*e3/44.0)*e2 + e3/14.0) / sqrt(ave);
+}
+
+
+__device__ double carlson_RC(double x, double y)
+// Carlson's degenerate elliptic integral RC(x,y)=RF(x,y,y), for y>0
+{
+    const double ERRTOL = 0.0012;
+    double xt=x, yt=y, ave, s;
+    do
+    {
+        double alamb = 2.0*sqrt(xt)*sqrt(yt) + yt;
+        xt = 0.25*(xt+alamb);
+        yt = 0.25*(yt+alamb);
+        ave = (xt+yt+yt) / 3.0;
+        s = (yt-ave) / ave;
+    }
+    while (fabs(s) > ERRTOL);
+    return (1.0 + s*s*(0.3 + s*(1.0/7.0 + s*(0.375 + s*9.0/22.0)))) / sqrt(ave);
+}
+
+
+__device__ double carlson_RJ(double x, double y, double z, double p)
+// Carlson's elliptic integral of the third kind (p>0)
+{
+    const double ERRTOL = 0.0015;
+    const double C1=3.0/14.0, C2=1.0/3.0, C3=3.0/22.0, C4=3.0/26.0, C5=0.75*C3, C6=1.5*C4, C7=0.5*C2, C8=C3+C3;
+    double xt=x, yt=y, zt=z, pt=p, ave, delx, dely, delz, delp;
+    double sum = 0.0;
+    double fac = 1.0;
+    do
+    {
+        double sqrtx = sqrt(xt);
+        double sqrty = sqrt(yt);
+        double sqrtz = sqrt(zt);
+        double alamb = sqrtx*(sqrty+sqrtz) + sqrty*sqrtz;
+        double alpha = pt*(sqrtx+sqrty+sqrtz) + sqrtx*sqrty*sqrtz;
+        double beta = pt*(pt+alamb)*(pt+alamb);
+        sum = sum + fac*carlson_RC(alpha*alpha, beta);
+        fac = 0.25*fac;
+        xt = 0.25*(xt+alamb);
+        yt = 0.25*(yt+alamb);
+        zt = 0.25*(zt+alamb);
+        pt = 0.25*(pt+alamb);
+        ave = 0.2*(xt+yt+zt+pt+pt);
+        delx = (ave-xt) / ave;
+        dely = (ave-yt) / ave;
+        delz = (ave-zt) / ave;
+        delp = (ave-pt) / ave;
+    }
+    while (fmax(fmax(fabs(delx), fabs(dely)), fmax(fabs(delz), fabs(delp))) > ERRTOL);
+    double ea = delx*(dely+delz) + dely*delz;
+    double eb = delx*dely*delz;
+    double ec = delp*delp;
+    double ed = ea - 3.0*ec;
+    double ee = eb + 2.0*delp*(ea-ec);
+    return 3.0*sum + fac*(1.0 + ed*(-C1+C5*ed-C6*ee) + eb*(C7+delp*(-C8+delp*C4)) + delp*ea*(C2-delp*C3) - C2*delp*ec) / (ave*sqrt(ave));
+}
+
+
+__device__ void jacobi_sncndn(double u, double m, double *sn, double *cn, double *dn)
+// Jacobi elliptic functions sn, cn, dn for the parameter m=k^2 (0<=m<1), using the descending Landen (AGM) transformation
+{
+    const double CA = 1e-8;  // ~sqrt of the double precision
+    double em[14], en[14];
+    double a = 1.0;
+    double emc = 1.0 - m;
+    double c = 1.0;
+    int l = 0;
+    *dn = 1.0;
+    for (int i=0; i<13; i++)
+    {
+        l = i;
+        em[i] = a;
+        emc = sqrt(emc);
+        en[i] = emc;
+        c = 0.5*(a+emc);
+        if (fabs(a-emc) <= CA*a)
+            break;
+        emc = emc * a;
+        a = c;
+    }
+    u = u * c;
+    *sn = sin(u);
+    *cn = cos(u);
+    if (*sn != 0.0)
+    {
+        a = *cn / *sn;
+        c = c * a;
+        for (int ii=l; ii>=0; ii--)
+        {
+            double b = em[ii];
+            a = a * c;
+            c = c * (*dn);
+            *dn = (en[ii]+a) / (b+a);
+            a = c / b;
+        }
+        a = 1.0 / sqrt(c*c+1.0);
+        *sn = (*sn >= 0.0 ? a : -a);
+        *cn = c * (*sn);
+    }
+    return;
+}
+
+
+__device__ double ellint_Pi(double n, double phi, double m)
+// Incomplete elliptic integral of the third kind Pi(n; phi | m), for -pi/2<=phi<=pi/2 and n<1 (n=0: first kind, F(phi|m))
+{
+    double s = sin(phi);
+    double c = cos(phi);
+    double q = 1.0 - m*s*s;
+    double F = s * carlson_RF(c*c, q, 1.0);
+    if (n == 0.0)
+        return F;
+    return F + n/3.0*s*s*s * carlson_RJ(c*c, q, 1.0, 1.0-n*s*s);
+}
+
+
+__device__ void free_rotation_init(struct free_rotation *fr, double L, double Ii, double Is, double Es, double phi0, double theta0, double psi0)
+// Computing the time independent constants of the closed form solution, for the initial Euler angles phi0, theta0, psi0 (at t=0)
+{
+    double Ip, Iq, Ir;
+    fr->LAM = Es > 1.0/Ii;
+    // Moments of inertia (Il=1) for the p, q, r axes:
+    Iq = Ii;
+    if (fr->LAM)
+    {
+        Ip = Is;  Ir = 1.0;
+    }
+    else
+    {
+        Ip = 1.0;  Ir = Is;
+    }
+    fr->L = L;
+    fr->Ii = Ii;
+    fr->Is = Is;
+    fr->phi0 = phi0;
+    fr->a = L * sqrt((Es*Ir-1.0) / (Ip*(Ir-Ip)));
+    fr->b = L * sqrt((Es*Ir-1.0) / (Iq*(Ir-Iq)));
+    fr->c = L * sqrt((1.0-Es*Ip) / (Ir*(Ir-Ip)));
+    fr->rate = L * sqrt((Ir-Iq)*(1.0-Es*Ip) / (Ip*Iq*Ir));
+    fr->m = (Iq-Ip)*(Es*Ir-1.0) / ((Ir-Iq)*(1.0-Es*Ip));
+
+    // Initial angular velocity components:
+    double Omega_i = L / Ii * sin(theta0) * sin(psi0);
+    double Omega_s = L / Is * sin(theta0) * cos(psi0);
+    double Omega_l = L * cos(theta0);
+    double Omega_p, Omega_r;
+    if (fr->LAM)
+    {
+        Omega_p = Omega_s;  Omega_r = Omega_l;
+    }
+    else
+    {
+        Omega_p = Omega_l;  Omega_r = Omega_s;
+    }
+    fr->sr = Omega_r >= 0.0 ? 1.0 : -1.0;
+
+    // 1-cos^2(theta) = A + B*sn^2(tau):
+    double A, B;
+    if (fr->LAM)
+    {
+        double g2 = fr->c*fr->c / (L*L);
+        A = 1.0 - g2;
+        B = g2 * fr->m;
+    }
+    else
+    {
+        double a2 = fr->a*fr->a / (L*L);
+        A = 1.0 - a2;
+        B = a2;
+    }
+    fr->n = -B / A;
+    fr->phi_coef = L * (1.0-Es) / (A*fr->rate);
+
+    // Complete integrals:
+    fr->K = carlson_RF(0.0, 1.0-fr->m, 1.0);
+    fr->Pi = fr->K + fr->n/3.0 * carlson_RJ(0.0, 1.0-fr->m, 1.0, 1.0-fr->n);
+
+    // Initial amplitude am(tau0), in -pi...pi, reduced to -pi/2...pi/2 (j=-1,0,1 half-periods):
+    double am0 = atan2(fr->sr*Omega_i/fr->b, Omega_p/fr->a);
+    double j = floor((am0 + 0.5*PI) / PI);
+    am0 = am0 - j*PI;
+    fr->tau0 = 2.0*j*fr->K + ellint_Pi(0.0, am0, fr->m);
+    fr->Pi0 = 2.0*j*fr->Pi + ellint_Pi(fr->n, am0, fr->m);
+    return;
+}
+
+
+__device__ void free_rotation_angles(struct free_rotation *fr, double t, double *phi, double *theta, double *psi)
+// Euler angles at time t (relative to the initial time)
+{
+    double tau = fr->tau0 + fr->rate * t;
+    // Reducing tau to the -K...K interval (j is the number of half-periods 2K):
+    double j = floor((tau + fr->K) / (2.0*fr->K));
+    double tau_r = tau - 2.0*j*fr->K;
+    double sn, cn, dn;
+    jacobi_sncndn(tau_r, fr->m, &sn, &cn, &dn);
+    double am = atan2(sn, cn);
+    if (fmod(j, 2.0) != 0.0)
+    {
+        sn = -sn;
+        cn = -cn;
+    }
+    double Omega_p = fr->a * cn;
+    double Omega_i = fr->sr * fr->b * sn;
+    double Omega_r = fr->sr * fr->c * dn;
+    double Omega_s, Omega_l;
+    if (fr->LAM)
+    {
+        Omega_s = Omega_p;  Omega_l = Omega_r;
+    }
+    else
+    {
+        Omega_s = Omega_r;  Omega_l = Omega_p;
+    }
+    double u = Omega_l / fr->L;
+    if (u > 1.0)
+        u = 1.0;
+    if (u < -1.0)
+        u = -1.0;
+    *theta = acos(u);
+    *psi = atan2(fr->Ii*Omega_i, fr->Is*Omega_s);
+    *phi = fr->phi0 + fr->L*t - fr->phi_coef * (2.0*j*fr->Pi + ellint_Pi(fr->n, am, fr->m) - fr->Pi0);
+    return;
+}
+#endif // ANALYTIC
+
+
+#if defined(DENSE_PLOT) && !defined(ANALYTIC)
+__device__ void plot_step(struct plot_node *a, struct plot_node *b, double *mu)
+// One RK4 step (PLOT_TIME_STEP) of the dense output integration of the plot curve: the step [a, b] moves to [b, b+PLOT_TIME_STEP]
+{
+    #ifdef TORQUE
+    const int N_ODE = 6;
+    #else
+    const int N_ODE = 3;
+    #endif
+    double f[N_ODE], K2[N_ODE], K3[N_ODE], K4[N_ODE];
+    double h = PLOT_TIME_STEP;
+    int j;
+    *a = *b;
+    for (j=0; j<N_ODE; j++)
+        f[j] = a->y[j] + 0.5*h*a->f[j];
+    ODE_func (f, K2, mu);
+    for (j=0; j<N_ODE; j++)
+        f[j] = a->y[j] + 0.5*h*K2[j];
+    ODE_func (f, K3, mu);
+    for (j=0; j<N_ODE; j++)
+        f[j] = a->y[j] + h*K3[j];
+    ODE_func (f, K4, mu);
+    for (j=0; j<N_ODE; j++)
+        b->y[j] = a->y[j] + 1/6.0 * h *(a->f[j] + 2*K2[j] + 2*K3[j] + K4[j]);
+    ODE_func (b->y, b->f, mu);
+    b->t = a->t + h;
+    return;
+}
+
+
+__device__ void plot_next(struct plot_node *a, struct plot_node *b, struct chi2_struct *sp, int *k_node, double *mu)
+// The next step of the dense output integration: from the nodes stored by the seeding call if there are, otherwise a new RK4 step
+{
+    if (sp->plot_nodes != NULL)
+    {
+        *a = *b;
+        *k_node = *k_node + 1;
+        *b = sp->plot_nodes[*k_node];
+    }
+    else
+        plot_step(a, b, mu);
+    return;
+}
+#endif
+
+
 __device__ CHI_FLOAT chi2one(double *params, struct obs_data *sData, int N_data, int N_filters, CHI_FLOAT *delta_V, int Nplot, struct chi2_struct *sp,
 #ifdef ANIMATE
                              unsigned char * d_rgb,
@@ -92,6 +449,9 @@ __device__ CHI_FLOAT chi2one(double *params, struct obs_data *sData, int N_data,
     double sum_y2[N_FILTERS];
     double sum_y[N_FILTERS];
     double sum_w[N_FILTERS];
+    // Number of ODE steps and ODE_func calls (reported in d_ode_steps, d_ode_evals when Nplot<0):
+    int n_steps = 0;
+    int n_evals = 0;
     
     
     for (m=0; m<N_filters; m++)
@@ -162,31 +522,6 @@ __device__ CHI_FLOAT chi2one(double *params, struct obs_data *sData, int N_data,
     // (Will use one segment, for all the data, when SEGMENT is not defined)
     for (int iseg=0; iseg<N_SEG; iseg++)
     {
-        // Defining these for better readability:
-        #define P_theta_M  params[sTypes[T_theta_M][iseg]]
-        #define P_phi_M    params[sTypes[T_phi_M][iseg]]
-        #define P_phi_0    params[sTypes[T_phi_0][iseg]]
-        #define P_L        params[sTypes[T_L][iseg]]
-        #define P_A        params[sTypes[T_A][iseg]]
-        #define P_Ti       params[sTypes[T_Ti][iseg]]
-        #define P_Ts       params[sTypes[T_Ts][iseg]]
-        #define P_Tl       params[sTypes[T_Tl][iseg]]
-        #define P_T2i      params[sTypes[T_T2i][iseg]]
-        #define P_T2s      params[sTypes[T_T2s][iseg]]
-        #define P_T2l      params[sTypes[T_T2l][iseg]]
-        #define P_Tt       params[sTypes[T_Tt][iseg]]
-        #define P_c_tumb   params[sTypes[T_c_tumb][iseg]]
-        #define P_b_tumb   params[sTypes[T_b_tumb][iseg]]
-        #define P_Es       params[sTypes[T_Es][iseg]]
-        #define P_psi_0    params[sTypes[T_psi_0][iseg]]
-        #define P_c        params[sTypes[T_c][iseg]]
-        #define P_b        params[sTypes[T_b][iseg]]
-        #define P_theta_R  params[sTypes[T_theta_R][iseg]]
-        #define P_phi_R    params[sTypes[T_phi_R][iseg]]
-        #define P_psi_R    params[sTypes[T_psi_R][iseg]]
-        #define P_kappa    params[sTypes[T_kappa][iseg]]
-        
-        
         // Calculations which are time independent:            
         
         // In tumbling mode, the vector M is the angular momentum vector (fixed in the inertial - barycentric - frame of reference)
@@ -251,11 +586,25 @@ __device__ CHI_FLOAT chi2one(double *params, struct obs_data *sData, int N_data,
         mu[2] = Im;    
         #endif
         
+        #ifdef ANALYTIC
+        // Closed form solution for the Euler angles, with the initial conditions at the segment start (sData->MJD[i1]):
+        struct free_rotation fr;
+        free_rotation_init(&fr, P_L, Ii, Is, P_Es, phi, theta, psi);
+        #endif
+        
         #ifdef MIN_DV
         double Vmin = 1e20;
         double Vmax = -1e20;
         #endif
         
+        #ifdef DP45
+        // Adaptive integrator state carried over from one data interval to the next: the last step size, and
+        // the derivatives at the current point (reused as the first stage of the next step)
+        double h_dp = TIME_STEP;
+        double K1_dp[6];
+        int have_K1 = 0;
+        #endif
+        
         int i1, i2;
         #ifdef SEGMENT
         i1 = sp->start_seg[iseg];
@@ -267,27 +616,124 @@ __device__ CHI_FLOAT chi2one(double *params, struct obs_data *sData, int N_data,
         i1 = 0;
         i2 = N_data;
         #endif
+        // The points processed by this call (for the plot curve, only the range sp->plot_i1 ... sp->plot_i2-1):
+        int i_first = i1;
+        int i_last = i2;
+        #ifdef DENSE_PLOT
+        if (Nplot > 0)
+        {
+            if (sp->plot_i1 > i_first)
+                i_first = sp->plot_i1;
+            if (sp->plot_i2 < i_last)
+                i_last = sp->plot_i2;
+        }
+        #endif
+        
+        #if defined(DENSE_PLOT) && !defined(ANALYTIC)
+        // Dense output for the plot curve: the ODEs are integrated once, with RK4 steps of PLOT_TIME_STEP from the segment start,
+        // and the plot points are interpolated inside the current step [pa.t, pb.t] (cubic Hermite interpolation from the values
+        // and the derivatives at both ends)
+        struct plot_node pa, pb;
+        int k_node = 0;  // With sp->plot_nodes: pb is node k_node
+        if (Nplot > 0)
+        {
+            pb.t = sData->MJD[i1];
+            #ifdef TORQUE
+            pb.y[0] = Omega_i;
+            pb.y[1] = Omega_s;
+            pb.y[2] = Omega_l;
+            pb.y[3] = phi;
+            pb.y[4] = theta;
+            pb.y[5] = psi;
+            int n_ode = 6;
+            #else
+            pb.y[0] = phi;
+            pb.y[1] = theta;
+            pb.y[2] = psi;
+            int n_ode = 3;
+            #endif
+            ODE_func (pb.y, pb.f, mu);
+            // No step yet (a point before the segment start is linearly extrapolated from it):
+            pa.t = pb.t - PLOT_TIME_STEP;
+            for (int j=0; j<n_ode; j++)
+            {
+                pa.y[j] = pb.y[j] - PLOT_TIME_STEP*pb.f[j];
+                pa.f[j] = pb.f[j];
+            }
+            
+            if (sp->plot_nodes != NULL && sp->plot_i1 < 0)
+            {
+                // The seeding call: the integration of the whole segment, storing all the nodes (if they don't fit, the
+                // nodes are not used, and every call integrates by itself)
+                if (iseg == 0)
+                    sp->plot_node0[0] = 0;
+                k_node = sp->plot_node0[iseg];
+                if (k_node < sp->plot_N_nodes)
+                    sp->plot_nodes[k_node] = pb;
+                else
+                    sp->plot_nodes = NULL;
+                for (i=i1+1; i<i2 && sp->plot_nodes != NULL; i++)
+                    while (sData->MJD[i] > pb.t)
+                    {
+                        plot_step(&pa, &pb, mu);
+                        k_node++;
+                        if (k_node == sp->plot_N_nodes)
+                        {
+                            sp->plot_nodes = NULL;
+                            break;
+                        }
+                        sp->plot_nodes[k_node] = pb;
+                    }
+                if (iseg < N_SEG-1)
+                    sp->plot_node0[iseg+1] = k_node + 1;
+                continue;
+            }
+            if (sp->plot_nodes != NULL)
+            {
+                k_node = sp->plot_node0[iseg];
+                // A part starting inside the segment: the step the sequential computation would be at (no integration)
+                for (i=i1+1; i<i_first; i++)
+                    while (sData->MJD[i] > pb.t)
+                        plot_next(&pa, &pb, sp, &k_node, mu);
+            }
+        }
+        #endif
         
         #ifdef ANIMATE
         int i1_rgb = d_i1;
         int i2_rgb = d_i2;
         #endif
         
+        #ifdef TWO_PHASE
+        // Two-phase evaluation: the data points are processed in tiles of N_TILE points. For each tile, the Euler angles are first
+        // propagated sequentially (phase one), then the brightness is computed for all the tile points in a vectorized loop
+        // (phase two), and finally the chi2 sums are accumulated (phase three).
+        for (int i0=i_first; i0<i_last; i0+=N_TILE)
+        {
+        int i0_end = i0+N_TILE < i_last ? i0+N_TILE : i_last;
+        double t_phi[N_TILE], t_theta[N_TILE], t_psi[N_TILE], t_Vmod[N_TILE];
+        for (i=i0; i<i0_end; i++)
+        #else
         // The loop over all data points in the current segment 
-        for (i=i1; i<i2; i++)
+        for (i=i_first; i<i_last; i++)
+        #endif
         {                                
             
+            #ifdef ANALYTIC
+            if (i > i1)
+                free_rotation_angles(&fr, sData->MJD[i] - sData->MJD[i1], &phi, &theta, &psi);
+            #else
             // Derive the three Euler angles theta, phi, psi here, by solving three ODEs numerically
             if (i > i1)
             {
                 int N_steps;
                 double h;
-                OBS_TYPE t1 = sData[i-1].MJD;
-                OBS_TYPE t2 = sData[i].MJD;
+                OBS_TYPE t1 = sData->MJD[i-1];
+                OBS_TYPE t2 = sData->MJD[i];
                 
                 #ifdef TORQUE2
-                // The split point (in time) between the two torque regimes (can vary between sData[i1].MJD and sData[i2-1].MJD):
-                OBS_TYPE t_split = P_Tt*(sData[i2-1].MJD - sData[i1].MJD) + sData[i1].MJD;
+                // The split point (in time) between the two torque regimes (can vary between sData->MJD[i1] and sData->MJD[i2-1]):
+                OBS_TYPE t_split = P_Tt*(sData->MJD[i2-1] - sData->MJD[i1]) + sData->MJD[i1];
                 int Nsplit;
                 if (t_split >= t1 && t_split < t2)
                     // We are in the split time interval (when torque changes inside the interval), so need to run the ODE loop twice - 
@@ -306,22 +752,20 @@ __device__ CHI_FLOAT chi2one(double *params, struct obs_data *sData, int N_data,
                         else
                         {
                             t1 = t_split;
-                            t2 = sData[i].MJD;
+                            t2 = sData->MJD[i];
                             // Right after the split point, changing the torque parameters to th second set:
                             mu[3] = P_T2i;
                             mu[4] = P_T2s;
                             mu[5] = P_T2l;
+                            #ifdef DP45
+                            // The derivatives have changed:
+                            have_K1 = 0;
+                            #endif
                         }
                     }
                         
                 #endif
                 
-                // How many integration steps to the current (i-th) observed value, from the previous (i-1) one:
-                // Forcing the maximum possible time step of TIME_STEP days (macro parameter), to ensure accuracy
-                N_steps = (t2 - t1) / TIME_STEP + 1;
-                // Current equidistant time steps (h<=TIME_STEP):
-                h = (t2 - t1) / N_steps;
-                
                 // Initial values for ODEs variables = the old values, from the previous i cycle:
                 #ifdef TORQUE
                 const int N_ODE = 6;
@@ -340,36 +784,175 @@ __device__ CHI_FLOAT chi2one(double *params, struct obs_data *sData, int N_data,
                 y[2] = psi;
                 #endif            
                 
-                #ifdef PLOT_OMEGA
+                #if defined(PLOT_OMEGA) || defined(DP45)
                 double K1[N_ODE];
                 #endif
                 
-                // RK4 method for solving ODEs with a fixed time step h
-                for (int l=0; l<N_steps; l++)
+                #ifdef DP45
+                // Dormand-Prince 5(4) method with adaptive time step, controlled by the absolute error tolerance d_tol (-tol switch)
+                if (have_K1)
+                    for (int j=0; j<N_ODE; j++)
+                        K1[j] = K1_dp[j];
+                else
                 {
-                    double f[N_ODE], K2[N_ODE], K3[N_ODE], K4[N_ODE];
-                    #ifndef PLOT_OMEGA
-                    double K1[N_ODE];
-                    #endif
-                    
                     ODE_func (y, K1, mu);
-                    
+                    n_evals++;
+                }
+                // Integration direction (the time goes backwards for some light time corrected data points):
+                double dir = t2 >= t1 ? 1.0 : -1.0;
+                double t = t1;
+                while (dir*(t2 - t) > 0.0)
+                {
+                    double f[N_ODE], y5[N_ODE], K2[N_ODE], K3[N_ODE], K4[N_ODE], K5[N_ODE], K6[N_ODE], K7[N_ODE];
                     int j;
+                    // The last step is shortened to end exactly at t2:
+                    int last = (h_dp >= dir*(t2 - t));
+                    h = last ? t2 - t : dir*h_dp;
+                    
                     for (j=0; j<N_ODE; j++)
-                        f[j] = y[j] + 0.5*h*K1[j];
+                        f[j] = y[j] + h*A21*K1[j];
                     ODE_func (f, K2, mu);
-                    
                     for (j=0; j<N_ODE; j++)
-                        f[j] = y[j] + 0.5*h*K2[j];
+                        f[j] = y[j] + h*(A31*K1[j] + A32*K2[j]);
                     ODE_func (f, K3, mu);
-                    
                     for (j=0; j<N_ODE; j++)
-                        f[j] = y[j] + h*K3[j];
+                        f[j] = y[j] + h*(A41*K1[j] + A42*K2[j] + A43*K3[j]);
                     ODE_func (f, K4, mu);
+                    for (j=0; j<N_ODE; j++)
+                        f[j] = y[j] + h*(A51*K1[j] + A52*K2[j] + A53*K3[j] + A54*K4[j]);
+                    ODE_func (f, K5, mu);
+                    for (j=0; j<N_ODE; j++)
+                        f[j] = y[j] + h*(A61*K1[j] + A62*K2[j] + A63*K3[j] + A64*K4[j] + A65*K5[j]);
+                    ODE_func (f, K6, mu);
+                    for (j=0; j<N_ODE; j++)
+                        y5[j] = y[j] + h*(B1*K1[j] + B3*K3[j] + B4*K4[j] + B5*K5[j] + B6*K6[j]);
+                    ODE_func (y5, K7, mu);
+                    n_steps++;
+                    n_evals += 6;
                     
+                    // Error estimate (max norm), in the units of the tolerance:
+                    double err = 0.0;
                     for (j=0; j<N_ODE; j++)
-                        y[j] = y[j] + 1/6.0 * h *(K1[j] + 2*K2[j] + 2*K3[j] + K4[j]);
+                    {
+                        double e = fabs(h*(E1*K1[j] + E3*K3[j] + E4*K4[j] + E5*K5[j] + E6*K6[j] + E7*K7[j]));
+                        if (e > err || e != e)
+                            err = e;
+                    }
+                    err = err / d_tol;
+                    
+                    // Step size change factor (safety factor 0.9; the change is limited to 0.2 ... 5 times):
+                    double fac = 0.9 * pow(err, -0.2);
+                    if (fac > 5.0 || err == 0.0)
+                        fac = 5.0;
+                    if (fac < 0.2 || fac != fac)
+                        fac = 0.2;
+                    
+                    if (err > 1.0)
+                    {
+                        if (fabs(h) > DP45_H_MIN)
+                            // Rejected step
+                        {
+                            h_dp = fabs(h) * fac;
+                            continue;
+                        }
+                        else
+                            // Step size underflow; the model is rejected (chi2 becomes NaN)
+                            for (j=0; j<N_ODE; j++)
+                                y5[j] = nan("");
+                    }
+                    
+                    // Accepted step (NaN values stop the integration)
+                    for (j=0; j<N_ODE; j++)
+                    {
+                        y[j] = y5[j];
+                        K1[j] = K7[j];
+                    }
+                    // The shortened last step only changes the step size history if it has to decrease:
+                    if (!last || fac < 1.0)
+                        h_dp = fabs(h) * fac;
+                    if (last || y[0] != y[0])
+                        break;
+                    t = t + h;
                 }
+                for (int j=0; j<N_ODE; j++)
+                    K1_dp[j] = K1[j];
+                have_K1 = 1;
+                
+                #else
+                #if defined(DENSE_PLOT) && !defined(ANALYTIC)
+                if (Nplot > 0)
+                {
+                    // Plot point: RK4 steps until the current step brackets the point (no step if it is still inside the last one)
+                    while (t2 > pb.t)
+                        plot_next(&pa, &pb, sp, &k_node, mu);
+                    // Cubic Hermite interpolation inside [pa.t, pb.t]:
+                    if (t2 == pb.t)
+                        for (int j=0; j<N_ODE; j++)
+                            y[j] = pb.y[j];
+                    else
+                    {
+                        h = pb.t - pa.t;
+                        double x = (t2 - pa.t) / h;
+                        double h00 = (1.0 + 2.0*x) * (1.0 - x) * (1.0 - x);
+                        double h10 = x * (1.0 - x) * (1.0 - x);
+                        double h01 = x * x * (3.0 - 2.0*x);
+                        double h11 = x * x * (x - 1.0);
+                        for (int j=0; j<N_ODE; j++)
+                            y[j] = h00*pa.y[j] + h10*h*pa.f[j] + h01*pb.y[j] + h11*h*pb.f[j];
+                    }
+                    #ifdef PLOT_OMEGA
+                    ODE_func (y, K1, mu);
+                    #endif
+                }
+                else
+                #endif
+                {
+                    // Number of equidistant integration steps (|h|<=TIME_STEP) to the current (i-th) observed value, from the previous (i-1) one,
+                    // precomputed in read_data (integration_schedule):
+                    #ifdef TORQUE2
+                    if (Nsplit == 2)
+                    {
+                        // The split interval depends on the model (P_Tt), so it is scheduled here:
+                        N_steps = fabs(t2 - t1) / TIME_STEP + 1;
+                        h = (t2 - t1) / N_steps;
+                    }
+                    else
+                    #endif
+                    {
+                        N_steps = sData->N_steps[i];
+                        h = sData->h[i];
+                    }
+                    n_steps = n_steps + N_steps;
+                    n_evals = n_evals + 4*N_steps;
+                
+                    // RK4 method for solving ODEs with a fixed time step h
+                    for (int l=0; l<N_steps; l++)
+                    {
+                        double f[N_ODE], K2[N_ODE], K3[N_ODE], K4[N_ODE];
+                        #ifndef PLOT_OMEGA
+                        double K1[N_ODE];
+                        #endif
+                    
+                        ODE_func (y, K1, mu);
+                    
+                        int j;
+                        for (j=0; j<N_ODE; j++)
+                            f[j] = y[j] + 0.5*h*K1[j];
+                        ODE_func (f, K2, mu);
+                    
+                        for (j=0; j<N_ODE; j++)
+                            f[j] = y[j] + 0.5*h*K2[j];
+                        ODE_func (f, K3, mu);
+                    
+                        for (j=0; j<N_ODE; j++)
+                            f[j] = y[j] + h*K3[j];
+                        ODE_func (f, K4, mu);
+                    
+                        for (j=0; j<N_ODE; j++)
+                            y[j] = y[j] + 1/6.0 * h *(K1[j] + 2*K2[j] + 2*K3[j] + K4[j]);
+                    }
+                }
+                #endif // DP45
                 
                 
                 // New (current) values of the ODEs variables derived from solving the ODEs:
@@ -426,9 +1009,24 @@ __device__ CHI_FLOAT chi2one(double *params, struct obs_data *sData, int N_data,
                 }  // isplit loop
                 #endif
             }                
+            #endif // ANALYTIC
             
             // At this point we know the three Euler angles for the current moment of time (data point) - phi, theta, psi.
             
+            #ifdef TWO_PHASE
+            t_phi[i-i0] = phi;
+            t_theta[i-i0] = theta;
+            t_psi[i-i0] = psi;
+        }
+        
+        // Phase two (no dependencies between the points):
+        #pragma omp simd private(Ep_b, Ep_c, Ep_a, Sp_b, Sp_c, Sp_a)
+        for (i=i0; i<i0_end; i++)
+        {
+            double phi = t_phi[i-i0];
+            double theta = t_theta[i-i0];
+            double psi = t_psi[i-i0];
+            #endif
             double cos_phi = cos(phi);
             double sin_phi = sin(phi);
             
@@ -525,9 +1123,9 @@ __device__ CHI_FLOAT chi2one(double *params, struct obs_data *sData, int N_data,
             double E_x1,E_y1,E_z1, S_x1,S_y1,S_z1;
     
             // Quadratic interpolation:
-            rr[0] = (sData[i].MJD-sp->MJD0[1]) * (sData[i].MJD-sp->MJD0[2]) / (sp->MJD0[0]-sp->MJD0[1]) / (sp->MJD0[0]-sp->MJD0[2]);
-            rr[1] = (sData[i].MJD-sp->MJD0[0]) * (sData[i].MJD-sp->MJD0[2]) / (sp->MJD0[1]-sp->MJD0[0]) / (sp->MJD0[1]-sp->MJD0[2]);
-            rr[2] = (sData[i].MJD-sp->MJD0[0]) * (sData[i].MJD-sp->MJD0[1]) / (sp->MJD0[2]-sp->MJD0[0]) / (sp->MJD0[2]-sp->MJD0[1]);
+            rr[0] = (sData->MJD[i]-sp->MJD0[1]) * (sData->MJD[i]-sp->MJD0[2]) / (sp->MJD0[0]-sp->MJD0[1]) / (sp->MJD0[0]-sp->MJD0[2]);
+            rr[1] = (sData->MJD[i]-sp->MJD0[0]) * (sData->MJD[i]-sp->MJD0[2]) / (sp->MJD0[1]-sp->MJD0[0]) / (sp->MJD0[1]-sp->MJD0[2]);
+            rr[2] = (sData->MJD[i]-sp->MJD0[0]) * (sData->MJD[i]-sp->MJD0[1]) / (sp->MJD0[2]-sp->MJD0[0]) / (sp->MJD0[2]-sp->MJD0[1]);
             E_x1 = sp->E_x0[0]*rr[0] + sp->E_x0[1]*rr[1] + sp->E_x0[2]*rr[2];
             E_y1 = sp->E_y0[0]*rr[0] + sp->E_y0[1]*rr[1] + sp->E_y0[2]*rr[2];
             E_z1 = sp->E_z0[0]*rr[0] + sp->E_z0[1]*rr[1] + sp->E_z0[2]*rr[2];
@@ -545,12 +1143,12 @@ __device__ CHI_FLOAT chi2one(double *params, struct obs_data *sData, int N_data,
             S_z1= S_z1 / S;
             #else
             // Using Sun and Earth coordinates interpolated previously on CPU
-            #define E_x1 sData[i].E_x
-            #define E_y1 sData[i].E_y
-            #define E_z1 sData[i].E_z
-            #define S_x1 sData[i].S_x
-            #define S_y1 sData[i].S_y
-            #define S_z1 sData[i].S_z
+            #define E_x1 sData->E_x[i]
+            #define E_y1 sData->E_y[i]
+            #define E_z1 sData->E_z[i]
+            #define S_x1 sData->S_x[i]
+            #define S_y1 sData->S_y[i]
+            #define S_z1 sData->S_z[i]
             #endif
 
             // Earth vector in the new (b,c,a) basis
@@ -696,29 +1294,49 @@ __device__ CHI_FLOAT chi2one(double *params, struct obs_data *sData, int N_data,
             Vmod = Vmod - P_A*alpha;
             #endif        
             
+            #ifdef TWO_PHASE
+            t_Vmod[i-i0] = Vmod;
+        }
+        
+        // Phase three:
+        for (i=i0; i<i0_end; i++)
+        {
+            double Vmod = t_Vmod[i-i0];
+            #endif
+            
             if (Nplot > 0)
             {
                 #ifndef MINIMA_TEST                
+                #ifdef CPU
+                if (sp->Vplot != NULL)
+                    sp->Vplot[i] = Vmod + delta_V[0];
+                else
+                #endif
                 d_Vmod[i] = Vmod + delta_V[0]; //???
                 #endif                
             }
             else
             {
                 // Filter:
-                int m = sData[i].Filter;
+                int m = sData->Filter[i];
                 // Difference between the observational and model magnitudes:
-                double y = sData[i].V - Vmod;  
-//        printf("%f %f\n",sData[i].V ,Vmod);
-                sum_y2[m] = sum_y2[m] + y*y*sData[i].w;
-                sum_y[m] = sum_y[m] + y*sData[i].w;
-                sum_w[m] = sum_w[m] + sData[i].w;
+                double y = sData->V[i] - Vmod;  
+                #ifdef CPU
+                if (sp->Vmod != NULL)
+                    // Model magnitudes of the data points, for the residuals (lm.c):
+                    sp->Vmod[i] = Vmod;
+                #endif
+//        printf("%f %f\n",sData->V[i] ,Vmod);
+                sum_y2[m] = sum_y2[m] + y*y*sData->w[i];
+                sum_y[m] = sum_y[m] + y*sData->w[i];
+                sum_w[m] = sum_w[m] + sData->w[i];
             }
             #ifdef NUDGE
             // Determining if the previous time point was a local minimum
-            if (i < i1 + 2)
+            if (i < i_first + 2)
             {
-                t_old[i-i1] = sData[i].MJD;
-                V_old[i-i1] = Vmod;
+                t_old[i-i_first] = sData->MJD[i];
+                V_old[i-i_first] = Vmod;
             }
             else
             {
@@ -742,7 +1360,7 @@ __device__ CHI_FLOAT chi2one(double *params, struct obs_data *sData, int N_data,
                             }
                             // Using parabolic approximatioin to find the precise location of the local model minimum in the [i-2 ... i] interval
                             //Fitting a parabola to the three last points:
-                            double a = ((Vmod-V_old[1])/(sData[i].MJD-t_old[1]) - (V_old[1]-V_old[0])/(t_old[1]-t_old[0])) / (sData[i].MJD-t_old[0]);
+                            double a = ((Vmod-V_old[1])/(sData->MJD[i]-t_old[1]) - (V_old[1]-V_old[0])/(t_old[1]-t_old[0])) / (sData->MJD[i]-t_old[0]);
                             double b = (V_old[1]-V_old[0])/(t_old[1]-t_old[0]) - a*(t_old[1]+t_old[0]);
                             double c = V_old[1] - a*t_old[1]*t_old[1] - b*t_old[1];
                             // Maximum point for the parabola:
@@ -754,7 +1372,7 @@ __device__ CHI_FLOAT chi2one(double *params, struct obs_data *sData, int N_data,
                 // Shifting the values:
                 t_old[0] = t_old[1];
                 V_old[0] = V_old[1];
-                t_old[1] = sData[i].MJD;
+                t_old[1] = sData->MJD[i];
                 V_old[1] = Vmod;           
             }
             #endif
@@ -765,7 +1383,7 @@ __device__ CHI_FLOAT chi2one(double *params, struct obs_data *sData, int N_data,
                 // Determining if the previous time point was a local minimum
                 if (i < i1 + 2)
                 {
-                    t_old[i-i1] = sData[i].MJD;
+                    t_old[i-i1] = sData->MJD[i];
                     V_old[i-i1] = Vmod;
                 }
                 else
@@ -793,14 +1411,14 @@ __device__ CHI_FLOAT chi2one(double *params, struct obs_data *sData, int N_data,
                 // Shifting the values:
                 t_old[0] = t_old[1];
                 V_old[0] = V_old[1];
-                t_old[1] = sData[i].MJD;
+                t_old[1] = sData->MJD[i];
                 V_old[1] = Vmod;           
                 }
             }
             #endif
             
             #ifdef MIN_DV
-            if (sData[i].MJD > DV_MARGIN && sData[i].MJD < sData[N_data-1].MJD-DV_MARGIN)
+            if (sData->MJD[i] > DV_MARGIN && sData->MJD[i] < sData->MJD[N_data-1]-DV_MARGIN)
                 if (Vmod > Vmax)
                     Vmax = Vmod;
                 if (Vmod < Vmin)
@@ -808,10 +1426,19 @@ __device__ CHI_FLOAT chi2one(double *params, struct obs_data *sData, int N_data,
                 #endif
                 
         } // data points loop
+        #ifdef TWO_PHASE
+        } // tiles loop
+        #endif
         
         
     } // for (iseg) loop
     
+    if (Nplot < 0)
+    {
+        d_ode_steps = n_steps;
+        d_ode_evals = n_evals;
+    }
+    
     
     
     #ifdef MINIMA_TEST
@@ -1322,13 +1949,63 @@ __device__ int x2params(CHI_FLOAT *x, double *params, CHI_FLOAT sLimits[][N_TYPE
 
 //++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
 
+__device__ double dlsq2_point(struct obs_data *dData, int i, struct obs_data *dPlot, int Nplot, double *Vm, CHI_FLOAT *delta_V)
+// The squared 2D distance (t/T_SCALE, V/V_SCALE) between the data point i and the plot curve Vm[] (computed by chi2one with the
+// filter constants delta_V[]; the data magnitude is brought to the first filter, as the plot curve)
+{
+    double t = dData->MJD[i];
+    double V = dData->V[i] - delta_V[dData->Filter[i]] + delta_V[0];
+    // The nearest plot point in time (the plot times are increasing):
+    int k0 = 0, k1 = Nplot-1;
+    while (k1 - k0 > 1)
+    {
+        int k = (k0 + k1) / 2;
+        if (dPlot->MJD[k] <= t)
+            k0 = k;
+        else
+            k1 = k;
+    }
+    double d2_min = 1e30;
+    // Going outwards from there, while the time difference alone is smaller than the best distance:
+    for (int k=k0; k>=0; k--)
+    {
+        double dt = (t - dPlot->MJD[k]) / T_SCALE;
+        if (dt*dt >= d2_min)
+            break;
+        double dV = (V - Vm[k]) / V_SCALE;
+        if (dt*dt + dV*dV < d2_min)
+            d2_min = dt*dt + dV*dV;
+    }
+    for (int k=k0+1; k<Nplot; k++)
+    {
+        double dt = (dPlot->MJD[k] - t) / T_SCALE;
+        if (dt*dt >= d2_min)
+            break;
+        double dV = (V - Vm[k]) / V_SCALE;
+        if (dt*dt + dV*dV < d2_min)
+            d2_min = dt*dt + dV*dV;
+    }
+    return d2_min;
+}
+
+
+
+//++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+
+#ifndef CPU
+// The kernels below are only used in the GPU build; their host versions for the CPU build are in cpu.c
+
 #ifndef ANIMATE
 __global__ void chi2_gpu (struct obs_data *dData, int N_data, int N_filters, int reopt, int Nstages,
                           curandState* globalState, CHI_FLOAT *d_f, double* d_params, double* d_dV)
 // CUDA kernel computing chi^2 on GPU
 {        
     #ifndef NO_SDATA
-    __shared__ struct obs_data sData[MAX_DATA];
+    // Shared memory copy of the data (obs_data memory block, sized at launch time - h_sdata_size), and its arrays.
+    // If the data don't fit into shared memory (d_sdata=0), the device memory copy is used directly:
+    extern __shared__ double sBuf[];
+    struct obs_data sView;
+    struct obs_data *sData = d_sdata ? &sView : dData;
     #endif
     __shared__ CHI_FLOAT sLimits[2][N_TYPES];
     __shared__ volatile CHI_FLOAT s_f[BSIZE];
@@ -1350,21 +2027,22 @@ __global__ void chi2_gpu (struct obs_data *dData, int N_data, int N_filters, int
     if (threadIdx.x == 0)
     {
         #ifndef NO_SDATA
-          for (i=0; i<N_data; i++)
-              sData[i] = dData[i];
-          #ifdef INTERP
-          for (i=0; i<3; i++)
-          {
-              sp.E_x0[i] = dE_x0[i];
-              sp.E_y0[i] = dE_y0[i];
-              sp.E_z0[i] = dE_z0[i];
-              sp.S_x0[i] = dS_x0[i];
-              sp.S_y0[i] = dS_y0[i];
-              sp.S_z0[i] = dS_z0[i];
-              sp.MJD0[i] = dMJD0[i];
-          }
-          #endif
-        #endif        
+        if (d_sdata)
+            for (i=0; i<obs_size(N_data)/sizeof(int); i++)
+                ((int *)sBuf)[i] = ((int *)dData->buf)[i];
+        #endif
+        #ifdef INTERP
+        for (i=0; i<3; i++)
+        {
+            sp.E_x0[i] = dE_x0[i];
+            sp.E_y0[i] = dE_y0[i];
+            sp.E_z0[i] = dE_z0[i];
+            sp.S_x0[i] = dS_x0[i];
+            sp.S_y0[i] = dS_y0[i];
+            sp.S_z0[i] = dS_z0[i];
+            sp.MJD0[i] = dMJD0[i];
+        }
+        #endif
         #ifdef NUDGE
         // Copying the data on the observed minima from device to shared memory:
         sp.N_obs = d_chi2_params.N_obs;
@@ -1398,19 +2076,24 @@ __global__ void chi2_gpu (struct obs_data *dData, int N_data, int N_filters, int
             sp.start_seg[i] = d_start_seg[i];
         #endif   
         
-        s_x2_params.reopt = reopt;
+        // Island model (-island): the first d_N_migrants blocks reoptimize the models found by the other islands:
+        s_x2_params.reopt = reopt || blockIdx.x < d_N_migrants;
     }
     
     CHI_FLOAT x[N_PARAMS+1][N_PARAMS];  // simplex points (point index, coordinate)
     CHI_FLOAT f[N_PARAMS+1]; // chi2 values for the simplex edges (point index)
 
     __syncthreads();
+    #ifndef NO_SDATA
+    if (d_sdata)
+        obs_carve(sData, sBuf, N_data);
+    #endif
     
     if (s_x2_params.reopt)
     {
         // Reading the initial point from device memory
         for (i=0; i<N_PARAMS; i++)
-            params[i] = d_params0[i];
+            params[i] = blockIdx.x < d_N_migrants? d_migrants[blockIdx.x][i] : d_params0[i];
         // Converting from physical to dimensionless (0...1 scale) parameters:
         params2x(x[0], params, sLimits, sProperty, sTypes, &s_x2_params);
     }
@@ -1420,6 +2103,8 @@ __global__ void chi2_gpu (struct obs_data *dData, int N_data, int N_filters, int
     
     // Reading the global states from device memory:
     curandState localState = globalState[id];    
+    // Halton point index of the initial point (-start halton; -1 for random starting points):
+    long long qmc_n = qmc_index(id);
 
     for (int istage=0; istage<Nstages; istage++)
     {
@@ -1460,6 +2145,9 @@ __global__ void chi2_gpu (struct obs_data *dData, int N_data, int N_filters, int
         {
             // Generating random number in [0..1[ interval:
             float r = curand_uniform(&localState);
+            if (qmc_n >= 0 && !s_x2_params.reopt)
+                // Low-discrepancy point instead:
+                r = qmc_x(qmc_n, i);
             
             #ifdef BC
             #ifndef RANDOM_BC
@@ -1506,6 +2194,8 @@ __global__ void chi2_gpu (struct obs_data *dData, int N_data, int N_filters, int
             LAM = x[0][i]>=0.5;
             
         }
+        // (The next stages and the P_BOTH restarts use random points)
+        qmc_n = -1;
             
         // Simplex initialization (initial values x[j][i] for all j>0)
         // Vertex loop:
@@ -1590,10 +2280,17 @@ __global__ void chi2_gpu (struct obs_data *dData, int N_data, int N_filters, int
                 }            
             }
             if (jmin < 0)
-                // All f[] values are NaN, so exiting the thread
+                // The remaining f[] values are NaN: these points go to the end (as the worst ones)
             {
-                ind[0] = 0;
-                f[ind[0]] = 1e30;
+                if (j == 0)
+                    // All f[] values are NaN
+                    f[0] = 1e30;
+                for (int j2=0; j2<N_PARAMS+1; j2++)
+                    if (ind2[j2] == 0)
+                    {
+                        ind[j] = j2;
+                        j++;
+                    }
                 break;
             }
             ind[j] = jmin;
@@ -1839,19 +2536,11 @@ __global__ void chi2_gpu (struct obs_data *dData, int N_data, int N_filters, int
 #ifdef DEBUG2
 __global__ void debug_kernel(struct parameters_struct params, struct obs_data *dData, int N_data, int N_filters)
 {
-    __shared__ struct obs_data sData[MAX_DATA];
     int i;
     CHI_FLOAT f;
     
-    // Not efficient, for now:
-    if (threadIdx.x == 0)
-    {
-        for (i=0; i<N_data; i++)
-            sData[i] = dData[i];
-    }
-    
     // !!! Will not work in NUDGE mode - NULL
-    f = chi2one(params, sData, N_data, N_filters, delta_V, 0, NULL);
+    f = chi2one(params, dData, N_data, N_filters, delta_V, 0, NULL);
     
     return;
     
@@ -1936,7 +2625,7 @@ __global__ void chi2_plot (struct obs_data *dData, int N_data, int N_filters,
         #ifndef ANIMATE
         // !!! Will not work in NUDGE mode - NULL
         // Step one: computing constants for each filter (delta_V[]) using chi^2 method, and the chi2 value
-        d_chi2_plot = chi2one(params, dData, N_data, N_filters, delta_V, 0,  &sp, sTypes);
+        d_chi2_plot = chi2one(params, dData, N_data, N_filters, delta_V, -1,  &sp, sTypes);
         for (int m=0; m<N_filters; m++)
             d_delta_V[m] = delta_V[m];
         
@@ -1946,8 +2635,19 @@ __global__ void chi2_plot (struct obs_data *dData, int N_data, int N_filters,
             sp.start_seg[i] = d_plot_start_seg[i];
         #endif    
 
+        #ifdef DENSE_PLOT
+        #ifndef ANALYTIC
+        // The sequential part of step two (below): the integration of the plot curve, done once, storing all its nodes
+        sp.plot_nodes = d_plot_nodes;
+        sp.plot_N_nodes = d_plot_N_nodes;
+        sp.plot_i1 = sp.plot_i2 = -1;
+        if (blockIdx.x == 0 && blockIdx.y == 0)
+            chi2one(params, dPlot, Nplot, N_filters, delta_V, Nplot,  &sp, sTypes);
+        #endif
+        #else
         // Step two: computing the Nplots data points using the delta_V values from above:
         chi2one(params, dPlot, Nplot, N_filters, delta_V, Nplot,  &sp, sTypes);
+        #endif
 
         #if defined(SPHERICAL_K) && defined(TORQUE) && defined(PROFILES)
         // Converting torque vector from Cartesian to spherical coordinates, for confidence interval estimation
@@ -1975,6 +2675,30 @@ __global__ void chi2_plot (struct obs_data *dData, int N_data, int N_filters,
     return;
     #endif
     
+    #if defined(DENSE_PLOT) && !defined(ANIMATE)
+    // Step two: computing the Nplots data points using the delta_V values from above, in parallel (every thread interpolates
+    // the Euler angles between the stored nodes, and computes the brightness, for a contiguous part of the plot grid):
+    if (blockIdx.x == 0 && blockIdx.y == 0)
+    {
+        struct chi2_struct sp1 = sp;
+        int n = (Nplot + blockDim.x - 1) / blockDim.x;
+        sp1.plot_i1 = threadIdx.x * n;
+        sp1.plot_i2 = sp1.plot_i1 + n;
+        for (int i=0; i<N_PARAMS; i++)
+            params[i] = d_params0[i];
+        for (int m=0; m<N_filters; m++)
+            delta_V[m] = d_delta_V[m];
+        if (sp1.plot_i1 < Nplot)
+            chi2one(params, dPlot, Nplot, N_filters, delta_V, Nplot,  &sp1, sTypes);
+    }
+    __syncthreads();
+    #endif
+    
+    // The least squares distances between the data points and the plot curve:
+    if (blockIdx.x == 0 && blockIdx.y == 0)
+        for (int i=threadIdx.x; i<N_data; i+=blockDim.x)
+            d_dlsq2[i] = dlsq2_point(dData, i, dPlot, Nplot, d_Vmod, d_delta_V);
+    
     int blockid = blockIdx.x + gridDim.x*blockIdx.y;
         
     #ifdef PROFILES
@@ -2151,7 +2875,11 @@ __global__ void chi2_gpu_rms (struct obs_data *dData, int N_data, int N_filters,
 // CUDA kernel computing the confidence intervals for the input model, using RMSD method (Bartczak & Dudziński 2019)
 {        
     #ifndef NO_SDATA
-    __shared__ struct obs_data sData[MAX_DATA];
+    // Shared memory copy of the data (obs_data memory block, sized at launch time - h_sdata_size), and its arrays.
+    // If the data don't fit into shared memory (d_sdata=0), the device memory copy is used directly:
+    extern __shared__ double sBuf[];
+    struct obs_data sView;
+    struct obs_data *sData = d_sdata ? &sView : dData;
     #endif
     __shared__ CHI_FLOAT sLimits[2][N_TYPES];
     __shared__ volatile CHI_FLOAT s_f[BSIZE];
@@ -2173,21 +2901,22 @@ __global__ void chi2_gpu_rms (struct obs_data *dData, int N_data, int N_filters,
     if (threadIdx.x == 0)
     {
         #ifndef NO_SDATA
-          for (i=0; i<N_data; i++)
-              sData[i] = dData[i];
-          #ifdef INTERP
-          for (i=0; i<3; i++)
-          {
-              sp.E_x0[i] = dE_x0[i];
-              sp.E_y0[i] = dE_y0[i];
-              sp.E_z0[i] = dE_z0[i];
-              sp.S_x0[i] = dS_x0[i];
-              sp.S_y0[i] = dS_y0[i];
-              sp.S_z0[i] = dS_z0[i];
-              sp.MJD0[i] = dMJD0[i];
-          }
-          #endif
-        #endif        
+        if (d_sdata)
+            for (i=0; i<obs_size(N_data)/sizeof(int); i++)
+                ((int *)sBuf)[i] = ((int *)dData->buf)[i];
+        #endif
+        #ifdef INTERP
+        for (i=0; i<3; i++)
+        {
+            sp.E_x0[i] = dE_x0[i];
+            sp.E_y0[i] = dE_y0[i];
+            sp.E_z0[i] = dE_z0[i];
+            sp.S_x0[i] = dS_x0[i];
+            sp.S_y0[i] = dS_y0[i];
+            sp.S_z0[i] = dS_z0[i];
+            sp.MJD0[i] = dMJD0[i];
+        }
+        #endif
         for (i=0; i<N_TYPES; i++)
         {
             sLimits[0][i] = dLimits[0][i];
@@ -2203,6 +2932,10 @@ __global__ void chi2_gpu_rms (struct obs_data *dData, int N_data, int N_filters,
     }
     
     __syncthreads();
+    #ifndef NO_SDATA
+    if (d_sdata)
+        obs_carve(sData, sBuf, N_data);
+    #endif
     
     CHI_FLOAT x[2][N_PARAMS];  // simplex points (point index, coordinate)
     CHI_FLOAT par_min[N_PARAMS];
@@ -2388,6 +3121,8 @@ __global__ void chi2_gpu_rms (struct obs_data *dData, int N_data, int N_filters,
     }
     #endif //RMSD
 
+#endif // not CPU
+
 
 //--------------------------------------------------------------------------------------------------------------------------------------------------------------------------
 
@@ -2538,3 +3273,5 @@ __global__ void chi2_gpu_rms (struct obs_data *dData, int N_data, int N_filters,
         return;
     }
 #endif
+
+END_VARIANT
@@ -14,9 +14,9 @@ inline void gpuAssert(cudaError_t code, const char *file, int line, bool abort=t
 }
 
 #ifdef MAIN
-cudaDeviceProp deviceProp; 
-void Is_GPU_present()
+inline void Is_GPU_present()
 {
+  cudaDeviceProp deviceProp; 
   int devid, devcount;
   /* find number of device in current "context" */
   cudaGetDevice(&devid);
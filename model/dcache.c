@@ -0,0 +1,276 @@
+/* Memory-mapped binary cache of the preprocessed data set (-cache dir switch).
+ *
+ * read_data parses the light curve and the three .eph files and does the light time, absolute magnitude and ephemeris interpolation
+ * conversions every time the code starts, which dominates the startup of the short -plot and -reopt jobs. With -cache dir, the
+ * result of read_data (the obs_data arrays of the data and of the plot grid, plus the ephemeris brackets, MJD offset, filters and the
+ * integration schedule) is stored in dir/asteroid_<key>.bin, where key is a 64-bit FNV-1a hash of the contents of the data file and
+ * of asteroid.eph, earth.eph, sun.eph, of Nplot, and of the compile time settings which change the preprocessed data. The next runs
+ * with the same inputs map the file read-only (MAP_SHARED), so all the processes on a node share one page cache copy of the data,
+ * and nothing is parsed. The cache file is written to a temporary file which is then renamed, so concurrent jobs never see a partial
+ * file. A changed input file gets a new key (stale cache files are never reused, but are not deleted either).
+ */
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "asteroid.h"
+
+BEGIN_VARIANT
+
+// Cache file header; the arrays follow at page aligned offsets:
+struct dcache_header {
+    char magic[8];
+    unsigned long long key;
+    int N_data;
+    int N_filters;
+    int Nplot;
+    int sched_steps;
+    char all_filters[N_FILTERS];
+    double hMJD0;
+    double MJD0[3], E_x0[3], E_y0[3], E_z0[3], S_x0[3], S_y0[3], S_z0[3];
+    int start_seg[N_SEG];
+    int plot_start_seg[N_SEG];
+    size_t off_MJD;   // MJD_obs
+    size_t off_data;  // hData->buf
+    size_t off_plot;  // hPlot->buf
+    size_t size;      // Total file size
+};
+
+static const char DCACHE_MAGIC[8] = "ASTDAT1";
+
+
+static unsigned long long fnv1a(unsigned long long h, const void *p, size_t n)
+// 64-bit FNV-1a hash of n bytes at p, continuing from h
+{
+    const unsigned char *c = (const unsigned char *)p;
+    for (size_t i=0; i<n; i++)
+    {
+        h = h ^ c[i];
+        h = h * 0x100000001B3ULL;
+    }
+    return h;
+}
+
+
+static int fnv1a_file(unsigned long long *h, const char *name)
+// Adding the contents of the file name to the hash *h. Returns 1 if the file cannot be read.
+{
+    struct stat st;
+    int fd = open(name, O_RDONLY);
+    if (fd < 0)
+        return 1;
+    if (fstat(fd, &st) != 0)
+    {
+        close(fd);
+        return 1;
+    }
+    *h = fnv1a(*h, &st.st_size, sizeof(st.st_size));
+    if (st.st_size > 0)
+    {
+        void *p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p == MAP_FAILED)
+        {
+            close(fd);
+            return 1;
+        }
+        *h = fnv1a(*h, p, st.st_size);
+        munmap(p, st.st_size);
+    }
+    close(fd);
+    return 0;
+}
+
+
+static size_t dcache_align(size_t n)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    return (n + page - 1) / page * page;
+}
+
+
+static int dcache_key(char *data_file, int Nplot, unsigned long long *key)
+// The cache key for the given inputs. Returns 1 if one of the input files cannot be read.
+{
+    // Everything at compile time which changes the output of read_data:
+    char settings[1024];
+    #ifdef INTERP
+    int interp = 1;
+    #else
+    int interp = 0;
+    #endif
+    int n = snprintf(settings, sizeof(settings), "%s %d %d %d %d %d %d %d %.17g %.17g", DCACHE_MAGIC, (int)sizeof(OBS_TYPE), (int)sizeof(GEOM_TYPE),
+                     interp, N_FILTERS, N_SEG, OBS_POINT_SIZE, EPH_ORDER, TIME_STEP, light_speed);
+    #ifdef SEGMENT
+    for (int i=0; i<N_SEG && n < (int)sizeof(settings); i++)
+        n = n + snprintf(settings+n, sizeof(settings)-n, " %.17g", T_START[i]);
+    #endif
+
+    unsigned long long h = 0xCBF29CE484222325ULL;
+    h = fnv1a(h, settings, strlen(settings));
+    h = fnv1a(h, &Nplot, sizeof(int));
+    if (fnv1a_file(&h, data_file) || fnv1a_file(&h, "asteroid.eph") || fnv1a_file(&h, "earth.eph") || fnv1a_file(&h, "sun.eph"))
+        return 1;
+    *key = h;
+    return 0;
+}
+
+
+static int dcache_map(char *name, unsigned long long key, int Nplot, int *N_data, int *N_filters)
+// Setting up the data from the cache file name. Returns 1 if there is no valid cache file.
+{
+    struct stat st;
+    int fd = open(name, O_RDONLY);
+    if (fd < 0)
+        return 1;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(struct dcache_header))
+    {
+        close(fd);
+        return 1;
+    }
+    char *p = (char *)mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED)
+        return 1;
+    struct dcache_header *h = (struct dcache_header *)p;
+    if (memcmp(h->magic, DCACHE_MAGIC, 8) != 0 || h->key != key || h->Nplot != Nplot || h->size != (size_t)st.st_size ||
+        h->off_plot + (Nplot > 0? obs_size(Nplot) : 0) > h->size)
+    {
+        munmap(p, st.st_size);
+        return 1;
+    }
+
+    // The arrays stay mapped until the end of the run:
+    *N_data = h->N_data;
+    *N_filters = h->N_filters;
+    MJD_obs = (double *)(p + h->off_MJD);
+    ERR(cudaMallocHost(&hData, sizeof(struct obs_data)));
+    obs_carve(hData, p + h->off_data, *N_data);
+    if (Nplot > 0)
+    {
+        ERR(cudaMallocHost(&hPlot, sizeof(struct obs_data)));
+        obs_carve(hPlot, p + h->off_plot, Nplot);
+    }
+    h_sched_steps = h->sched_steps;
+    hMJD0 = h->hMJD0;
+    for (int i=0; i<3; i++)
+    {
+        MJD0[i] = h->MJD0[i];
+        E_x0[i] = h->E_x0[i];
+        E_y0[i] = h->E_y0[i];
+        E_z0[i] = h->E_z0[i];
+        S_x0[i] = h->S_x0[i];
+        S_y0[i] = h->S_y0[i];
+        S_z0[i] = h->S_z0[i];
+    }
+    #ifdef SEGMENT
+    for (int i=0; i<N_SEG; i++)
+    {
+        h_start_seg[i] = h->start_seg[i];
+        h_plot_start_seg[i] = h->plot_start_seg[i];
+    }
+    #endif
+    printf("Filters:\n");
+    for (int i=0; i<*N_filters; i++)
+    {
+        all_filters[i] = h->all_filters[i];
+        printf("%d: %c\n", i+1, all_filters[i]);
+    }
+    #ifdef DEBUG
+    printf("RK4 steps per chi2 evaluation: %d\n", h_sched_steps);
+    printf("Data from cache file %s\n", name);
+    #endif
+    return 0;
+}
+
+
+static void dcache_write(char *name, unsigned long long key, int N_data, int N_filters, int Nplot)
+// Writing the data set prepared by read_data to the cache file name (failures are not fatal: the run just goes on without the cache)
+{
+    struct dcache_header h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, DCACHE_MAGIC, 8);
+    h.key = key;
+    h.N_data = N_data;
+    h.N_filters = N_filters;
+    h.Nplot = Nplot;
+    h.sched_steps = h_sched_steps;
+    memcpy(h.all_filters, all_filters, N_FILTERS);
+    h.hMJD0 = hMJD0;
+    for (int i=0; i<3; i++)
+    {
+        h.MJD0[i] = MJD0[i];
+        h.E_x0[i] = E_x0[i];
+        h.E_y0[i] = E_y0[i];
+        h.E_z0[i] = E_z0[i];
+        h.S_x0[i] = S_x0[i];
+        h.S_y0[i] = S_y0[i];
+        h.S_z0[i] = S_z0[i];
+    }
+    #ifdef SEGMENT
+    for (int i=0; i<N_SEG; i++)
+    {
+        h.start_seg[i] = h_start_seg[i];
+        h.plot_start_seg[i] = h_plot_start_seg[i];
+    }
+    #endif
+    h.off_MJD = dcache_align(sizeof(h));
+    h.off_data = dcache_align(h.off_MJD + N_data*sizeof(double));
+    h.off_plot = dcache_align(h.off_data + obs_size(N_data));
+    h.size = h.off_plot + (Nplot > 0? obs_size(Nplot) : 0);
+
+    // A unique temporary name, so concurrent jobs don't write into the same file:
+    char tmp_name[MAX_FILE_NAME+32];
+    snprintf(tmp_name, sizeof(tmp_name), "%s.%d.tmp", name, (int)getpid());
+    FILE *fc = fopen(tmp_name, "wb");
+    if (fc == NULL)
+    {
+        printf("Warning: cannot write data cache file %s\n", tmp_name);
+        return;
+    }
+    int n_bad = 0;
+    n_bad += fwrite(&h, sizeof(h), 1, fc) != 1;
+    n_bad += fseek(fc, h.off_MJD, SEEK_SET) != 0;
+    n_bad += fwrite(MJD_obs, sizeof(double), N_data, fc) != (size_t)N_data;
+    n_bad += fseek(fc, h.off_data, SEEK_SET) != 0;
+    n_bad += fwrite(hData->buf, 1, obs_size(N_data), fc) != obs_size(N_data);
+    if (Nplot > 0)
+    {
+        n_bad += fseek(fc, h.off_plot, SEEK_SET) != 0;
+        n_bad += fwrite(hPlot->buf, 1, obs_size(Nplot), fc) != obs_size(Nplot);
+    }
+    else
+        // Padding to the full size
+        n_bad += ftruncate(fileno(fc), h.size) != 0;
+    n_bad += fclose(fc) != 0;
+    if (n_bad || rename(tmp_name, name) != 0)
+    {
+        printf("Warning: cannot write data cache file %s\n", name);
+        unlink(tmp_name);
+    }
+    return;
+}
+
+
+int read_data_cached(char *cache_dir, char *data_file, int *N_data, int *N_filters, int Nplot)
+// read_data, using the binary cache in the directory cache_dir (if cache_dir is NULL, or the inputs cannot be hashed, just read_data)
+{
+    unsigned long long key;
+    char name[MAX_FILE_NAME+32];
+
+    #if defined(DUMP_DV) || defined(DUMP_RED_BLUE)
+    // The dumps are done (and the code exits) in read_data
+    cache_dir = NULL;
+    #endif
+    if (cache_dir == NULL || dcache_key(data_file, Nplot, &key))
+        return read_data(data_file, N_data, N_filters, Nplot);
+
+    snprintf(name, sizeof(name), "%s/asteroid_%016llx.bin", cache_dir, key);
+    if (dcache_map(name, key, Nplot, N_data, N_filters) == 0)
+        return 0;
+
+    read_data(data_file, N_data, N_filters, Nplot);
+    dcache_write(name, key, *N_data, *N_filters, Nplot);
+    return 0;
+}
+
+END_VARIANT
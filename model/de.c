@@ -0,0 +1,301 @@
+/* Differential evolution optimizer for the CPU build (-opt de).
+ *
+ * An alternative to the BSIZE independent random-start simplex runs of every block in the initial optimization stage: each block
+ * evolves a population of DE_NP points in the dimensionless x[] space of x2params, with the DE/current-to-pbest/1/bin strategy
+ * (Zhang & Sanderson 2009, JADE, without the parameter adaptation). The trial points of all the blocks are evaluated together
+ * in every generation, in parallel (in the chi2_batch lanes in BATCH mode, with chi2one otherwise). At the end, the best BSIZE
+ * points of each population take the place of the BSIZE simplex results of the block, so the block reduction and the
+ * reoptimization stages (Nstages>1) in chi2_cpu don't change.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include "asteroid.h"
+
+BEGIN_VARIANT
+
+#ifdef CPU
+
+// Device arrays, under the same names as the shared memory copies in the kernels:
+#define sLimits dLimits
+#define sProperty dProperty
+#define sTypes dTypes
+
+#define SMALL 1e-8  // Small offset from the hard parameter limits
+
+
+static int hard_left(int i)
+// Whether the lower limit (x=0) of the parameter i is hard. PERIODIC_LAM parameters (psi_0) are always treated as hard here.
+{
+    return sProperty[i][P_periodic]==HARD_BOTH || sProperty[i][P_periodic]==HARD_LEFT || sProperty[i][P_periodic]==PERIODIC_LAM;
+}
+
+
+static int hard_right(int i)
+{
+    return sProperty[i][P_periodic]==HARD_BOTH || sProperty[i][P_periodic]==HARD_RIGHT || sProperty[i][P_periodic]==PERIODIC_LAM;
+}
+
+
+static void de_init_point(CHI_FLOAT *x, CHI_FLOAT *x_start, struct x2_struct *s_x2_params, curandState *localState, long long qmc_n)
+// A random point of the initial population; the same distribution as the first vertex of the initial simplex (simplex_init in cpu.c):
+// the full range (the Halton point qmc_n if qmc_n >= 0), or (reopt=1) within +-DX_RAND/2 from x_start.
+{
+    for (int i=0; i<N_PARAMS; i++)
+    {
+        float r = curand_uniform(localState);
+        if (qmc_n >= 0 && !s_x2_params->reopt)
+            r = qmc_x(qmc_n, i);
+
+        #if defined(BC) && !defined(RANDOM_BC)
+        if (!s_x2_params->reopt)
+        {
+            // Initial vales of c/b are equal to initial values of c_tumb/b_tumb:
+            if (sProperty[i][P_type] == T_c)
+            {
+                x[i] = x[sTypes[T_c_tumb][sProperty[i][P_iseg]]];
+                continue;
+            }
+            else if (sProperty[i][P_type] == T_b)
+            {
+                x[i] = x[sTypes[T_b_tumb][sProperty[i][P_iseg]]];
+                continue;
+            }
+        }
+        #endif
+
+        if (!s_x2_params->reopt || sProperty[i][P_frozen]==-1)
+            x[i] = DX_INI+SMALL + r*(1.0 - 2*(SMALL+DX_INI));
+        else
+        {
+            CHI_FLOAT xmin = x_start[i] - DX_RAND;
+            CHI_FLOAT xmax = x_start[i] + DX_RAND;
+            if (xmin<SMALL && hard_left(i))
+                xmin = SMALL;
+            if (xmax>1.0-SMALL && hard_right(i))
+                xmax = 1.0 - SMALL;
+            x[i] = xmin + r*(xmax-xmin);
+        }
+    }
+    return;
+}
+
+
+static void de_eval(CHI_FLOAT (*xt)[N_PARAMS], int *list, int n, CHI_FLOAT *ft, struct obs_data *dData, int N_data, int N_filters,
+                    struct x2_struct *s_x2_params, struct chi2_struct *sp)
+// chi2 for the n points xt[list[k]] (all blocks together, in parallel), stored in ft[list[k]]. The points where x2params fails
+// (and NaN chi2 values) get 1e30.
+{
+    long long int n_eval = 0;
+    #ifdef BATCH
+    #pragma omp parallel for schedule(dynamic) reduction(+:n_eval)
+    for (int k0=0; k0<n; k0+=K_BATCH)
+    {
+        double params[N_PARAMS];
+        double pb[N_PARAMS][K_BATCH];
+        CHI_FLOAT fb[K_BATCH];
+        int failed[K_BATCH];
+        int k_good = -1;
+        for (int k=0; k<K_BATCH; k++)
+        {
+            failed[k] = 1;
+            if (k0+k >= n)
+                continue;
+            int m = list[k0+k];
+            if (x2params(xt[m], params, sLimits, &s_x2_params[m/DE_NP], sProperty, sTypes) == 0)
+            {
+                failed[k] = 0;
+                k_good = k;
+                n_eval++;
+                for (int i=0; i<N_PARAMS; i++)
+                    pb[i][k] = params[i];
+            }
+        }
+        if (k_good >= 0)
+        {
+            // Unused lanes get a copy of a good model:
+            for (int k=0; k<K_BATCH; k++)
+                if (failed[k])
+                    for (int i=0; i<N_PARAMS; i++)
+                        pb[i][k] = pb[i][k_good];
+            chi2_batch(pb, dData, N_data, N_filters, fb, NULL, sp);
+        }
+        for (int k=0; k<K_BATCH && k0+k<n; k++)
+            ft[list[k0+k]] = failed[k] || !(fb[k] < 1e30) ? 1e30 : fb[k];
+    }
+    #else
+    #pragma omp parallel for schedule(dynamic) reduction(+:n_eval)
+    for (int k=0; k<n; k++)
+    {
+        double params[N_PARAMS];
+        CHI_FLOAT delta_V[N_FILTERS];
+        int m = list[k];
+        ft[m] = 1e30;
+        if (x2params(xt[m], params, sLimits, &s_x2_params[m/DE_NP], sProperty, sTypes) == 0)
+        {
+            CHI_FLOAT f = chi2one(params, dData, N_data, N_filters, delta_V, 0, sp, sTypes);
+            n_eval++;
+            if (f < 1e30)
+                ft[m] = f;
+        }
+    }
+    #endif
+    h_simplex_evals += n_eval;
+    return;
+}
+
+
+static void de_sort(CHI_FLOAT *f, int *ind)
+// Indexes of the DE_NP population points, in the order of increasing chi2 (insertion sort; stable)
+{
+    for (int m=0; m<DE_NP; m++)
+    {
+        int j = m;
+        while (j > 0 && f[ind[j-1]] > f[m])
+        {
+            ind[j] = ind[j-1];
+            j--;
+        }
+        ind[j] = m;
+    }
+    return;
+}
+
+
+void de_stage(struct obs_data *dData, int N_data, int N_filters, int N_blocks, CHI_FLOAT *s_f, CHI_FLOAT (*x_min)[N_PARAMS],
+              CHI_FLOAT (*s_x0)[N_PARAMS], struct x2_struct *s_x2_params, curandState* globalState, struct chi2_struct *sp)
+// One optimization stage with differential evolution, for N_blocks blocks (populations). Block iblock uses the initial point
+// s_x0[iblock] (when reoptimizing; the first population point is s_x0[iblock] itself), s_x2_params[iblock], and the random
+// numbers stream globalState[iblock*BSIZE]. The best BSIZE points are returned in s_f[iblock*BSIZE...], x_min[iblock*BSIZE...]
+{
+    const int N = N_blocks * DE_NP;
+    CHI_FLOAT (*x)[N_PARAMS] = (CHI_FLOAT (*)[N_PARAMS])malloc(N * N_PARAMS * sizeof(CHI_FLOAT));   // Population
+    CHI_FLOAT (*xt)[N_PARAMS] = (CHI_FLOAT (*)[N_PARAMS])malloc(N * N_PARAMS * sizeof(CHI_FLOAT));  // Trial points
+    CHI_FLOAT *f = (CHI_FLOAT *)malloc(N * sizeof(CHI_FLOAT));
+    CHI_FLOAT *ft = (CHI_FLOAT *)malloc(N * sizeof(CHI_FLOAT));
+    int *ind = (int *)malloc(N * sizeof(int));
+    int *list = (int *)malloc(N * sizeof(int));
+    int *done = (int *)malloc(N_blocks * sizeof(int));
+
+    // Initial populations:
+    for (int iblock=0; iblock<N_blocks; iblock++)
+    {
+        done[iblock] = 0;
+        for (int m=0; m<DE_NP; m++)
+        {
+            int mm = iblock*DE_NP + m;
+            if (s_x2_params[iblock].reopt && m == 0)
+                for (int i=0; i<N_PARAMS; i++)
+                    x[mm][i] = s_x0[iblock][i];
+            else
+                de_init_point(x[mm], s_x0[iblock], &s_x2_params[iblock], &globalState[iblock*BSIZE], qmc_index(mm));
+            list[mm] = mm;
+        }
+    }
+    de_eval(x, list, N, f, dData, N_data, N_filters, s_x2_params, sp);
+
+    for (int igen=0; igen<DE_GEN; igen++)
+    {
+        // Trial points for all the active populations:
+        int n = 0;
+        for (int iblock=0; iblock<N_blocks; iblock++)
+        {
+            if (done[iblock])
+                continue;
+            CHI_FLOAT (*xb)[N_PARAMS] = &x[iblock*DE_NP];
+            curandState *localState = &globalState[iblock*BSIZE];
+            int *indb = &ind[iblock*DE_NP];
+            de_sort(&f[iblock*DE_NP], indb);
+            for (int m=0; m<DE_NP; m++)
+            {
+                // Random pbest point, and two random points different from m (and from each other):
+                int p = indb[(int)(curand_uniform(localState)*DE_PBEST) % DE_PBEST];
+                int r1, r2;
+                do
+                    r1 = (int)(curand_uniform(localState)*DE_NP) % DE_NP;
+                while (r1 == m);
+                do
+                    r2 = (int)(curand_uniform(localState)*DE_NP) % DE_NP;
+                while (r2 == m || r2 == r1);
+                CHI_FLOAT F = DE_F_MIN + curand_uniform(localState)*(DE_F_MAX-DE_F_MIN);
+                int i_rand = (int)(curand_uniform(localState)*N_PARAMS) % N_PARAMS;
+                CHI_FLOAT *xtm = xt[iblock*DE_NP + m];
+                for (int i=0; i<N_PARAMS; i++)
+                {
+                    float r = curand_uniform(localState);
+                    if (sProperty[i][P_frozen] == 1 || i != i_rand && r > DE_CR)
+                    {
+                        xtm[i] = xb[m][i];
+                        continue;
+                    }
+                    CHI_FLOAT v = xb[m][i] + F*(xb[p][i] - xb[m][i]) + F*(xb[r1][i] - xb[r2][i]);
+                    // Points beyond the hard limits are moved half-way between the parent and the limit:
+                    if (v < 0.0 && hard_left(i))
+                        v = 0.5*xb[m][i];
+                    if (v > 1.0 && hard_right(i))
+                        v = 0.5*(1.0 + xb[m][i]);
+                    xtm[i] = v;
+                }
+                list[n++] = iblock*DE_NP + m;
+            }
+        }
+        if (n == 0)
+            break;
+
+        de_eval(xt, list, n, ft, dData, N_data, N_filters, s_x2_params, sp);
+
+        // Selection, and the convergence test (the population size, as for the simplex):
+        for (int iblock=0; iblock<N_blocks; iblock++)
+        {
+            if (done[iblock])
+                continue;
+            CHI_FLOAT x0[N_PARAMS];
+            for (int i=0; i<N_PARAMS; i++)
+                x0[i] = 0.0;
+            for (int m=iblock*DE_NP; m<(iblock+1)*DE_NP; m++)
+            {
+                if (ft[m] <= f[m])
+                {
+                    f[m] = ft[m];
+                    for (int i=0; i<N_PARAMS; i++)
+                        x[m][i] = xt[m][i];
+                }
+                for (int i=0; i<N_PARAMS; i++)
+                    x0[i] += x[m][i] / DE_NP;
+            }
+            CHI_FLOAT size2 = 0.0;
+            for (int m=iblock*DE_NP; m<(iblock+1)*DE_NP; m++)
+                for (int i=0; i<N_PARAMS; i++)
+                    size2 += (x[m][i]-x0[i]) * (x[m][i]-x0[i]);
+            if (size2 / (DE_NP*N_PARAMS) < SIZE2_MIN)
+                done[iblock] = 1;
+            h_simplex_steps++;
+        }
+    }
+
+    // The best BSIZE points of each population:
+    for (int iblock=0; iblock<N_blocks; iblock++)
+    {
+        int *indb = &ind[iblock*DE_NP];
+        de_sort(&f[iblock*DE_NP], indb);
+        for (int k=0; k<BSIZE; k++)
+        {
+            int m = iblock*DE_NP + indb[k];
+            s_f[iblock*BSIZE + k] = f[m];
+            for (int i=0; i<N_PARAMS; i++)
+                x_min[iblock*BSIZE + k][i] = x[m][i];
+        }
+    }
+
+    free(x);
+    free(xt);
+    free(f);
+    free(ft);
+    free(ind);
+    free(list);
+    free(done);
+    return;
+}
+
+#endif // CPU
+
+END_VARIANT
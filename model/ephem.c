@@ -0,0 +1,267 @@
+/* Ephemeris interpolation (used by read_data).
+ *
+ * All the epochs of asteroid.eph, earth.eph and sun.eph (HORIZONS vectors tables, same epochs in all three files) are read, and
+ * the asteroid->Earth and asteroid->Sun vectors are interpolated with piecewise Chebyshev polynomials of degree EPH_ORDER (or
+ * N_epochs-1, if there are fewer epochs). Window w is the Chebyshev interpolant through the epochs w ... w+EPH_ORDER; the interval
+ * between the epochs k and k+1 uses the window which has it in the middle (shifted inwards at the ends of the table), so the
+ * interpolation is continuous at the epochs, and there is no limit on the number of epochs (multi-month and multi-apparition
+ * arcs). The vectors and the light time of all the data and plot points are computed once, in read_data.
+ * With INTERP the GPU still does its own quadratic interpolation, so exactly three epochs are required.
+ */
+#include "asteroid.h"
+
+BEGIN_VARIANT
+
+static int eph_N = 0;                // Number of epochs
+static int eph_order = 0;            // Polynomial degree (EPH_ORDER, or less for short tables)
+static double *eph_MJD = NULL;       // Epochs (MJD)
+static double *eph_coef = NULL;      // Chebyshev coefficients: [window][6 vector components][eph_order+1]
+
+
+static int ephem_line(FILE *fp, char *line, int size, char *name)
+// Next line of an ephemeris file; 1 at the end of the data
+{
+    if (fgets(line, size, fp) == NULL)
+    {
+        printf("Ephemeris file %s: no $$EOE line!\n", name);
+        exit(1);
+    }
+    return strcmp(line, "$$EOE\n") == 0;
+}
+
+
+static int ephem_window(int k)
+// The window used for the interval between epochs k and k+1
+{
+    int w = k - (eph_order-1)/2;
+    if (w > eph_N-1 - eph_order)
+        w = eph_N-1 - eph_order;
+    if (w < 0)
+        w = 0;
+    return w;
+}
+
+
+static void ephem_fit(int w, double (*v)[6])
+// Chebyshev coefficients of window w (interpolation through its eph_order+1 epochs), by Gaussian elimination
+{
+    int n = eph_order + 1;
+    double A[EPH_ORDER+1][EPH_ORDER+1], b[EPH_ORDER+1][6];
+    double t0 = eph_MJD[w], t1 = eph_MJD[w+eph_order];
+
+    for (int i=0; i<n; i++)
+    {
+        double x = (2*eph_MJD[w+i] - t0 - t1) / (t1 - t0);
+        // Chebyshev polynomials at x:
+        A[i][0] = 1.0;
+        if (n > 1)
+            A[i][1] = x;
+        for (int j=2; j<n; j++)
+            A[i][j] = 2*x*A[i][j-1] - A[i][j-2];
+        for (int c=0; c<6; c++)
+            b[i][c] = v[w+i][c];
+    }
+
+    // Elimination with partial pivoting:
+    for (int j=0; j<n; j++)
+    {
+        int p = j;
+        for (int i=j+1; i<n; i++)
+            if (fabs(A[i][j]) > fabs(A[p][j]))
+                p = i;
+        for (int l=0; l<n; l++)
+        {
+            double tmp = A[j][l];  A[j][l] = A[p][l];  A[p][l] = tmp;
+        }
+        for (int c=0; c<6; c++)
+        {
+            double tmp = b[j][c];  b[j][c] = b[p][c];  b[p][c] = tmp;
+        }
+        for (int i=j+1; i<n; i++)
+        {
+            double r = A[i][j] / A[j][j];
+            for (int l=j; l<n; l++)
+                A[i][l] = A[i][l] - r*A[j][l];
+            for (int c=0; c<6; c++)
+                b[i][c] = b[i][c] - r*b[j][c];
+        }
+    }
+    // Back substitution:
+    double *coef = &eph_coef[w*6*n];
+    for (int c=0; c<6; c++)
+        for (int j=n-1; j>=0; j--)
+        {
+            double s = b[j][c];
+            for (int l=j+1; l<n; l++)
+                s = s - A[j][l]*coef[c*n + l];
+            coef[c*n + j] = s / A[j][j];
+        }
+}
+
+
+int ephem_read()
+// Reading the three ephemeris files and setting up the interpolation. Returns the number of epochs.
+{
+    char lineA[MAX_LINE_LENGTH], lineE[MAX_LINE_LENGTH], lineS[MAX_LINE_LENGTH];
+    char *names[3] = {(char *)"asteroid.eph", (char *)"earth.eph", (char *)"sun.eph"};
+    FILE *fp[3];
+    char *line[3] = {lineA, lineE, lineS};
+
+    for (int f=0; f<3; f++)
+    {
+        fp[f] = fopen(names[f], "r");
+        if (fp[f] == NULL)
+        {
+            printf("Ephemeris file %s does not exist!\n", names[f]);
+            exit(1);
+        }
+        // Pointing to the data portion in each file
+        while (fgets(line[f], MAX_LINE_LENGTH, fp[f]))
+            if (strcmp(line[f], "$$SOE\n") == 0)
+                break;
+    }
+
+    // Epochs and the asteroid->Earth, asteroid->Sun vectors (E_x, E_y, E_z, S_x, S_y, S_z):
+    int N_max = 1024;
+    double (*v)[6] = (double (*)[6])malloc(N_max * sizeof(double[6]));
+    eph_MJD = (double *)malloc(N_max * sizeof(double));
+    eph_N = 0;
+    while (1)
+    {
+        // Even data lines contain JD:
+        int end = 0;
+        for (int f=0; f<3; f++)
+            end = end + ephem_line(fp[f], line[f], MAX_LINE_LENGTH, names[f]);
+        if (end == 3)
+            break;
+        if (end > 0)
+        {
+            printf("The ephemeris files have different numbers of epochs!\n");
+            exit(1);
+        }
+        if (eph_N == N_max)
+        {
+            N_max = 2*N_max;
+            v = (double (*)[6])realloc(v, N_max * sizeof(double[6]));
+            eph_MJD = (double *)realloc(eph_MJD, N_max * sizeof(double));
+        }
+        double JD;
+        sscanf(lineA, "%lf", &JD);
+        // Light travel corrected:
+        eph_MJD[eph_N] = JD - 2400000.5;
+        if (eph_N > 0 && eph_MJD[eph_N] <= eph_MJD[eph_N-1])
+        {
+            printf("Error: the ephemeris epochs have to be sorted chronologically!\n");
+            exit(1);
+        }
+
+        // Odd data lines contain X,Y,Z:
+        double Xa,Ya,Za, Xe,Ye,Ze, Xs,Ys,Zs;
+        for (int f=0; f<3; f++)
+            ephem_line(fp[f], line[f], MAX_LINE_LENGTH, names[f]);
+        sscanf(lineA, "%lE %lE %lE", &Xa, &Ya, &Za);
+        sscanf(lineE, "%lE %lE %lE", &Xe, &Ye, &Ze);
+        sscanf(lineS, "%lE %lE %lE", &Xs, &Ys, &Zs);
+        // Asteroid -> Earth vector:
+        v[eph_N][0] = Xe - Xa;
+        v[eph_N][1] = Ye - Ya;
+        v[eph_N][2] = Ze - Za;
+        // Asteroid -> Sun vector:
+        v[eph_N][3] = Xs - Xa;
+        v[eph_N][4] = Ys - Ya;
+        v[eph_N][5] = Zs - Za;
+        eph_N++;
+    }
+    for (int f=0; f<3; f++)
+        fclose(fp[f]);
+
+    if (eph_N < 2)
+    {
+        printf("At least two ephemeris epochs are required!\n");
+        exit(1);
+    }
+    #ifdef INTERP
+    if (eph_N != 3)
+    {
+        printf("INTERP requires exactly three ephemeris epochs (found %d)!\n", eph_N);
+        exit(1);
+    }
+    // The epochs for the interpolation in chi2one:
+    for (int m=0; m<3; m++)
+    {
+        MJD0[m] = eph_MJD[m];
+        E_x0[m] = v[m][0];
+        E_y0[m] = v[m][1];
+        E_z0[m] = v[m][2];
+        S_x0[m] = v[m][3];
+        S_y0[m] = v[m][4];
+        S_z0[m] = v[m][5];
+    }
+    #endif
+
+    eph_order = eph_N-1 < EPH_ORDER? eph_N-1 : EPH_ORDER;
+    int N_windows = eph_N - eph_order;
+    eph_coef = (double *)malloc(N_windows * 6 * (eph_order+1) * sizeof(double));
+    for (int w=0; w<N_windows; w++)
+        ephem_fit(w, v);
+    free(v);
+    #ifdef DEBUG
+    printf("Ephemeris: %d epochs, MJD %.5f ... %.5f, Chebyshev degree %d\n", eph_N, eph_MJD[0], eph_MJD[eph_N-1], eph_order);
+    #endif
+    return eph_N;
+}
+
+
+int ephem_eval(double MJD, OBS_TYPE *E_x1, OBS_TYPE *E_y1, OBS_TYPE *E_z1, OBS_TYPE *S_x1, OBS_TYPE *S_y1, OBS_TYPE *S_z1)
+// The asteroid->Earth and asteroid->Sun vectors (au, not normalized) at the time MJD. Returns 1 if MJD is outside the ephemeris
+// (the vectors are then extrapolated from the first or the last window).
+{
+    // The interval bracketing MJD (binary search):
+    int k0 = 0, k1 = eph_N-1;
+    while (k1 - k0 > 1)
+    {
+        int k = (k0 + k1) / 2;
+        if (eph_MJD[k] <= MJD)
+            k0 = k;
+        else
+            k1 = k;
+    }
+    int w = ephem_window(k0);
+    int n = eph_order + 1;
+    double t0 = eph_MJD[w], t1 = eph_MJD[w+eph_order];
+    double x = (2*MJD - t0 - t1) / (t1 - t0);
+
+    // Clenshaw summation of the Chebyshev series:
+    double r[6];
+    double *coef = &eph_coef[w*6*n];
+    for (int c=0; c<6; c++)
+    {
+        double b1 = 0.0, b2 = 0.0;
+        for (int j=n-1; j>=1; j--)
+        {
+            double b0 = 2*x*b1 - b2 + coef[c*n + j];
+            b2 = b1;
+            b1 = b0;
+        }
+        r[c] = x*b1 - b2 + coef[c*n];
+    }
+    *E_x1 = r[0];
+    *E_y1 = r[1];
+    *E_z1 = r[2];
+    *S_x1 = r[3];
+    *S_y1 = r[4];
+    *S_z1 = r[5];
+
+    return MJD < eph_MJD[0] || MJD > eph_MJD[eph_N-1];
+}
+
+
+void ephem_free()
+{
+    free(eph_MJD);
+    free(eph_coef);
+    eph_MJD = eph_coef = NULL;
+    eph_N = 0;
+}
+
+END_VARIANT
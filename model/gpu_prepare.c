@@ -1,4 +1,6 @@
 #include "asteroid.h"
+
+BEGIN_VARIANT
 int gpu_prepare(int N_data, int N_filters, int N_threads, int Nplot)
 {
 
@@ -10,8 +12,38 @@ int gpu_prepare(int N_data, int N_filters, int N_threads, int Nplot)
     ERR(cudaMallocHost(&h_params, N_BLOCKS * N_PARAMS * sizeof(double)));
     ERR(cudaMallocHost(&h_dV, N_BLOCKS * N_FILTERS * sizeof(double)));
     
-    ERR(cudaMallocHost(&dData, N_data * sizeof(struct obs_data)));    
-    ERR(cudaMemcpy(dData, hData, N_data * sizeof(struct obs_data), cudaMemcpyHostToDevice));
+    obs_alloc(&dData, N_data);
+    ERR(cudaMemcpy(dData->buf, hData->buf, obs_size(N_data), cudaMemcpyHostToDevice));
+
+#if !defined(CPU) && !defined(NO_SDATA) && !defined(ANIMATE)
+    // The data are copied to shared memory by chi2_gpu / chi2_gpu_rms if they fit there (on top of the kernel's static
+    // shared memory); otherwise the kernel reads them directly from device memory, so there is no limit on N_data:
+    {
+        int dev;
+        struct cudaDeviceProp deviceProp;
+        struct cudaFuncAttributes attr;
+        ERR(cudaGetDevice(&dev));
+        ERR(cudaGetDeviceProperties(&deviceProp, dev));
+        #ifdef RMSD
+        ERR(cudaFuncGetAttributes(&attr, chi2_gpu_rms));
+        #else
+        ERR(cudaFuncGetAttributes(&attr, chi2_gpu));
+        #endif
+        h_sdata_size = obs_size(N_data);
+        if (attr.sharedSizeBytes + h_sdata_size > deviceProp.sharedMemPerBlockOptin)
+        {
+            printf("Data (%d points, %ld bytes) don't fit into shared memory; using device memory\n", N_data, (long)h_sdata_size);
+            h_sdata_size = 0;
+        }
+        #ifdef RMSD
+        ERR(cudaFuncSetAttribute(chi2_gpu_rms, cudaFuncAttributeMaxDynamicSharedMemorySize, h_sdata_size));
+        #else
+        ERR(cudaFuncSetAttribute(chi2_gpu, cudaFuncAttributeMaxDynamicSharedMemorySize, h_sdata_size));
+        #endif
+        int sdata = h_sdata_size > 0;
+        ERR(cudaMemcpyToSymbol(d_sdata, &sdata, sizeof(int), 0, cudaMemcpyHostToDevice));
+    }
+#endif
 
 #ifdef RMSD
     ERR(cudaMalloc(&dpar_min, N_BLOCKS * N_PARAMS * sizeof(float)));
@@ -22,11 +54,31 @@ int gpu_prepare(int N_data, int N_filters, int N_threads, int Nplot)
     
     if (Nplot > 0)
     {
-        ERR(cudaMallocHost(&dPlot, Nplot * sizeof(struct obs_data)));    
-        ERR(cudaMemcpy(dPlot, hPlot, Nplot * sizeof(struct obs_data), cudaMemcpyHostToDevice));
+        obs_alloc(&dPlot, Nplot);
+        ERR(cudaMemcpy(dPlot->buf, hPlot->buf, obs_size(Nplot), cudaMemcpyHostToDevice));
 
         ERR(cudaMalloc(&d_dlsq2, N_data * sizeof(double)));    
         ERR(cudaMallocHost(&h_dlsq2, N_data * sizeof(double)));    
+        memset(h_dlsq2, 0, N_data * sizeof(double));
+
+        #if defined(DENSE_PLOT) && !defined(ANALYTIC)
+        // Nodes of the dense output integration of the plot curve (chi2_plot): one per PLOT_TIME_STEP over the plot time span,
+        // plus the starts and the last (rounded) steps of the segments
+        double t_min = hPlot->MJD[0];
+        double t_max = hPlot->MJD[0];
+        for (int i=1; i<Nplot; i++)
+        {
+            if (hPlot->MJD[i] < t_min)
+                t_min = hPlot->MJD[i];
+            if (hPlot->MJD[i] > t_max)
+                t_max = hPlot->MJD[i];
+        }
+        int N_nodes = (int)((t_max - t_min) / PLOT_TIME_STEP) + 4*N_SEG;
+        struct plot_node *nodes;
+        ERR(cudaMalloc(&nodes, N_nodes * sizeof(struct plot_node)));
+        ERR(cudaMemcpyToSymbol(d_plot_nodes, &nodes, sizeof(struct plot_node *), 0, cudaMemcpyHostToDevice));
+        ERR(cudaMemcpyToSymbol(d_plot_N_nodes, &N_nodes, sizeof(int), 0, cudaMemcpyHostToDevice));
+        #endif
     }
     
 #ifdef SEGMENT
@@ -54,3 +106,5 @@ int gpu_prepare(int N_data, int N_filters, int N_threads, int Nplot)
     
     return 0;
 }
+
+END_VARIANT
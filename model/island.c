@@ -0,0 +1,150 @@
+/* Island model (-island name switch): cooperation between several asteroid processes running on the same node.
+ *
+ * The processes ("islands") started with the same -island name share a POSIX shared memory segment (/dev/shm/asteroid_<name>)
+ * holding the ISLAND_ELITE best models found so far by all of them. After every cycle of the main loop, each island publishes
+ * its block results there, and every ISLAND_PERIOD cycles it takes the best models found by the other islands as "migrants":
+ * the first ISLAND_MIGRANTS blocks of the next kernel call reoptimize the migrants (d_migrants, d_N_migrants) instead of starting
+ * from random points. No network or server is involved; the segment is protected by a spin lock, and is left in /dev/shm after the
+ * run (so islands can be added later); remove it by hand (rm /dev/shm/asteroid_<name>) before starting an unrelated search.
+ */
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sched.h>
+#include "asteroid.h"
+
+BEGIN_VARIANT
+
+#ifndef RMSD
+
+struct island_elite {
+    double f;                  // chi2 of the model (1e30 for an empty slot)
+    int island;                // Island which found it
+    double params[N_PARAMS];
+};
+
+// The shared memory segment. A newly created segment is all zeros, which is a valid empty state.
+struct island_shm {
+    volatile int lock;         // Spin lock (0: free)
+    int N_params;              // N_PARAMS of the islands (0 until the first island attaches); all the islands must run the same model
+    int N_islands;             // Number of islands attached so far (the next island number)
+    int N_elite;               // Number of used slots in elite[]
+    struct island_elite elite[ISLAND_ELITE];  // Sorted by increasing f
+};
+
+static struct island_shm *island = NULL;
+static int island_id;
+
+
+static void island_lock()
+{
+    while (__sync_lock_test_and_set(&island->lock, 1))
+        sched_yield();
+    return;
+}
+
+
+static void island_unlock()
+{
+    __sync_lock_release(&island->lock);
+    return;
+}
+
+
+int island_open(char *name)
+// Attaching to the shared memory segment of the island group "name" (creating it if needed). Returns the island number.
+{
+    char shm_name[256];
+    snprintf(shm_name, sizeof(shm_name), "/asteroid_%s", name);
+    int fd = shm_open(shm_name, O_RDWR | O_CREAT, 0600);
+    if (fd < 0)
+    {
+        printf("Cannot open shared memory segment %s!\n", shm_name);
+        exit(1);
+    }
+    // All the islands set the same size, so it doesn't matter which one comes first:
+    if (ftruncate(fd, sizeof(struct island_shm)) != 0)
+    {
+        printf("Cannot resize shared memory segment %s!\n", shm_name);
+        exit(1);
+    }
+    island = (struct island_shm *)mmap(NULL, sizeof(struct island_shm), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (island == MAP_FAILED)
+    {
+        printf("Cannot map shared memory segment %s!\n", shm_name);
+        exit(1);
+    }
+
+    island_lock();
+    if (island->N_params == 0)
+        island->N_params = N_PARAMS;
+    int N_params = island->N_params;
+    island_id = island->N_islands++;
+    island_unlock();
+    if (N_params != N_PARAMS)
+    {
+        printf("Island group %s runs a different model (%d parameters instead of %d)!\n", name, N_params, N_PARAMS);
+        exit(1);
+    }
+    printf("Island %d of group %s\n", island_id, name);
+    return island_id;
+}
+
+
+int island_exchange(int loop_counter, CHI_FLOAT *h_f, double *h_params)
+// Publishing the block results (h_f, h_params of all N_BLOCKS blocks) in the shared elite set, and (every ISLAND_PERIOD cycles)
+// copying the best models of the other islands to d_migrants. Returns the number of migrants for the next kernel call.
+{
+    double migrants[ISLAND_MIGRANTS][N_PARAMS];
+    int N_migrants = 0;
+
+    island_lock();
+    for (int iblock=0; iblock<N_BLOCKS; iblock++)
+    {
+        double f = h_f[iblock];
+        if (!(f < 1e29))
+            continue;
+        if (island->N_elite == ISLAND_ELITE && f >= island->elite[ISLAND_ELITE-1].f)
+            continue;
+        // The same model can be published several times (d_f keeps the best result of each block between the cycles):
+        int dup = 0;
+        for (int k=0; k<island->N_elite; k++)
+            if (island->elite[k].island == island_id && island->elite[k].f == f)
+                dup = 1;
+        if (dup)
+            continue;
+        // Insertion into the sorted list (dropping the worst model if it is full):
+        int k = island->N_elite < ISLAND_ELITE? island->N_elite++ : ISLAND_ELITE-1;
+        while (k > 0 && island->elite[k-1].f > f)
+        {
+            island->elite[k] = island->elite[k-1];
+            k--;
+        }
+        island->elite[k].f = f;
+        island->elite[k].island = island_id;
+        for (int i=0; i<N_PARAMS; i++)
+            island->elite[k].params[i] = h_params[iblock*N_PARAMS + i];
+    }
+
+    if (loop_counter % ISLAND_PERIOD == 0)
+        // The best models found by the other islands:
+        for (int k=0; k<island->N_elite && N_migrants<ISLAND_MIGRANTS; k++)
+            if (island->elite[k].island != island_id)
+            {
+                for (int i=0; i<N_PARAMS; i++)
+                    migrants[N_migrants][i] = island->elite[k].params[i];
+                N_migrants++;
+            }
+    island_unlock();
+
+    if (N_migrants > 0)
+        ERR(cudaMemcpyToSymbol(d_migrants, migrants, N_migrants*N_PARAMS*sizeof(double), 0, cudaMemcpyHostToDevice));
+    ERR(cudaMemcpyToSymbol(d_N_migrants, &N_migrants, sizeof(int), 0, cudaMemcpyHostToDevice));
+    return N_migrants;
+}
+
+#endif // RMSD
+
+END_VARIANT
@@ -0,0 +1,449 @@
+/* Levenberg-Marquardt refinement of a model, for the CPU build (-lm switch).
+ *
+ * The chi2 of chi2one is a weighted least squares problem, with the residuals r_i = sqrt(w_i) * (V_i - Vmod_i - delta_V[m_i]),
+ * where the per-filter offsets delta_V are solved analytically (variable projection), so the residuals depend only on the model
+ * parameters. The refinement is done in the dimensionless x[] space of x2params (reoptimization mapping, reopt=1), over the
+ * non-frozen parameters. The residuals Jacobian is computed with forward finite differences, one column per parameter, in parallel
+ * (OpenMP). The covariance matrix of the physical parameters (scaled by the reduced chi2) is a by-product. Used instead of the long
+ * simplex reoptimization (-reopt -Nstages with ACC) to polish a model which is already in the right basin.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "asteroid.h"
+
+BEGIN_VARIANT
+
+#ifdef CPU
+
+// Device arrays, under the same names as the shared memory copies in the kernels:
+#define sLimits dLimits
+#define sProperty dProperty
+#define sTypes dTypes
+
+
+static int lm_residuals(double *xd, double *r, double *S, struct chi2_struct *sp, struct x2_struct *s_x2_params,
+                        double *Vmod, int N_data, int N_filters)
+// Weighted residuals r[] of the model xd[] (and their sum of squares S). Returns 1 if the model is invalid.
+{
+    CHI_FLOAT x[N_PARAMS];
+    double params[N_PARAMS];
+    CHI_FLOAT delta_V[N_FILTERS];
+    struct chi2_struct spk = *sp;
+
+    for (int i=0; i<N_PARAMS; i++)
+        x[i] = xd[i];
+    if (x2params(x, params, sLimits, s_x2_params, sProperty, sTypes))
+        return 1;
+    spk.Vmod = Vmod;
+    CHI_FLOAT f = chi2one(params, dData, N_data, N_filters, delta_V, 0, &spk, sTypes);
+    if (!(f < 1e30))
+        return 1;
+    *S = 0.0;
+    for (int i=0; i<N_data; i++)
+    {
+        r[i] = sqrt(dData->w[i]) * (dData->V[i] - Vmod[i] - delta_V[dData->Filter[i]]);
+        *S = *S + r[i]*r[i];
+    }
+    return !(*S < 1e300);
+}
+
+
+static int lm_hard(double *xd, int i, int right)
+// Whether the left (right=0) or the right (right=1) limit of x[i] is hard (the same rules as in x2params)
+{
+    int LAM = 0;
+    for (int j=0; j<N_PARAMS; j++)
+        if (sProperty[j][P_type] == T_Es)
+            LAM = xd[j]>=0.5;
+    int hard = right? HARD_RIGHT : HARD_LEFT;
+    return sProperty[i][P_periodic]==HARD_BOTH || sProperty[i][P_periodic]==hard || LAM==0 && sProperty[i][P_periodic]==PERIODIC_LAM;
+}
+
+
+static void lm_clamp(double *xd)
+// Projecting the point to the hard limits of x, so the models on the boundary can be refined
+{
+    for (int i=0; i<N_PARAMS; i++)
+    {
+        if (xd[i]<0.0 && lm_hard(xd, i, 0))
+            xd[i] = 0.0;
+        if (xd[i]>1.0 && lm_hard(xd, i, 1))
+            xd[i] = 1.0;
+    }
+    return;
+}
+
+
+static void lm_jacobian(double *xd, double *r, double *J, int *ifree, int n, struct chi2_struct *sp, struct x2_struct *s_x2_params,
+                        int N_data, int N_filters)
+// Jacobian of the residuals r[] (at xd[]) over the n free coordinates ifree[]; column k is J[k*N_data ...]. Forward differences
+// (backward ones next to a hard limit), all the columns in parallel.
+{
+    #pragma omp parallel for schedule(dynamic)
+    for (int k=0; k<n; k++)
+    {
+        double xk[N_PARAMS];
+        double Sk;
+        double *rk = (double *)malloc(N_data * sizeof(double));
+        double *Vmod = (double *)malloc(N_data * sizeof(double));
+        double h = LM_DX;
+        for (int i=0; i<N_PARAMS; i++)
+            xk[i] = xd[i];
+        xk[ifree[k]] = xd[ifree[k]] + h;
+        int bad = lm_residuals(xk, rk, &Sk, sp, s_x2_params, Vmod, N_data, N_filters);
+        if (bad)
+        {
+            h = -LM_DX;
+            xk[ifree[k]] = xd[ifree[k]] + h;
+            bad = lm_residuals(xk, rk, &Sk, sp, s_x2_params, Vmod, N_data, N_filters);
+        }
+        for (int i=0; i<N_data; i++)
+            // The parameter is kept fixed when the model is invalid on both sides:
+            J[k*N_data + i] = bad? 0.0 : (rk[i] - r[i]) / h;
+        free(rk);
+        free(Vmod);
+    }
+    return;
+}
+
+
+int cholesky(double *A, int n)
+// In place Cholesky decomposition of the symmetric n x n matrix A (lower triangle). Returns 1 if A is not positive definite.
+{
+    for (int j=0; j<n; j++)
+    {
+        double d = A[j*n+j];
+        for (int k=0; k<j; k++)
+            d = d - A[j*n+k]*A[j*n+k];
+        if (!(d > 0.0))
+            return 1;
+        A[j*n+j] = sqrt(d);
+        for (int i=j+1; i<n; i++)
+        {
+            double s = A[i*n+j];
+            for (int k=0; k<j; k++)
+                s = s - A[i*n+k]*A[j*n+k];
+            A[i*n+j] = s / A[j*n+j];
+        }
+    }
+    return 0;
+}
+
+
+void cholesky_solve(double *L, int n, double *b)
+// Solving L L^T y = b (L from cholesky), in place
+{
+    for (int i=0; i<n; i++)
+    {
+        for (int k=0; k<i; k++)
+            b[i] = b[i] - L[i*n+k]*b[k];
+        b[i] = b[i] / L[i*n+i];
+    }
+    for (int i=n-1; i>=0; i--)
+    {
+        for (int k=i+1; k<n; k++)
+            b[i] = b[i] - L[k*n+i]*b[k];
+        b[i] = b[i] / L[i*n+i];
+    }
+    return;
+}
+
+
+int lm_refine(double *params, int N_data, int N_filters, char *results_name, CHI_FLOAT *f_out, CHI_FLOAT *dV_out)
+// Levenberg-Marquardt refinement of the model params (-m). The refined model goes to the results file (same format as in the
+// optimization mode), and its covariance matrix (N_PARAMS lines of N_PARAMS values; zeros for the frozen parameters) to
+// results_name.cov. The parameter uncertainties are printed.
+// With results_name=NULL (Stage Three of -pipeline), nothing is printed or written: the refined model replaces params, and its
+// chi2 and delta_V go to *f_out, dV_out. Returns 1 if the model is invalid.
+{
+    struct chi2_struct sp;
+    struct x2_struct x2_params;
+    CHI_FLOAT x[N_PARAMS];
+    double xd[N_PARAMS], xt[N_PARAMS];
+    int ifree[N_PARAMS];
+    int i, j, k, n = 0;
+    double S, St;
+    long long int N_eval = 0;
+    int N_iter = 0;
+
+    init_chi2_struct(&sp);
+    init_x2_struct(&x2_params, 1);
+
+    for (i=0; i<N_PARAMS; i++)
+    {
+        if (sProperty[i][P_frozen] == -1)
+        {
+            printf("-lm: all the model parameters have to be given (no \"v\" values)\n");
+            exit(1);
+        }
+        if (sProperty[i][P_frozen] != 1)
+            ifree[n++] = i;
+    }
+
+    params2x(x, params, sLimits, sProperty, sTypes, &x2_params);
+    for (i=0; i<N_PARAMS; i++)
+        xd[i] = x[i];
+
+    double *r = (double *)malloc(N_data * sizeof(double));
+    double *rt = (double *)malloc(N_data * sizeof(double));
+    double *Vmod = (double *)malloc(N_data * sizeof(double));
+    double *J = (double *)malloc(n * N_data * sizeof(double));
+    double *A = (double *)malloc(n * n * sizeof(double));
+    double *B = (double *)malloc(n * n * sizeof(double));
+    double *g = (double *)malloc(n * sizeof(double));
+    double *dx = (double *)malloc(n * sizeof(double));
+    int *fixed = (int *)malloc(n * sizeof(int));
+
+    const int verbose = results_name != NULL;
+    if (lm_residuals(xd, r, &S, &sp, &x2_params, Vmod, N_data, N_filters))
+    {
+        if (!verbose)
+        {
+            free(r);  free(rt);  free(Vmod);  free(J);  free(A);  free(B);  free(g);  free(dx);  free(fixed);
+            return 1;
+        }
+        printf("-lm: the input model is invalid\n");
+        exit(1);
+    }
+    N_eval++;
+    const double dof = N_data - N_PARAMS - N_filters;
+
+    if (verbose)
+    {
+        printf("\n*** Levenberg-Marquardt refinement ***\n\n");
+        printf("  N_free = %d\n\n", n);
+        printf("%4d %13.6e\n", 0, S/dof);
+    }
+
+    double lambda = LM_LAMBDA0;
+    for (int iter=1; iter<=LM_ITER_MAX; iter++)
+    {
+        lm_jacobian(xd, r, J, ifree, n, &sp, &x2_params, N_data, N_filters);
+        N_eval += n;
+
+        // Normal equations: A = J^T J, g = J^T r
+        for (k=0; k<n; k++)
+        {
+            g[k] = 0.0;
+            for (i=0; i<N_data; i++)
+                g[k] = g[k] + J[k*N_data+i]*r[i];
+            for (j=0; j<=k; j++)
+            {
+                double s = 0.0;
+                for (i=0; i<N_data; i++)
+                    s = s + J[k*N_data+i]*J[j*N_data+i];
+                A[k*n+j] = s;
+                A[j*n+k] = s;
+            }
+        }
+
+        // The parameters sitting on a hard limit, with the gradient pushing them outside, are kept fixed in this iteration:
+        for (k=0; k<n; k++)
+        {
+            i = ifree[k];
+            fixed[k] = xd[i]<=0.0 && g[k]>0.0 && lm_hard(xd, i, 0) || xd[i]>=1.0 && g[k]<0.0 && lm_hard(xd, i, 1);
+        }
+
+        // Increasing the damping until the step decreases the sum of squares:
+        int accepted = 0;
+        while (lambda < 1e16)
+        {
+            for (k=0; k<n; k++)
+                for (j=0; j<n; j++)
+                    B[k*n+j] = fixed[k] || fixed[j]? 0.0 : A[k*n+j];
+            for (k=0; k<n; k++)
+            {
+                B[k*n+k] = A[k*n+k] * (1.0+lambda);
+                if (B[k*n+k] == 0.0 || fixed[k])
+                    // (a parameter the residuals don't depend on, or a fixed one)
+                    B[k*n+k] = 1.0;
+                dx[k] = fixed[k]? 0.0 : -g[k];
+            }
+            if (cholesky(B, n) == 0)
+            {
+                cholesky_solve(B, n, dx);
+                for (i=0; i<N_PARAMS; i++)
+                    xt[i] = xd[i];
+                for (k=0; k<n; k++)
+                    xt[ifree[k]] = xd[ifree[k]] + dx[k];
+                N_eval++;
+                lm_clamp(xt);
+                if (lm_residuals(xt, rt, &St, &sp, &x2_params, Vmod, N_data, N_filters) == 0 && St < S)
+                {
+                    accepted = 1;
+                    break;
+                }
+            }
+            lambda = lambda * 10.0;
+        }
+        if (!accepted)
+            // No downhill step even for a tiny step size: converged
+            break;
+
+        N_iter++;
+        double dS = (S - St) / S;
+        for (i=0; i<N_PARAMS; i++)
+            xd[i] = xt[i];
+        double *tmp = r;
+        r = rt;
+        rt = tmp;
+        S = St;
+        lambda = lambda / 10.0;
+        if (lambda < 1e-15)
+            lambda = 1e-15;
+        if (verbose)
+        {
+            printf("%4d %13.6e  lambda=%.1e\n", N_iter, S/dof, lambda);
+            fflush(stdout);
+        }
+        if (dS < LM_TOL)
+            break;
+    }
+
+    // The final model:
+    double p[N_PARAMS];
+    CHI_FLOAT delta_V[N_FILTERS];
+    for (i=0; i<N_PARAMS; i++)
+        x[i] = xd[i];
+    x2params(x, p, sLimits, &x2_params, sProperty, sTypes);
+    CHI_FLOAT f = chi2one(p, dData, N_data, N_filters, delta_V, 0, &sp, sTypes);
+
+    if (!verbose)
+    {
+        for (i=0; i<N_PARAMS; i++)
+            params[i] = p[i];
+        *f_out = f;
+        for (int m=0; m<N_filters; m++)
+            dV_out[m] = delta_V[m];
+        free(r);  free(rt);  free(Vmod);  free(J);  free(A);  free(B);  free(g);  free(dx);  free(fixed);
+        return 0;
+    }
+
+    // Covariance matrix in x space (at the final model), C_x = s2 * (J^T J)^-1, s2 being the reduced chi2:
+    lm_jacobian(xd, r, J, ifree, n, &sp, &x2_params, N_data, N_filters);
+    N_eval += n;
+    for (k=0; k<n; k++)
+        for (j=0; j<=k; j++)
+        {
+            double s = 0.0;
+            for (i=0; i<N_data; i++)
+                s = s + J[k*N_data+i]*J[j*N_data+i];
+            A[k*n+j] = s;
+        }
+    double *Cx = (double *)malloc(n * n * sizeof(double));
+    int singular = cholesky(A, n);
+    for (k=0; k<n; k++)
+    {
+        for (j=0; j<n; j++)
+            g[j] = j==k? 1.0 : 0.0;
+        if (!singular)
+            cholesky_solve(A, n, g);
+        for (j=0; j<n; j++)
+            Cx[j*n+k] = singular? 0.0 : g[j] * S/dof;
+    }
+
+    // Conversion to the physical parameters, C_p = P C_x P^T, with P = dparams/dx (central differences):
+    double (*P)[N_PARAMS] = (double (*)[N_PARAMS])malloc(n * N_PARAMS * sizeof(double));
+    for (k=0; k<n; k++)
+    {
+        double p1[N_PARAMS], p2[N_PARAMS];
+        CHI_FLOAT x1[N_PARAMS], x2[N_PARAMS];
+        double h1 = LM_DX, h2 = LM_DX;
+        for (i=0; i<N_PARAMS; i++)
+        {
+            x1[i] = xd[i];
+            x2[i] = xd[i];
+        }
+        x1[ifree[k]] = xd[ifree[k]] - h1;
+        x2[ifree[k]] = xd[ifree[k]] + h2;
+        if (x2params(x1, p1, sLimits, &x2_params, sProperty, sTypes))
+        {
+            h1 = 0.0;
+            for (i=0; i<N_PARAMS; i++)
+                p1[i] = p[i];
+        }
+        if (x2params(x2, p2, sLimits, &x2_params, sProperty, sTypes))
+        {
+            h2 = 0.0;
+            for (i=0; i<N_PARAMS; i++)
+                p2[i] = p[i];
+        }
+        for (i=0; i<N_PARAMS; i++)
+        {
+            P[k][i] = h1+h2 > 0.0? (p2[i] - p1[i]) / (h1 + h2) : 0.0;
+            #ifdef MY_L
+            if (sProperty[i][P_type] == T_L)
+                P[k][i] = -48.0*PI/(p[i]*p[i]) * P[k][i];
+            #endif
+        }
+    }
+    double (*Cp)[N_PARAMS] = (double (*)[N_PARAMS])malloc(N_PARAMS * N_PARAMS * sizeof(double));
+    for (i=0; i<N_PARAMS; i++)
+        for (j=0; j<N_PARAMS; j++)
+        {
+            double s = 0.0;
+            for (k=0; k<n; k++)
+                for (int l=0; l<n; l++)
+                    s = s + P[k][i] * Cx[k*n+l] * P[l][j];
+            Cp[i][j] = s;
+        }
+
+    // Bringing periodic parameters to the canonic range of values (as in the optimization mode), and printing:
+    double iii;
+    for (j=0; j<N_PARAMS; j++)
+    {
+        if (sProperty[j][P_periodic] == PERIODIC || sProperty[j][P_type] == T_psi_0)
+            p[j] = 2*PI * modf(p[j]/(2*PI), &iii);
+        #ifdef MY_L
+        if (sProperty[j][P_type] == T_L)
+            p[j] = 48*PI/p[j];
+        #endif
+    }
+    printf("\n%d iterations, %lld chi2 evaluations%s\n\n", N_iter, N_eval, singular? "; singular Jacobian, no covariance" : "");
+    printf("%13.6e ", f);
+    for (j=0; j<N_PARAMS; j++)
+        printf("%15.11f ", p[j]);
+    printf("\n%13s ", "+-");
+    for (j=0; j<N_PARAMS; j++)
+        printf("%15.11f ", sqrt(Cp[j][j]));
+    printf("\n");
+
+    FILE *fp = fopen(results_name, "w");
+    fprintf(fp, "%13.6e ", f);
+    for (int m=0; m<N_filters; m++)
+        fprintf(fp, "%13.6e ", delta_V[m]);
+    for (j=0; j<N_PARAMS; j++)
+        fprintf(fp, "%15.11f ", p[j]);
+    fprintf(fp, "\n");
+    fclose(fp);
+
+    char cov_name[strlen(results_name)+5];
+    sprintf(cov_name, "%s.cov", results_name);
+    fp = fopen(cov_name, "w");
+    for (i=0; i<N_PARAMS; i++)
+    {
+        for (j=0; j<N_PARAMS; j++)
+            fprintf(fp, "%16.9e ", Cp[i][j]);
+        fprintf(fp, "\n");
+    }
+    fclose(fp);
+
+    free(r);
+    free(rt);
+    free(Vmod);
+    free(J);
+    free(A);
+    free(B);
+    free(g);
+    free(dx);
+    free(fixed);
+    free(Cx);
+    free(P);
+    free(Cp);
+    return 0;
+}
+
+#endif // CPU
+
+END_VARIANT
@@ -3,6 +3,8 @@
  */
 #include "asteroid.h"
 
+BEGIN_VARIANT
+
 // Used with qsort:
 int cmpdouble (const void * a, const void * b) {
     if (*(double*)a > *(double*)b)
@@ -17,24 +19,6 @@ int cmpdouble (const void * a, const void * b) {
 //}
 
 
-int quadratic_interpolation(double MJD, OBS_TYPE *E_x1, OBS_TYPE *E_y1, OBS_TYPE *E_z1, OBS_TYPE *S_x1, OBS_TYPE *S_y1, OBS_TYPE *S_z1)
-{
-    double rr[3];
-    
-    rr[0] = (MJD-MJD0[1]) * (MJD-MJD0[2]) / (MJD0[0]-MJD0[1]) / (MJD0[0]-MJD0[2]);
-    rr[1] = (MJD-MJD0[0]) * (MJD-MJD0[2]) / (MJD0[1]-MJD0[0]) / (MJD0[1]-MJD0[2]);
-    rr[2] = (MJD-MJD0[0]) * (MJD-MJD0[1]) / (MJD0[2]-MJD0[0]) / (MJD0[2]-MJD0[1]);
-    *E_x1 = E_x0[0]*rr[0] + E_x0[1]*rr[1] + E_x0[2]*rr[2];
-    *E_y1 = E_y0[0]*rr[0] + E_y0[1]*rr[1] + E_y0[2]*rr[2];
-    *E_z1 = E_z0[0]*rr[0] + E_z0[1]*rr[1] + E_z0[2]*rr[2];
-    *S_x1 = S_x0[0]*rr[0] + S_x0[1]*rr[1] + S_x0[2]*rr[2];
-    *S_y1 = S_y0[0]*rr[0] + S_y0[1]*rr[1] + S_y0[2]*rr[2];
-    *S_z1 = S_z0[0]*rr[0] + S_z0[1]*rr[1] + S_z0[2]*rr[2];
-    
-    return 0;   
-}
-
-
 int timeval_subtract (double *result, struct timeval *x, struct timeval *y)
 {
     struct timeval result0;
@@ -62,8 +46,33 @@ int timeval_subtract (double *result, struct timeval *x, struct timeval *y)
 }
 
 
-int minima(struct obs_data * dPlot, double * Vm, int Nplot)
-// Finding minima and computing periodogramm
+static int minima_search(double *dt, int M, int j0, double dt1, int n, double w, int upper)
+// The first of the sorted time intervals dt[j0 ... M-1] with dt/dt1 > n-w (upper=0), or dt/dt1 >= n+w (upper=1)
+{
+    // Bisection on the threshold interval (no divisions), then the exact test near the boundary:
+    double thr = (upper? n + w : n - w) * dt1;
+    int j1 = M;
+    while (j0 < j1)
+    {
+        int j = (j0 + j1) / 2;
+        if (dt[j] >= thr)
+            j1 = j;
+        else
+            j0 = j + 1;
+    }
+    #define MINIMA_IN(j) (upper? dt[j]/dt1 - n >= w : n - dt[j]/dt1 < w)
+    while (j0 > 0 && MINIMA_IN(j0-1))
+        j0--;
+    while (j0 < M && !MINIMA_IN(j0))
+        j0++;
+    #undef MINIMA_IN
+    return j0;
+}
+
+
+int minima(struct obs_data * dPlot, double * Vm, int Nplot, double * cl_fr, double * cl_H)
+// Finding minima and computing periodogramm; the frequencies and heights of the NCL_MAX top clusters go to cl_fr[], cl_H[]
+// (cl_fr=-1 for the clusters not found). Re-entrant: only uses its arguments and local arrays.
 {
     
     // Maximum number of minima:    
@@ -85,12 +94,12 @@ int minima(struct obs_data * dPlot, double * Vm, int Nplot)
             }
 #ifdef PARABOLIC_MAX
             //Fitting a parabola to the three points (i-1), i, (i+1)
-            double a = ((Vm[i+1]-Vm[i])/(dPlot[i+1].MJD-dPlot[i].MJD) - (Vm[i]-Vm[i-1])/(dPlot[i].MJD-dPlot[i-1].MJD)) / (dPlot[i+1].MJD-dPlot[i-1].MJD);
-            double b = (Vm[i]-Vm[i-1])/(dPlot[i].MJD-dPlot[i-1].MJD) - a*(dPlot[i].MJD+dPlot[i-1].MJD);
+            double a = ((Vm[i+1]-Vm[i])/(dPlot->MJD[i+1]-dPlot->MJD[i]) - (Vm[i]-Vm[i-1])/(dPlot->MJD[i]-dPlot->MJD[i-1])) / (dPlot->MJD[i+1]-dPlot->MJD[i-1]);
+            double b = (Vm[i]-Vm[i-1])/(dPlot->MJD[i]-dPlot->MJD[i-1]) - a*(dPlot->MJD[i]+dPlot->MJD[i-1]);
             // Maximum point for the parabola:
             t[N-1] = -b/2.0/a;
 #else
-            t[N-1] = dPlot[i].MJD;
+            t[N-1] = dPlot->MJD[i];
 #endif            
         }
     }
@@ -139,38 +148,50 @@ int minima(struct obs_data * dPlot, double * Vm, int Nplot)
     double * H = (double*)malloc(NN*sizeof(double));
     int * marked = (int*)malloc(NN*sizeof(int));
         
-    double m = 0.0;
+#ifdef MINIMA_SPLINE
+    double w = 2.0*sgm;
+#else
+    double w = sgm;
+#endif
+    #pragma omp parallel for schedule(dynamic,64)
     for (int i=0; i<NN; i++) 
     {
         fr[i] = fr2 + (double)i/(double)(NN-1) * (fr0-fr2);
         H[i] = 0.0;
         double dt1 = 1/fr[i];
-        for (int j=0; j<M; j++)
+        // Only the intervals within w*dt1 from a multiple of dt1 contribute; as dt[] is sorted, they are found by binary search:
+        int j2 = 0;
+        for (int n=0; M>0 && n - dt[M-1]/dt1 < w; n++)
         {
-            double dv=fabs(dt[j]/dt1-int(dt[j]/dt1+0.5));
+            int j1 = minima_search(dt, M, j2, dt1, n, w, 0);
+            j2 = minima_search(dt, M, j1, dt1, n, w, 1);
 #ifdef MINIMA_SPLINE
-            // Using M4 B-spline function instead of step function
-            double q = dv / sgm;
-            double H1;
-            double q1 = 1.0 - q;
-            double q2 = 2.0 - q;
-            if (q <= 1.0)
-                H1 = 0.25*q2*q2*q2 - q1*q1*q1;
-            else if (q <= 2.0)
-                H1 = 0.25*q2*q2*q2;
-            else
-                H1 = 0.0;
-            H[i] = H[i] + H1;
-#else            
-            if (dv < sgm)
-                // Current time interval is within fractional sgm from the histogram bin value, 1/fr[i], so we are counting it as good
+            for (int j=j1; j<j2; j++)
             {
-                H[i] = H[i] + 1.0;
-            }        
+                double dv=fabs(dt[j]/dt1-int(dt[j]/dt1+0.5));
+                // Using M4 B-spline function instead of step function
+                double q = dv / sgm;
+                double H1;
+                double q1 = 1.0 - q;
+                double q2 = 2.0 - q;
+                if (q <= 1.0)
+                    H1 = 0.25*q2*q2*q2 - q1*q1*q1;
+                else if (q <= 2.0)
+                    H1 = 0.25*q2*q2*q2;
+                else
+                    H1 = 0.0;
+                H[i] = H[i] + H1;
+            }
+#else            
+            // The time intervals j1 ... j2-1 are within fractional sgm from the histogram bin value (times n), 1/fr[i], so we are
+            // counting them as good
+            H[i] = H[i] + (double)(j2 - j1);
 #endif            
         }
-        m = m + H[i];
     }
+    double m = 0.0;
+    for (int i=0; i<NN; i++) 
+        m = m + H[i];
     
     // The histogram has been computed - H(fr)
     
@@ -216,6 +237,7 @@ int minima(struct obs_data * dPlot, double * Vm, int Nplot)
         double max = -100;
         int imax = -1;
         cl_fr[j] = -1.0;
+        cl_H[j] = 0.0;
         
         // Serching for the current unmarked maximum value:
         for (int i=0; i<NN; i++) 
@@ -276,6 +298,54 @@ int minima(struct obs_data * dPlot, double * Vm, int Nplot)
 }
 
 
+double lsq_distance(struct obs_data * hData, double * dlsq2, int N_data)
+// The "lsq" figure of -plot: rms of the 2D distances dlsq2[] (chi2_plot) between the data points and the model curve, averaged
+// within six time intervals of the data (the two multi-featured ones have double weight)
+{
+    double d2[6], w[6];
+    int ind;
+    for (int i=0; i<6; i++)
+    {
+        d2[i] = 0.0;
+        w[i] = 0.0;
+    }
+    for (int i=0; i<N_data; i++)
+    {
+        if (hData->MJD[i] < 0.5)
+            ind = 0;
+        else if (hData->MJD[i] < 1.5)
+            ind = 1;
+        else if (hData->MJD[i] < 2.7)
+            ind = 2;
+        else if (hData->MJD[i] < 3.7)
+            ind = 3;
+        else if (hData->MJD[i] < 4.5)
+            ind = 4;
+        else
+            ind = 5;                                
+        d2[ind] = d2[ind] + dlsq2[i];
+        w[ind] = w[ind] + 1;
+    }
+    double sum = 0.0;
+    double W;
+    double SW = 0.0;
+    for (int i=0; i<6; i++)
+    {
+        // (Intervals without data are skipped)
+        if (w[i] == 0.0)
+            continue;
+        if (i == 2 || i == 3)
+            // Giving extra weight to multi-featured regions 2 and 3:
+            W = 2;
+        else
+            W = 1;
+        sum = sum + W*d2[i]/w[i];
+        SW = SW + W;
+    }
+    return sqrt(sum/SW);
+}
+
+
 #ifdef NUDGE
 int prepare_chi2_params(int * N_data)
 {
@@ -291,7 +361,7 @@ int prepare_chi2_params(int * N_data)
         // The brightness minima times and magnitudes, in converted coordinates (the ones used to compute chi2)
         sscanf(line, "%f %f", &t_obs, &V_obs);
         const double small=0.05;
-        if (t_obs >= hMJD0-small && t_obs <= hData[*N_data-1].MJD+hMJD0+small)
+        if (t_obs >= hMJD0-small && t_obs <= hData->MJD[*N_data-1]+hMJD0+small)
             // Only keeping the minima which are within the observed range
         {
             i++;
@@ -458,3 +528,5 @@ int write_PNGs(unsigned char * h_rgb, int i1, int i2)
     
 }
 #endif
+
+END_VARIANT
@@ -0,0 +1,204 @@
+/* In-process multi-stage pipeline (-pipeline N1 K N2 switch): Stage One -> Stage Two -> Stage Three in one run.
+ *
+ * Stage One is the usual random search (N1 cycles of the main loop). All the block results go to an archive of the PIPE_ELITE best
+ * models, kept diverse: a new model closer than PIPE_DIVERSITY (the rms of the parameter differences, in units of the parameter
+ * ranges; periodic angles modulo 2*pi) to an archived one only replaces it if it is better. Stage Two reoptimizes the K best archive
+ * models for N2 cycles, in parallel: block b works on model b%K (through the migrants mechanism of the island model, d_migrants),
+ * and every model moves to the best point found by its blocks (as with -reopt -t). Stage Three (CPU build) polishes the K models
+ * with the Levenberg-Marquardt refinement of lm.c. The data are read once, and nothing goes through the results files between
+ * the stages.
+ */
+#include <math.h>
+#include "asteroid.h"
+
+BEGIN_VARIANT
+
+#ifndef RMSD
+
+static int pipe_K = 0;                       // Number of models in Stage Two/Three
+static int pipe_N = 0;                       // Number of models in the archive
+static CHI_FLOAT pipe_f[PIPE_ELITE];         // Archive (Stage One; sorted by increasing f), and then the K models of Stage Two/Three
+static double pipe_params[PIPE_ELITE][N_PARAMS];
+static double pipe_dV[PIPE_ELITE][N_FILTERS];
+// Scales of the parameters for the distance between two models:
+static double pipe_scale[N_PARAMS];
+static int pipe_periodic[N_PARAMS];
+
+
+int pipeline_init(int K, CHI_FLOAT hLimits[][N_TYPES], int Property[][N_COLUMNS])
+// Setting up the pipeline with K models in Stage Two (the parameter ranges are the optimization limits)
+{
+    pipe_K = K;
+    pipe_N = 0;
+    for (int j=0; j<N_PARAMS; j++)
+    {
+        int type = Property[j][P_type];
+        pipe_periodic[j] = Property[j][P_periodic] == PERIODIC || type == T_psi_0;
+        pipe_scale[j] = pipe_periodic[j]? 2*PI : fabs(hLimits[1][type] - hLimits[0][type]);
+        if (pipe_scale[j] == 0.0)
+            pipe_scale[j] = 1.0;
+    }
+    return 0;
+}
+
+
+static double pipeline_distance(double *p1, double *p2)
+// Scaled rms distance between two models
+{
+    double d2 = 0.0;
+    for (int j=0; j<N_PARAMS; j++)
+    {
+        double d = p1[j] - p2[j];
+        if (pipe_periodic[j])
+            d = d - 2*PI * floor(d/(2*PI) + 0.5);
+        d = d / pipe_scale[j];
+        d2 = d2 + d*d;
+    }
+    return sqrt(d2 / N_PARAMS);
+}
+
+
+static void pipeline_copy(int to, int from)
+// Moving archive entry "from" to "to"
+{
+    pipe_f[to] = pipe_f[from];
+    for (int j=0; j<N_PARAMS; j++)
+        pipe_params[to][j] = pipe_params[from][j];
+    for (int m=0; m<N_FILTERS; m++)
+        pipe_dV[to][m] = pipe_dV[from][m];
+}
+
+
+int pipeline_archive(CHI_FLOAT *h_f, double *h_params, double *h_dV)
+// Stage One: adding the block results of a cycle to the archive
+{
+    for (int i=0; i<N_BLOCKS; i++)
+    {
+        if (!(h_f[i] < 1e29))
+            continue;
+        double *p = &h_params[i*N_PARAMS];
+        // A similar archived model is replaced if the new one is better:
+        int k;
+        for (k=0; k<pipe_N; k++)
+            if (pipeline_distance(p, pipe_params[k]) < PIPE_DIVERSITY)
+                break;
+        if (k < pipe_N)
+        {
+            if (h_f[i] >= pipe_f[k])
+                continue;
+            for (; k<pipe_N-1; k++)
+                pipeline_copy(k, k+1);
+            pipe_N--;
+        }
+        // A full archive loses its worst model:
+        if (pipe_N == PIPE_ELITE)
+        {
+            if (h_f[i] >= pipe_f[PIPE_ELITE-1])
+                continue;
+            pipe_N--;
+        }
+        // Inserting the model at its place in the sorted archive:
+        for (k=pipe_N; k>0 && pipe_f[k-1] > h_f[i]; k--)
+            pipeline_copy(k, k-1);
+        pipe_f[k] = h_f[i];
+        for (int j=0; j<N_PARAMS; j++)
+            pipe_params[k][j] = p[j];
+        for (int m=0; m<N_FILTERS; m++)
+            pipe_dV[k][m] = h_dV[i*N_FILTERS + m];
+        pipe_N++;
+    }
+    return 0;
+}
+
+
+static void pipeline_migrants()
+// Block b of the next kernel call reoptimizes model b%K
+{
+    double migrants[N_BLOCKS][N_PARAMS];
+    for (int b=0; b<N_BLOCKS; b++)
+        for (int j=0; j<N_PARAMS; j++)
+            migrants[b][j] = pipe_params[b % pipe_K][j];
+    int N_migrants = N_BLOCKS;
+    ERR(cudaMemcpyToSymbol(d_migrants, migrants, N_BLOCKS*N_PARAMS*sizeof(double), 0, cudaMemcpyHostToDevice));
+    ERR(cudaMemcpyToSymbol(d_N_migrants, &N_migrants, sizeof(int), 0, cudaMemcpyHostToDevice));
+}
+
+
+int pipeline_start()
+// The end of Stage One: taking the K best (diverse) archive models to Stage Two. Returns K.
+{
+    if (pipe_N == 0)
+    {
+        printf("-pipeline: Stage One found no valid models!\n");
+        exit(1);
+    }
+    if (pipe_K > pipe_N)
+        pipe_K = pipe_N;
+    pipeline_migrants();
+    return pipe_K;
+}
+
+
+int pipeline_update(CHI_FLOAT *h_f, double *h_params, double *h_dV)
+// Stage Two: every model moves to the best point found by its blocks in this cycle (if it is better)
+{
+    for (int b=0; b<N_BLOCKS; b++)
+    {
+        int k = b % pipe_K;
+        if (h_f[b] < pipe_f[k])
+        {
+            pipe_f[k] = h_f[b];
+            for (int j=0; j<N_PARAMS; j++)
+                pipe_params[k][j] = h_params[b*N_PARAMS + j];
+            for (int m=0; m<N_FILTERS; m++)
+                pipe_dV[k][m] = h_dV[b*N_FILTERS + m];
+        }
+    }
+    pipeline_migrants();
+    return 0;
+}
+
+
+#ifdef CPU
+int pipeline_polish(int N_data, int N_filters)
+// Stage Three: Levenberg-Marquardt refinement of the K models
+{
+    printf("\n*** Pipeline Stage Three: polishing %d models ***\n\n", pipe_K);
+    for (int k=0; k<pipe_K; k++)
+    {
+        double p[N_PARAMS];
+        CHI_FLOAT f, dV[N_FILTERS];
+        for (int j=0; j<N_PARAMS; j++)
+            p[j] = pipe_params[k][j];
+        if (lm_refine(p, N_data, N_filters, NULL, &f, dV) == 0 && f < pipe_f[k])
+        {
+            printf("  model %d: %13.6e -> %13.6e\n", k+1, pipe_f[k], f);
+            pipe_f[k] = f;
+            for (int j=0; j<N_PARAMS; j++)
+                pipe_params[k][j] = p[j];
+            for (int m=0; m<N_filters; m++)
+                pipe_dV[k][m] = dV[m];
+        }
+    }
+    return 0;
+}
+#endif
+
+
+int pipeline_results(CHI_FLOAT *h_f, double *h_params, double *h_dV)
+// Copying the K current models to the result arrays of the main loop. Returns K.
+{
+    for (int k=0; k<pipe_K; k++)
+    {
+        h_f[k] = pipe_f[k];
+        for (int j=0; j<N_PARAMS; j++)
+            h_params[k*N_PARAMS + j] = pipe_params[k][j];
+        for (int m=0; m<N_FILTERS; m++)
+            h_dV[k*N_FILTERS + m] = pipe_dV[k][m];
+    }
+    return pipe_K;
+}
+
+#endif // RMSD
+
+END_VARIANT
@@ -0,0 +1,116 @@
+/* Low-discrepancy starting points for the random search (-start halton switch).
+ *
+ * By default the starting point of every simplex run (and every point of the initial DE population) is drawn with curand_uniform,
+ * independently in each thread, so the coverage of the N_PARAMS-dimensional unit cube is clumpy. With -start halton the
+ * full-range coordinates of the starting points come from a scrambled Halton sequence instead: coordinate i of point n is the
+ * radical inverse of n in base prime(i), with the digits passed through a random permutation of 0..prime(i)-1 (one permutation per
+ * dimension; this removes the strong correlations between the high dimensions of the plain Halton sequence). Every work item
+ * gets its own point index: d_qmc_base + the work item index, with d_qmc_base advanced by the number of starting points per kernel
+ * call (qmc_cycle), so no two starts of a run are the same. The island model runs (-island) share one scrambled sequence (the
+ * permutations are derived from the island group name), and every island uses its own range of QMC_ISLAND_STRIDE indexes.
+ * The coordinates which start near the input model in the reoptimization mode, the initial simplex steps, and the restarts (P_BOTH)
+ * are still random.
+ */
+#include "asteroid.h"
+
+BEGIN_VARIANT
+
+static const int qmc_primes[QMC_MAX_DIM] = {
+      2,   3,   5,   7,  11,  13,  17,  19,  23,  29,  31,  37,  41,  43,  47,  53,
+     59,  61,  67,  71,  73,  79,  83,  89,  97, 101, 103, 107, 109, 113, 127, 131,
+    137, 139, 149, 151, 157, 163, 167, 173, 179, 181, 191, 193, 197, 199, 211, 223,
+    227, 229, 233, 239, 241, 251, 257, 263, 269, 271, 277, 281, 283, 293, 307, 311};
+
+// Index of the first point of the island, and the number of starting points used by one kernel call:
+static long long qmc_offset = 0;
+static long long qmc_per_cycle = 0;
+
+
+static unsigned long long qmc_random(unsigned long long *state)
+// splitmix64 (host only; used to generate the permutations)
+{
+    unsigned long long z = (*state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+
+int qmc_init(int start, unsigned long seed, int island_id)
+// Setting up the starting point generator of the given type (START_RANDOM or START_HALTON). The scrambling permutations
+// are derived from seed; island_id > 0 selects the range of the point indexes of the island.
+{
+    int h_prime[N_PARAMS];
+    short h_perm[N_PARAMS][QMC_P_MAX];
+
+    ERR(cudaMemcpyToSymbol(d_qmc, &start, sizeof(int), 0, cudaMemcpyHostToDevice));
+    if (start == START_RANDOM)
+        return 0;
+
+    if (N_PARAMS > QMC_MAX_DIM)
+    {
+        printf("-start halton supports at most %d parameters!\n", QMC_MAX_DIM);
+        exit(1);
+    }
+    unsigned long long state = seed;
+    for (int i=0; i<N_PARAMS; i++)
+    {
+        int p = qmc_primes[i];
+        h_prime[i] = p;
+        // Random permutation of the digits 0...p-1 (Fisher-Yates):
+        for (int d=0; d<p; d++)
+            h_perm[i][d] = d;
+        for (int d=p-1; d>0; d--)
+        {
+            int k = qmc_random(&state) % (d+1);
+            short t = h_perm[i][d];
+            h_perm[i][d] = h_perm[i][k];
+            h_perm[i][k] = t;
+        }
+    }
+    ERR(cudaMemcpyToSymbol(d_qmc_prime, h_prime, N_PARAMS*sizeof(int), 0, cudaMemcpyHostToDevice));
+    ERR(cudaMemcpyToSymbol(d_qmc_perm, h_perm, N_PARAMS*QMC_P_MAX*sizeof(short), 0, cudaMemcpyHostToDevice));
+
+    qmc_offset = island_id > 0? island_id * QMC_ISLAND_STRIDE : 0;
+    qmc_per_cycle = N_BLOCKS * BSIZE;
+    #ifdef CPU
+    if (h_optimizer == OPT_DE)
+        qmc_per_cycle = N_BLOCKS * DE_NP;
+    #endif
+    return 0;
+}
+
+
+int qmc_cycle(int loop_counter)
+// Setting the index of the first starting point of the kernel call number loop_counter (1, 2, ...)
+{
+    long long base = qmc_offset + (loop_counter-1) * qmc_per_cycle;
+    ERR(cudaMemcpyToSymbol(d_qmc_base, &base, sizeof(long long), 0, cudaMemcpyHostToDevice));
+    return 0;
+}
+
+
+__device__ long long qmc_index(int id)
+// The Halton point index of the work item id of the current kernel call, or -1 if the starts are random
+{
+    return d_qmc == START_HALTON? d_qmc_base + id : -1;
+}
+
+
+__device__ CHI_FLOAT qmc_x(long long n, int i)
+// Coordinate i (0...1) of the scrambled Halton point number n
+{
+    int p = d_qmc_prime[i];
+    double x = 0.0;
+    double scale = 1.0 / p;
+    // The digits beyond the last nonzero digit of n are zeros, but they are permuted too, so the sum runs until the float resolution:
+    while (scale > 1e-9)
+    {
+        x = x + d_qmc_perm[i][n % p] * scale;
+        n = n / p;
+        scale = scale / p;
+    }
+    return x;
+}
+
+END_VARIANT
@@ -1,27 +1,32 @@
 #include "asteroid.h"
 
+BEGIN_VARIANT
+
 /*  Reading input data files - ephemerides for asteroid, earth, sun, and the brightness curve data.  
 */
 
+static void obs_set_geometry(struct obs_data *data, int i, struct obs_data_h *hh)
+// Storing the Earth and Sun unit vectors for the i-th point (with INTERP they are computed in chi2one instead)
+{
+#ifndef INTERP
+data->E_x[i] = hh->E_x;
+data->E_y[i] = hh->E_y;
+data->E_z[i] = hh->E_z;
+data->S_x[i] = hh->S_x;
+data->S_y[i] = hh->S_y;
+data->S_z[i] = hh->S_z;
+#endif
+}
+
+
 int read_data(char *data_file, int *N_data, int *N_filters, int Nplot)
 {
  FILE *fp;
- FILE *fpA;
- FILE *fpE;
- FILE *fpS;
 // char filename[MAX_FILE_NAME];
  char line[MAX_LINE_LENGTH];
- char lineA[MAX_LINE_LENGTH];
- char lineE[MAX_LINE_LENGTH];
- char lineS[MAX_LINE_LENGTH];
- char ch;
- #ifdef INTERP
- struct obs_data_h *hhData = (obs_data_h *)malloc(MAX_DATA * sizeof(struct obs_data_h));
- struct obs_data_h *hhPlot = (obs_data_h *)malloc(Nplot * sizeof(struct obs_data_h));
- #else
- #define hhData hData
- #define hhPlot hPlot
- #endif    
+ // Earth and Sun vectors (before normalization):
+ struct obs_data_h *hhData;
+ struct obs_data_h *hhPlot;
 // int N;
   
  // Number of brightness data points:
@@ -31,27 +36,18 @@ int read_data(char *data_file, int *N_data, int *N_filters, int Nplot)
      printf("Input file %s does not exist!\n", data_file);
      exit(1);
  }
+ // (Counted with fgets, exactly as the lines are read below, so a last line without the end of line character is counted too)
  *N_data = 0;
- while(!feof(fp))
-{
-  ch = fgetc(fp);
-  if(ch == '\n')
-  {
+ while (fgets(line, sizeof(line), fp))
     *N_data = *N_data + 1;
-  }
-}
 fclose(fp);
 // Minus one header line: (???)
 //*N_data = *N_data - 1;
 
-if (*N_data > MAX_DATA)
-{
-    fprintf(stderr,"Error: N_data (%d) > MAX_DATA!\n", *N_data);
-    exit(1);
-}
-
  // Allocating the data arrays:
-ERR(cudaMallocHost(&hData, *N_data * sizeof(struct obs_data)));
+obs_alloc(&hData, *N_data);
+hhData = (obs_data_h *)malloc(*N_data * sizeof(struct obs_data_h));
+hhPlot = (obs_data_h *)malloc(Nplot * sizeof(struct obs_data_h));
 ERR(cudaMallocHost(&MJD_obs, *N_data * sizeof(double)));
 
 #ifdef DUMP_DV
@@ -83,8 +79,8 @@ while (fgets(line, sizeof(line), fp))
             printf("Error: the data have to be sorted chronologically!\n");
             exit(1);
         }
-        hData[i].V = V1;
-        hData[i].w = 1.0/(sgm*sgm);
+        hData->V[i] = V1;
+        hData->w[i] = 1.0/(sgm*sgm);
         // Finding all unique filters:
         int found = 1;
         for (k=0; k<j; k++)
@@ -110,7 +106,7 @@ while (fgets(line, sizeof(line), fp))
         for (k=0; k<j; k++)
         {
             if (filter == all_filters[k])
-                hData[i].Filter = k;
+                hData->Filter[i] = k;
         }
     }
 }
@@ -123,119 +119,20 @@ if (*N_filters > N_FILTERS)
 
 fclose(fp);
 
-// Reading the three ephemerides files and computing the data values:
-fpA = fopen("asteroid.eph", "r");
-fpE = fopen("earth.eph", "r");
-fpS = fopen("sun.eph", "r");
-// Pointing to the data portion in each file
-while (fgets(lineA, sizeof(lineA), fpA))
-{
-    if (strcmp(lineA, "$$SOE\n") == 0)
-        break;
-}
-while (fgets(lineE, sizeof(lineE), fpE))
+// Reading the three ephemerides files (ephem.c), and interpolating the Earth and Sun vectors to the observation times:
+ephem_read();
+for (i=0; i<*N_data; i++)
 {
-    if (strcmp(lineE, "$$SOE\n") == 0)
-        break;
-}
-while (fgets(lineS, sizeof(lineS), fpS))
-{
-    if (strcmp(lineS, "$$SOE\n") == 0)
-        break;
-}
-
-j = -1;
-double JD;
-double Xa,Ya,Za, Xe,Ye,Ze, Xs,Ys,Zs;
-double delay;
-int l = 0;
-int m;
-i = 0;
-while (fgets(lineA, sizeof(lineA), fpA))
-{
-    // The marking for the end of data:
-    if (strcmp(lineA, "$$EOE\n") == 0)
-        break;
-    j++;
-    fgets(lineE, sizeof(lineE), fpE);
-    fgets(lineS, sizeof(lineA), fpS);
-    if (j % 2 == 0)
-        // Even data lines contain JD
+    if (ephem_eval(MJD_obs[i], &(hhData[i].E_x), &(hhData[i].E_y), &(hhData[i].E_z), &(hhData[i].S_x), &(hhData[i].S_y), &(hhData[i].S_z)))
     {
-        sscanf(lineA, "%lf", &JD);
+        printf("Error: data point at MJD %f is outside of the ephemeris time range!\n", MJD_obs[i]);
+        exit(1);
     }
-    else
-        // Odd data lines contain X,Y,Z
-    {
-        if (l > 2)
-        {
-            // Shifting the arrays to the left by one
-            for (m=0; m<2; m++)
-            {
-                E_x0[m] = E_x0[m+1];
-                E_y0[m] = E_y0[m+1];
-                E_z0[m] = E_z0[m+1];
-                S_x0[m] = S_x0[m+1];
-                S_y0[m] = S_y0[m+1];
-                S_z0[m] = S_z0[m+1];
-                MJD0[m] = MJD0[m+1];
-            }
-            l = 2;
-        }
-        sscanf(lineA, "%lE %lE %lE", &Xa, &Ya, &Za);
-        sscanf(lineE, "%lE %lE %lE", &Xe, &Ye, &Ze);
-        sscanf(lineS, "%lE %lE %lE", &Xs, &Ys, &Zs);
-        // Asteroid -> Earth vector:
-        E_x0[l] = Xe - Xa;
-        E_y0[l] = Ye - Ya;
-        E_z0[l] = Ze - Za;
-        // Asteroid -> Sun vector:
-        S_x0[l] = Xs - Xa;
-        S_y0[l] = Ys - Ya;
-        S_z0[l] = Zs - Za;
-//printf("AA  %20.12lf %20.12lf\n",MJD0[0],E_x0[0]);
-        // Computing the delay (light time), in days:
-        delay = sqrt(E_x0[l]*E_x0[l] + E_y0[l]*E_y0[l]+ E_z0[l]*E_z0[l]) / light_speed;
-        // Corresponding earth observer time - wrong, as my data is normally light travel corrected!
-//        MJD0[l] = JD - 2400000.5 + delay;
-        // Light travel corrected:
-        MJD0[l] = JD - 2400000.5;
-        l++;
-        if (l > 2)
-        {
-            // Using "while" here as there may be more than one data point corresponding to the given MJD0 bracket:
-            //!!! [1]...[2]
-            while (i<*N_data && MJD_obs[i]>=MJD0[0] && MJD_obs[i]<MJD0[2])
-                // We just found the MJD0[1-2] interval bracketing the i-th data point
-            {
-                // Using the quadratic Lagrange polynomial to do second degree interpolation for E and S vector components
-//                double E_x1, E_y1, E_z1, S_x1, S_y1, S_z1;
-                quadratic_interpolation(MJD_obs[i], &(hhData[i].E_x), &(hhData[i].E_y), &(hhData[i].E_z), &(hhData[i].S_x), &(hhData[i].S_y), &(hhData[i].S_z));
-                //                quadratic_interpolation(MJD_obs[i], &E_x1, &E_y1, &E_z1, &S_x1, &S_y1, &S_z1);
-                /*
-                hhData[i].E_x = E_x1;
-                hhData[i].E_y = E_y1;
-                hhData[i].E_z = E_z1;
-                hhData[i].S_x = S_x1;
-                hhData[i].S_y = S_y1;
-                hhData[i].S_z = S_z1;
-                */
-//printf("%20.12lf %20.12lf %20.12lf %20.12lf %20.12lf %20.12lf %20.12lf\n", (*MJD)[i], (*E_x)[i],(*E_y)[i],(*E_z)[i],(*S_x)[i],(*S_y)[i],(*S_z)[i]);                
-                // Switching to the next data point:
-                i++;
-            }
-        }
-    }
-    if (i >= *N_data)
-        // No more data points; exiting
-        break;
 }
-fclose(fpA);
-fclose(fpE);
-fclose(fpS);
 
 // Converting the observed data
 double E, S;
+double delay;
 #ifdef SEGMENT
 int iseg = 0;
 #endif
@@ -256,24 +153,24 @@ for (i=0; i<*N_data; i++)
 
     // Convertimg visual magnitudes to absolute magnitudes (at 1 au from sun and earth):
     // W_filter data is skipped, but this does apply to all other filters, including D_filter
-    if (hData[i].Filter != W_filter)
-        hData[i].V = hData[i].V + 5.0*log10(1.0/E * 1.0/S);
+    if (hData->Filter[i] != W_filter)
+        hData->V[i] = hData->V[i] + 5.0*log10(1.0/E * 1.0/S);
 #ifdef DUMP_DV
     fprintf(fpdump, "%f\n", 5.0*log10(1.0/E * 1.0/S));
 #endif
     // Computing the delay (light time), in days:
     delay = E / light_speed;
-    hData[i].MJD = MJD_obs[i];
+    hData->MJD[i] = MJD_obs[i];
     // Converting to asteroidal time (minus light time):
     // Both W_filter and D_filter data is skipped
-    if (hData[i].Filter != W_filter && hData[i].Filter != D_filter)
-        hData[i].MJD = hData[i].MJD - delay;
+    if (hData->Filter[i] != W_filter && hData->Filter[i] != D_filter)
+        hData->MJD[i] = hData->MJD[i] - delay;
 #ifdef DUMP_RED_BLUE
-    fprintf(fpdump, "W %12.6lf %6.3f %5.3f r\n", hData[i].MJD, hData[i].V, 1.0/sqrt(hData[i].w));
+    fprintf(fpdump, "W %12.6lf %6.3f %5.3f r\n", hData->MJD[i], hData->V[i], 1.0/sqrt(hData->w[i]));
 #endif
     if (i == 0)
-        hMJD0 = hData[i].MJD;
-    hData[i].MJD = hData[i].MJD - hMJD0;
+        hMJD0 = hData->MJD[i];
+    hData->MJD[i] = hData->MJD[i] - hMJD0;
     // Making S,E a unit vector:
     hhData[i].E_x = hhData[i].E_x / E;
     hhData[i].E_y = hhData[i].E_y / E;
@@ -281,6 +178,7 @@ for (i=0; i<*N_data; i++)
     hhData[i].S_x = hhData[i].S_x / S;
     hhData[i].S_y = hhData[i].S_y / S;
     hhData[i].S_z = hhData[i].S_z / S;
+    obs_set_geometry(hData, i, &hhData[i]);
     
 }
 
@@ -302,22 +200,16 @@ for (i=0; i<*N_data; i++)
 #endif    
 
 // Computing a fake data set, only for plotting
-// Explicitely assuming that ephemeride files contain three data points each    
 #ifdef SEGMENT
     iseg = 0;
 #endif
 if (Nplot > 0)        
 {
-    ERR(cudaMallocHost(&hPlot, Nplot * sizeof(struct obs_data)));
+    obs_alloc(&hPlot, Nplot);
     // Time step for plotting:
-    double h = hData[*N_data-1].MJD / (Nplot - 1);
+    double h = hData->MJD[*N_data-1] / (Nplot - 1);
     double tplot;
     int iplot;
-    #ifndef INTERP
-    // Changing the ephemeride times:
-    for (l=0; l<3; l++)
-        MJD0[l] = MJD0[l] - hMJD0;
-    #endif    
     
     for (iplot=0; iplot<Nplot; iplot++)
     {
@@ -331,7 +223,7 @@ if (Nplot > 0)
                 i = 0;
             else
                 i = *N_data - 1;
-            hPlot[iplot].MJD = hData[i].MJD;
+            hPlot->MJD[iplot] = hData->MJD[i];
             hhPlot[iplot].E_x = hhData[i].E_x;
             hhPlot[iplot].E_y = hhData[i].E_y;
             hhPlot[iplot].E_z = hhData[i].E_z;
@@ -341,9 +233,9 @@ if (Nplot > 0)
         }
         else
         {
-            hPlot[iplot].MJD = tplot;
-            quadratic_interpolation(tplot, &(hhPlot[iplot].E_x), &(hhPlot[iplot].E_y), &(hhPlot[iplot].E_z), &(hhPlot[iplot].S_x), &(hhPlot[iplot].S_y), &(hhPlot[iplot].S_z));
-            hPlot[iplot].V = 0.0;            
+            hPlot->MJD[iplot] = tplot;
+            ephem_eval(tplot+hMJD0, &(hhPlot[iplot].E_x), &(hhPlot[iplot].E_y), &(hhPlot[iplot].E_z), &(hhPlot[iplot].S_x), &(hhPlot[iplot].S_y), &(hhPlot[iplot].S_z));
+            hPlot->V[iplot] = 0.0;            
 
             E = sqrt(hhPlot[iplot].E_x*hhPlot[iplot].E_x + hhPlot[iplot].E_y*hhPlot[iplot].E_y+ hhPlot[iplot].E_z*hhPlot[iplot].E_z);
             S = sqrt(hhPlot[iplot].S_x*hhPlot[iplot].S_x + hhPlot[iplot].S_y*hhPlot[iplot].S_y+ hhPlot[iplot].S_z*hhPlot[iplot].S_z);
@@ -354,9 +246,10 @@ if (Nplot > 0)
             hhPlot[iplot].S_y = hhPlot[iplot].S_y / S;
             hhPlot[iplot].S_z = hhPlot[iplot].S_z / S;
         }
+        obs_set_geometry(hPlot, iplot, &hhPlot[iplot]);
         
 #ifdef SEGMENT
-        if (iseg < N_SEG && hPlot[iplot].MJD+hMJD0 >= T_START[iseg])
+        if (iseg < N_SEG && hPlot->MJD[iplot]+hMJD0 >= T_START[iseg])
         // We found the start of the next data segment
         {        
             h_plot_start_seg[iseg] = iplot;
@@ -366,12 +259,59 @@ if (Nplot > 0)
         
     }
 
+    integration_schedule(hPlot, Nplot);
 }
 
-#ifdef INTERP
+h_sched_steps = integration_schedule(hData, *N_data);
+#ifdef SEGMENT
+// Each segment starts from its own initial conditions, so there is no integration across the segment boundaries:
+for (iseg=1; iseg<N_SEG; iseg++)
+{
+    h_sched_steps = h_sched_steps - hData->N_steps[h_start_seg[iseg]];
+    hData->N_steps[h_start_seg[iseg]] = 0;
+}
+#endif
+#ifdef DEBUG
+printf("RK4 steps per chi2 evaluation: %d\n", h_sched_steps);
+#endif
+
 free(hhData);
 free(hhPlot);
-#endif
+ephem_free();
     
 return 0;
 }
+
+
+int obs_alloc(struct obs_data **data, int N)
+// Allocating the obs_data structure and its (SoA) arrays for N data points
+{
+ERR(cudaMallocHost(data, sizeof(struct obs_data)));
+void *buf;
+ERR(cudaMallocHost(&buf, obs_size(N)));
+obs_carve(*data, buf, N);
+return 0;
+}
+
+
+int integration_schedule(struct obs_data *data, int N)
+/*  Precomputing the RK4 integration schedule (the number of time steps and the step size for each interval between
+    consecutive data points), used in chi2one for all models. The maximum step is TIME_STEP (asteroid.h).
+    Intervals going backwards in time (light time corrected W_filter points) are integrated backwards.
+    Returns the total number of steps.
+*/
+{
+int N_total = 0;
+data->N_steps[0] = 0;
+data->h[0] = 0.0;
+for (int i=1; i<N; i++)
+{
+    OBS_TYPE dt = data->MJD[i] - data->MJD[i-1];
+    data->N_steps[i] = fabs(dt) / TIME_STEP + 1;
+    data->h[i] = dt / data->N_steps[i];
+    N_total = N_total + data->N_steps[i];
+}
+return N_total;
+}
+
+END_VARIANT
@@ -0,0 +1,287 @@
+/* Asynchronous writing of the results file of the optimization runs.
+ *
+ * The main loop used to reopen the results file after every cycle and fprintf all the block results while the optimizer waits.
+ * Now the results are pushed into a lock-free single producer / single consumer queue (RESLOG_QUEUE results) and a writer thread
+ * formats and writes them, keeping the file open for the whole run; the main thread only waits if the writer falls behind by a
+ * whole queue. The file is flushed after every cycle, so it is as up to date as before. In the default mode (no -keep) the file
+ * is truncated at the start of every cycle, as before.
+ *
+ * With "-format binary", the results are written as fixed size binary records (no formatting at all): a header (struct
+ * reslog_header) followed by one record per model: cycle number, flags, chi2, N_filters delta_V values and N_PARAMS parameters,
+ * all but the first two as doubles. "-convert name -o name2" turns such a file into the usual text results file. The binary file
+ * is append-only: in the default mode every cycle is appended, and the converter only prints the last cycle.
+ */
+#include <pthread.h>
+#include <semaphore.h>
+#include <unistd.h>
+#include "asteroid.h"
+
+BEGIN_VARIANT
+
+#ifndef RMSD
+
+// Flags of a result:
+const int RESLOG_FIRST = 1;  // The first result of a cycle
+const int RESLOG_LAST = 2;   // The last result of a cycle
+
+struct reslog_result {
+    int cycle;
+    int flags;
+    double f;
+    double dV[N_FILTERS];
+    double params[N_PARAMS];
+};
+
+// Binary results file header:
+struct reslog_header {
+    char magic[8];
+    int N_params;
+    int N_filters;
+    int keep;                  // All cycles are kept (-keep), or only the last one is the current result
+    int reserved;
+};
+
+static const char RESLOG_MAGIC[8] = "ASTRES1";
+
+static struct reslog_result reslog_queue[RESLOG_QUEUE];
+// The number of results pushed by the main thread (head) and written by the writer thread (tail):
+static long long reslog_head = 0;
+static long long reslog_tail = 0;
+static sem_t reslog_ready;       // Posted when the writer has something to do
+static volatile int reslog_stop = 0;
+static pthread_t reslog_thread;
+static FILE *reslog_fp = NULL;
+static int reslog_format, reslog_keep, reslog_N_filters;
+
+
+static int reslog_record_size(int N_filters)
+// Size of one binary record in the file
+{
+    return 2*sizeof(int) + (1 + N_filters + N_PARAMS) * sizeof(double);
+}
+
+
+static void reslog_text(FILE *fp, struct reslog_result *r, int N_filters)
+// One results file line (the MY_L conversion is done by the caller)
+{
+    fprintf(fp,"%13.6e ",  r->f);
+    for (int m=0; m<N_filters; m++)
+        fprintf(fp,"%13.6e ",  r->dV[m]);
+    for (int j=0; j<N_PARAMS; j++)
+        fprintf(fp,"%15.11f ",  r->params[j]);
+    fprintf(fp,"\n");
+}
+
+
+static void reslog_binary(FILE *fp, struct reslog_result *r, int N_filters)
+{
+    fwrite(&r->cycle, sizeof(int), 1, fp);
+    fwrite(&r->flags, sizeof(int), 1, fp);
+    fwrite(&r->f, sizeof(double), 1, fp);
+    fwrite(r->dV, sizeof(double), N_filters, fp);
+    fwrite(r->params, sizeof(double), N_PARAMS, fp);
+}
+
+
+static void *reslog_writer(void *arg)
+// The writer thread
+{
+    while (1)
+    {
+        sem_wait(&reslog_ready);
+        long long head = __atomic_load_n(&reslog_head, __ATOMIC_ACQUIRE);
+        for (long long n=reslog_tail; n<head; n++)
+        {
+            struct reslog_result *r = &reslog_queue[n % RESLOG_QUEUE];
+            if ((r->flags & RESLOG_FIRST) && !reslog_keep && reslog_format == FORMAT_TEXT)
+            {
+                // In the default mode, the text file only has the current results:
+                fflush(reslog_fp);
+                if (ftruncate(fileno(reslog_fp), 0) != 0)
+                    printf("Cannot truncate the results file!\n");
+                rewind(reslog_fp);
+            }
+            if (reslog_format == FORMAT_TEXT)
+                reslog_text(reslog_fp, r, reslog_N_filters);
+            else
+                reslog_binary(reslog_fp, r, reslog_N_filters);
+            if (r->flags & RESLOG_LAST)
+                fflush(reslog_fp);
+            // The slot can be reused:
+            __atomic_store_n(&reslog_tail, n+1, __ATOMIC_RELEASE);
+        }
+        if (reslog_stop && __atomic_load_n(&reslog_head, __ATOMIC_ACQUIRE) == reslog_tail)
+            break;
+    }
+    return NULL;
+}
+
+
+int reslog_open(char *name, int format, int keep, int N_filters)
+// Opening the results file name and starting the writer thread
+{
+    reslog_format = format;
+    reslog_keep = keep;
+    reslog_N_filters = N_filters;
+    if (format == FORMAT_TEXT)
+        // (truncated by the writer at the first cycle in the default mode)
+        reslog_fp = fopen(name, "a");
+    else
+    {
+        struct reslog_header h;
+        memset(&h, 0, sizeof(h));
+        memcpy(h.magic, RESLOG_MAGIC, 8);
+        h.N_params = N_PARAMS;
+        h.N_filters = N_filters;
+        h.keep = keep;
+        reslog_fp = fopen(name, keep? "a+b" : "wb");
+        if (reslog_fp != NULL && keep)
+        {
+            // Appending to an existing binary file: it has to be for the same model and data
+            struct reslog_header h0;
+            if (fread(&h0, sizeof(h0), 1, reslog_fp) == 1)
+            {
+                if (memcmp(&h0, &h, sizeof(h)) != 0)
+                {
+                    printf("Binary results file %s was written by a different model variant or for different data!\n", name);
+                    exit(1);
+                }
+            }
+            else
+                fwrite(&h, sizeof(h), 1, reslog_fp);
+        }
+        else if (reslog_fp != NULL)
+            fwrite(&h, sizeof(h), 1, reslog_fp);
+    }
+    if (reslog_fp == NULL)
+    {
+        printf("Cannot open results file %s!\n", name);
+        exit(1);
+    }
+    setvbuf(reslog_fp, NULL, _IOFBF, 1<<20);
+    fflush(reslog_fp);
+
+    reslog_head = reslog_tail = 0;
+    reslog_stop = 0;
+    sem_init(&reslog_ready, 0, 0);
+    if (pthread_create(&reslog_thread, NULL, reslog_writer, NULL) != 0)
+    {
+        printf("Cannot start the results writer thread!\n");
+        exit(1);
+    }
+    return 0;
+}
+
+
+int reslog_write(int cycle, int first, int last, CHI_FLOAT f, double *dV, double *params)
+// Queueing one result of the cycle (first, last: the first and the last result of the cycle)
+{
+    long long head = reslog_head;
+    // Waiting for a free slot (only if the writer is a whole queue behind):
+    while (head - __atomic_load_n(&reslog_tail, __ATOMIC_ACQUIRE) >= RESLOG_QUEUE)
+    {
+        sem_post(&reslog_ready);
+        usleep(100);
+    }
+    struct reslog_result *r = &reslog_queue[head % RESLOG_QUEUE];
+    r->cycle = cycle;
+    r->flags = (first? RESLOG_FIRST : 0) | (last? RESLOG_LAST : 0);
+    r->f = f;
+    for (int m=0; m<reslog_N_filters; m++)
+        r->dV[m] = dV[m];
+    for (int j=0; j<N_PARAMS; j++)
+        r->params[j] = params[j];
+    __atomic_store_n(&reslog_head, head+1, __ATOMIC_RELEASE);
+    if (last)
+        sem_post(&reslog_ready);
+    return 0;
+}
+
+
+int reslog_sync()
+// Waiting until all the queued results are in the file (before a checkpoint)
+{
+    while (__atomic_load_n(&reslog_tail, __ATOMIC_ACQUIRE) != reslog_head)
+    {
+        sem_post(&reslog_ready);
+        usleep(100);
+    }
+    return 0;
+}
+
+
+int reslog_close()
+// Writing the remaining results, stopping the writer thread and closing the file
+{
+    if (reslog_fp == NULL)
+        return 0;
+    reslog_stop = 1;
+    sem_post(&reslog_ready);
+    pthread_join(reslog_thread, NULL);
+    fclose(reslog_fp);
+    reslog_fp = NULL;
+    sem_destroy(&reslog_ready);
+    return 0;
+}
+
+
+int reslog_convert(char *bin_name, char *txt_name)
+// Converting the binary results file bin_name to the text results file txt_name
+{
+    struct reslog_header h;
+    struct reslog_result r;
+
+    FILE *fb = fopen(bin_name, "rb");
+    if (fb == NULL)
+    {
+        printf("Cannot open binary results file %s!\n", bin_name);
+        exit(1);
+    }
+    if (fread(&h, sizeof(h), 1, fb) != 1 || memcmp(h.magic, RESLOG_MAGIC, 8) != 0 || h.N_params != N_PARAMS ||
+        h.N_filters < 0 || h.N_filters > N_FILTERS)
+    {
+        printf("%s is not a binary results file of this model variant!\n", bin_name);
+        exit(1);
+    }
+    long start = sizeof(h);
+    int size = reslog_record_size(h.N_filters);
+    if (!h.keep)
+    {
+        // Only the last complete cycle is the current result:
+        long pos = start, first = start;
+        int flags;
+        while (fseek(fb, pos+sizeof(int), SEEK_SET) == 0 && fread(&flags, sizeof(int), 1, fb) == 1)
+        {
+            if (flags & RESLOG_FIRST)
+                first = pos;
+            if (flags & RESLOG_LAST)
+                start = first;
+            pos = pos + size;
+        }
+    }
+
+    FILE *fp = fopen(txt_name, "w");
+    if (fp == NULL)
+    {
+        printf("Cannot open results file %s!\n", txt_name);
+        exit(1);
+    }
+    fseek(fb, start, SEEK_SET);
+    long N = 0;
+    while (fread(&r.cycle, sizeof(int), 1, fb) == 1 && fread(&r.flags, sizeof(int), 1, fb) == 1 && fread(&r.f, sizeof(double), 1, fb) == 1 &&
+           fread(r.dV, sizeof(double), h.N_filters, fb) == (size_t)h.N_filters && fread(r.params, sizeof(double), N_PARAMS, fb) == (size_t)N_PARAMS)
+    {
+        reslog_text(fp, &r, h.N_filters);
+        N++;
+        if (!h.keep && (r.flags & RESLOG_LAST))
+            break;
+    }
+    fclose(fp);
+    fclose(fb);
+    printf("%ld results converted\n", N);
+    return 0;
+}
+
+#endif // RMSD
+
+END_VARIANT
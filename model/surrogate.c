@@ -0,0 +1,202 @@
+/* Surrogate screening of the random starts, for the CPU build (-surrogate switch).
+ *
+ * Most of the random-start simplex runs of the initial stage end far above the best chi2, and each of them costs up to N_STEPS
+ * simplex steps. With -surrogate, the random starts are screened with a cheap model of "log(chi2 at the end of a simplex run started
+ * at u)", learned as the run proceeds: a Gaussian process regression (squared exponential kernel, length scale = the mean nearest
+ * neighbour distance of the archive points, noise variance SURR_NOISE) over an archive of up to SURR_MAX (start, result) pairs.
+ * The archive is a uniform random sample (reservoir sampling) of all the random-start runs done so far. For every run,
+ * SURR_CANDIDATES random candidate starting points are drawn, and the run starts from the one with the lowest predicted value,
+ * except for every SURR_EXPLORE-th run, which starts from a pure random point (exploration), and until the archive has SURR_MIN
+ * points. The starting points are described by the uniform random numbers u[] which place the initial simplex (simplex_init in cpu.c).
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include "asteroid.h"
+
+BEGIN_VARIANT
+
+#ifdef CPU
+
+#define sProperty dProperty
+
+// The archive (starting points u, log(chi2) of the runs):
+static double surr_u[SURR_MAX][N_PARAMS];
+static double surr_y[SURR_MAX];
+static int surr_N = 0;
+static long long surr_seen = 0;                        // Number of the runs offered to the archive so far
+static unsigned long long surr_state = 0x5DEECE66DULL;  // Random numbers for the reservoir sampling
+// The fitted model (surr_N_fit=0: no screening):
+static double surr_alpha[SURR_MAX];
+static double surr_gamma;                              // 1/(2*length_scale^2)
+static int surr_N_fit = 0;
+
+
+static int surr_used(int i)
+// The coordinates which actually place the initial point (the c, b random numbers are not used in BC mode: c, b start equal to c_tumb, b_tumb)
+{
+    #if defined(BC) && !defined(RANDOM_BC)
+    if (sProperty[i][P_type] == T_c || sProperty[i][P_type] == T_b)
+        return 0;
+    #endif
+    return 1;
+}
+
+
+static double surr_predict(CHI_FLOAT *u)
+// The GP mean prediction of the (normalized) log(chi2) for the starting point u
+{
+    double y = 0.0;
+    for (int j=0; j<surr_N_fit; j++)
+    {
+        double d2 = 0.0;
+        for (int i=0; i<N_PARAMS; i++)
+            if (surr_used(i))
+                d2 = d2 + (u[i]-surr_u[j][i]) * (u[i]-surr_u[j][i]);
+        y = y + surr_alpha[j] * exp(-surr_gamma*d2);
+    }
+    return y;
+}
+
+
+static void surrogate_fit()
+// Fitting the Gaussian process to the archive
+{
+    int n = surr_N;
+    surr_N_fit = 0;
+    if (n < SURR_MIN)
+        return;
+
+    // Squared distances between the archive points, and the mean nearest neighbour distance:
+    double *A = (double *)malloc(n * n * sizeof(double));
+    double nn = 0.0;
+    for (int j=0; j<n; j++)
+    {
+        double dmin = HUGE;
+        for (int k=0; k<n; k++)
+        {
+            double d2 = 0.0;
+            for (int i=0; i<N_PARAMS; i++)
+                if (surr_used(i))
+                    d2 = d2 + (surr_u[j][i]-surr_u[k][i]) * (surr_u[j][i]-surr_u[k][i]);
+            A[j*n+k] = d2;
+            if (k != j && d2 < dmin)
+                dmin = d2;
+        }
+        nn = nn + sqrt(dmin);
+    }
+    nn = nn / n;
+    surr_gamma = 1.0 / (2.0*nn*nn);
+
+    // Normalized targets:
+    double mean = 0.0, var = 0.0;
+    for (int j=0; j<n; j++)
+        mean = mean + surr_y[j];
+    mean = mean / n;
+    for (int j=0; j<n; j++)
+        var = var + (surr_y[j]-mean) * (surr_y[j]-mean);
+    double sigma = sqrt(var / n) + 1e-30;
+    for (int j=0; j<n; j++)
+        surr_alpha[j] = (surr_y[j]-mean) / sigma;
+
+    // Kernel matrix (+ noise), and alpha = K^-1 y:
+    for (int j=0; j<n; j++)
+        for (int k=0; k<n; k++)
+            A[j*n+k] = exp(-surr_gamma*A[j*n+k]) + (j==k? SURR_NOISE : 0.0);
+    if (cholesky(A, n) == 0)
+    {
+        cholesky_solve(A, n, surr_alpha);
+        surr_N_fit = n;
+    }
+    free(A);
+    return;
+}
+
+
+void surrogate_starts(int N_runs, CHI_FLOAT (*u_start)[N_PARAMS], curandState *globalState)
+// Choosing the initial point u_start[id] of each of the N_runs runs (the random numbers of the run id come from globalState[id])
+{
+    #pragma omp parallel for schedule(dynamic)
+    for (int id=0; id<N_runs; id++)
+    {
+        CHI_FLOAT u[N_PARAMS];
+        double y_best = HUGE;
+        int N_cand = surr_N_fit > 0 && id % SURR_EXPLORE != 0? SURR_CANDIDATES : 1;
+        for (int k=0; k<N_cand; k++)
+        {
+            for (int i=0; i<N_PARAMS; i++)
+                // The first candidate is a low-discrepancy point with -start halton:
+                u[i] = k == 0 && d_qmc != START_RANDOM? qmc_x(qmc_index(id), i) : curand_uniform(&globalState[id]);
+            double y = N_cand > 1? surr_predict(u) : 0.0;
+            if (y < y_best)
+            {
+                y_best = y;
+                for (int i=0; i<N_PARAMS; i++)
+                    u_start[id][i] = u[i];
+            }
+        }
+    }
+    return;
+}
+
+
+void surrogate_update(int N_runs, CHI_FLOAT (*u_start)[N_PARAMS], CHI_FLOAT *f_start)
+// Adding the results f_start[id] of the runs started at u_start[id] to the archive (f_start >= 1e29: not a random-start run,
+// or failed), and refitting the model
+{
+    for (int id=0; id<N_runs; id++)
+    {
+        if (!(f_start[id] < 1e29))
+            continue;
+        // Reservoir sampling: every run done so far has the same probability to be in the archive
+        int j;
+        if (surr_N < SURR_MAX)
+            j = surr_N++;
+        else
+        {
+            surr_state = surr_state * 6364136223846793005ULL + 1442695040888963407ULL;
+            j = (surr_state >> 17) % (surr_seen+1);
+        }
+        surr_seen++;
+        if (j >= SURR_MAX)
+            continue;
+        for (int i=0; i<N_PARAMS; i++)
+            surr_u[j][i] = u_start[id][i];
+        surr_y[j] = log(f_start[id]);
+    }
+    surrogate_fit();
+    return;
+}
+
+
+int surrogate_save(FILE *fc)
+// Saving the archive to the checkpoint file (ckpt.c). Returns the number of failed writes.
+{
+    int n_bad = 0;
+    n_bad += fwrite(&surr_N, sizeof(int), 1, fc) != 1;
+    n_bad += fwrite(&surr_seen, sizeof(long long), 1, fc) != 1;
+    n_bad += fwrite(&surr_state, sizeof(unsigned long long), 1, fc) != 1;
+    n_bad += fwrite(surr_u, sizeof(double), surr_N*N_PARAMS, fc) != (size_t)(surr_N*N_PARAMS);
+    n_bad += fwrite(surr_y, sizeof(double), surr_N, fc) != (size_t)surr_N;
+    return n_bad;
+}
+
+
+int surrogate_load(FILE *fc)
+// Restoring the archive from the checkpoint file, and refitting the model. Returns the number of failed reads.
+{
+    int n_bad = 0;
+    n_bad += fread(&surr_N, sizeof(int), 1, fc) != 1;
+    if (n_bad || surr_N < 0 || surr_N > SURR_MAX)
+        return 1;
+    n_bad += fread(&surr_seen, sizeof(long long), 1, fc) != 1;
+    n_bad += fread(&surr_state, sizeof(unsigned long long), 1, fc) != 1;
+    n_bad += fread(surr_u, sizeof(double), surr_N*N_PARAMS, fc) != (size_t)(surr_N*N_PARAMS);
+    n_bad += fread(surr_y, sizeof(double), surr_N, fc) != (size_t)surr_N;
+    surrogate_fit();
+    return n_bad;
+}
+
+#endif // CPU
+
+END_VARIANT
@@ -0,0 +1,135 @@
+/* Driver for the multi-variant binary (make multi / make cpu_multi).
+ *
+ * The model code (asteroid.c etc.) is compiled once for each model variant listed in variants.h, each copy in its own
+ * namespace, so every variant keeps its compile-time specialized chi2one/ODE_func/x2params. Here we only pick the variant
+ * requested with "-model MACRO1,MACRO2,..." and pass the rest of the command line to its main().
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define VARIANT(name, macros) namespace v_##name { int main(int, char **); }
+#include "variants.h"
+#undef VARIANT
+
+struct variant {
+    const char *name;
+    const char *macros;
+    int (*main)(int, char **);
+};
+
+#define VARIANT(name, macros) {#name, macros, v_##name::main},
+static const struct variant variants[] = {
+#include "variants.h"
+};
+#undef VARIANT
+
+const int N_VARIANTS = sizeof(variants) / sizeof(variants[0]);
+// Maximum number of macros in one variant:
+const int MAX_MACROS = 32;
+const int MAX_MACRO_LENGTH = 32;
+
+
+static int split_macros(const char *str, char macros[][MAX_MACRO_LENGTH])
+// Splitting a list of macro names (separated by spaces or commas; optional "-D" prefixes are ignored). Returns the number of macros.
+{
+    int n = 0;
+    const char *p = str;
+    while (*p)
+    {
+        while (*p == ' ' || *p == ',')
+            p++;
+        if (*p == 0)
+            break;
+        if (p[0] == '-' && p[1] == 'D')
+            p += 2;
+        int l = 0;
+        while (*p && *p != ' ' && *p != ',')
+        {
+            if (l < MAX_MACRO_LENGTH-1 && n < MAX_MACROS)
+                macros[n][l++] = *p;
+            p++;
+        }
+        if (n < MAX_MACROS)
+        {
+            macros[n][l] = 0;
+            n++;
+        }
+    }
+    return n;
+}
+
+
+static int same_macros(const char *str1, const char *str2)
+// Returns 1 if the two lists contain the same set of macros
+{
+    char m1[MAX_MACROS][MAX_MACRO_LENGTH], m2[MAX_MACROS][MAX_MACRO_LENGTH];
+    int n1 = split_macros(str1, m1);
+    int n2 = split_macros(str2, m2);
+    if (n1 != n2)
+        return 0;
+    for (int i=0; i<n1; i++)
+    {
+        int found = 0;
+        for (int j=0; j<n2; j++)
+            if (strcmp(m1[i], m2[j]) == 0)
+                found = 1;
+        if (!found)
+            return 0;
+    }
+    return 1;
+}
+
+
+static void list_variants()
+{
+    printf("Available model variants (-model argument):\n");
+    for (int i=0; i<N_VARIANTS; i++)
+        printf("  %s\n", variants[i].macros);
+}
+
+
+int main (int argc, char **argv)
+{
+    char *model = NULL;
+    int batch = 0;
+    int j = 1;
+
+    // Removing "-model MACROS" from the arguments list:
+    for (int i=1; i<argc; i++)
+    {
+        if (strcmp(argv[i], "-model") == 0 && i+1 < argc)
+        {
+            model = argv[++i];
+            continue;
+        }
+        if (strcmp(argv[i], "-batch") == 0)
+            batch = 1;
+        argv[j++] = argv[i];
+    }
+    argc = j;
+    argv[argc] = NULL;
+
+    if (model == NULL && batch)
+        // The batch driver doesn't depend on the model (every job gives its own -model)
+        return variants[0].main(argc, argv);
+
+    if (model == NULL)
+    {
+        printf("Model variant should be given with \"-model MACRO1,MACRO2,...\"\n");
+        list_variants();
+        exit(1);
+    }
+
+    for (int i=0; i<N_VARIANTS; i++)
+        if (strcmp(model, variants[i].name) == 0 || same_macros(model, variants[i].macros))
+        {
+            printf("Model variant: %s\n", variants[i].macros);
+            return variants[i].main(argc, argv);
+        }
+
+    if (strcmp(model, "list") != 0)
+        printf("Model variant \"%s\" is not compiled in (add it to variants.h)\n", model);
+    list_variants();
+    exit(1);
+}
@@ -0,0 +1,16 @@
+/*  Model variants compiled into the multi-variant binary (make multi / make cpu_multi).
+ *
+ *  One line per variant: VARIANT(name, "macros"). The model code is compiled once per line, with -DMACRO for each listed macro,
+ *  in namespace v_name. The variant is selected at run time with the -model option, e.g. -model P_PSI,TORQUE,BC (the order of
+ *  the macros doesn't matter). The makefile reads this file too, so keep one variant per line.
+ */
+
+VARIANT(psi_torque_bc,              "P_PSI TORQUE BC")
+VARIANT(psi_torque,                 "P_PSI TORQUE")
+VARIANT(psi_bc,                     "P_PSI BC")
+VARIANT(psi,                        "P_PSI")
+VARIANT(psi_torque_bw,              "P_PSI TORQUE BW_BALL")
+VARIANT(psi_rect,                   "P_PSI RECT")
+VARIANT(psi_torque2_bc,             "P_PSI TORQUE2 BC")
+VARIANT(psi_torque_trend_bc,        "P_PSI TORQUE TREND BC")
+VARIANT(psi_torque_acc_nudge_interp, "P_PSI TORQUE ACC NUDGE INTERP")